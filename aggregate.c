@@ -0,0 +1,381 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "utils.h"
+
+static const char *fn_names[] = {"last", "min", "max", "avg", "sum"};
+
+static const char *dstype_names[] = {"gauge", "derive", "counter",
+                                     "absolute"};
+
+// Start of the window after now, windows are aligned to the wall clock
+static void next_window(aggregate_t *agg) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    agg->window_end.tv_sec = (now.tv_sec / agg->window + 1) * agg->window;
+    agg->window_end.tv_nsec = 0;
+}
+
+aggregate_t *aggregate_alloc(int window, enum aggregate_fn fn) {
+    aggregate_t *agg = calloc(1, sizeof(aggregate_t));
+
+    agg->window = window;
+    agg->fn = fn;
+    agg->n_slots = AGGREGATE_MIN_SLOTS;
+    agg->slots = calloc(agg->n_slots, sizeof(agg_series_t *));
+    next_window(agg);
+
+    return agg;
+}
+
+int aggregate_fn_parse(const char *name, enum aggregate_fn *fn) {
+    for (int i = 0; i < sizeof(fn_names) / sizeof(fn_names[0]); i++) {
+        if (strcmp(name, fn_names[i]) == 0) {
+            *fn = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int aggregate_due(aggregate_t *agg) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return now.tv_sec > agg->window_end.tv_sec ||
+           (now.tv_sec == agg->window_end.tv_sec &&
+            now.tv_nsec >= agg->window_end.tv_nsec);
+}
+
+static uint32_t series_hash(const collectd_metric_t *m) {
+    const collectd_str_t *names[] = {&m->host, &m->plugin, &m->plugin_instance,
+                                     &m->type, &m->type_instance};
+    uint32_t h = FNV1A_INIT;
+
+    for (int i = 0; i < 5; i++) {
+        // The separator keeps "ab","c" apart from "a","bc"
+        h = fnv1a(h, names[i]->start, names[i]->size);
+        h = fnv1a(h, "", 1);
+    }
+    return h;
+}
+
+static int str_eq(const collectd_str_t *a, const collectd_str_t *b) {
+    return a->size == b->size && memcmp(a->start, b->start, a->size) == 0;
+}
+
+static int series_match(const agg_series_t *s, uint32_t hash,
+                        const collectd_metric_t *m) {
+    return s->hash == hash && str_eq(&s->host, &m->host) &&
+           str_eq(&s->plugin, &m->plugin) &&
+           str_eq(&s->plugin_instance, &m->plugin_instance) &&
+           str_eq(&s->type, &m->type) &&
+           str_eq(&s->type_instance, &m->type_instance);
+}
+
+static void copy_str(char **tail, collectd_str_t *dst,
+                     const collectd_str_t *src) {
+    memcpy(*tail, src->start, src->size);
+    dst->start = *tail;
+    dst->size = src->size;
+    *tail += src->size;
+}
+
+static agg_series_t *series_new(uint32_t hash, const collectd_metric_t *m) {
+    size_t names = m->host.size + m->plugin.size + m->plugin_instance.size +
+                   m->type.size + m->type_instance.size;
+    for (int i = 0; i < m->n_values; i++) {
+        names += m->values[i].dsname.size;
+    }
+    size_t values = m->n_values * sizeof(agg_value_t);
+    agg_series_t *s = calloc(1, sizeof(agg_series_t) + values + names);
+    char *tail = (char *)s->values + values;
+
+    s->hash = hash;
+    s->n_values = m->n_values;
+    copy_str(&tail, &s->host, &m->host);
+    copy_str(&tail, &s->plugin, &m->plugin);
+    copy_str(&tail, &s->plugin_instance, &m->plugin_instance);
+    copy_str(&tail, &s->type, &m->type);
+    copy_str(&tail, &s->type_instance, &m->type_instance);
+    for (int i = 0; i < m->n_values; i++) {
+        agg_value_t *v = &s->values[i];
+
+        v->last.dstype = m->values[i].dstype;
+        copy_str(&tail, &v->last.dsname, &m->values[i].dsname);
+        v->min = INFINITY;
+        v->max = -INFINITY;
+    }
+    return s;
+}
+
+static void grow(aggregate_t *agg) {
+    uint32_t n_slots = agg->n_slots * 2;
+    agg_series_t **slots = calloc(n_slots, sizeof(agg_series_t *));
+
+    for (uint32_t i = 0; i < agg->n_slots; i++) {
+        agg_series_t *s = agg->slots[i];
+        if (s == NULL) {
+            continue;
+        }
+        uint32_t idx = s->hash & (n_slots - 1);
+        while (slots[idx] != NULL) {
+            idx = (idx + 1) & (n_slots - 1);
+        }
+        slots[idx] = s;
+    }
+    free(agg->slots);
+    agg->slots = slots;
+    agg->n_slots = n_slots;
+}
+
+static agg_series_t *series_find(aggregate_t *agg,
+                                 const collectd_metric_t *m) {
+    uint32_t hash = series_hash(m);
+    uint32_t idx = hash & (agg->n_slots - 1);
+
+    for (; agg->slots[idx] != NULL; idx = (idx + 1) & (agg->n_slots - 1)) {
+        if (series_match(agg->slots[idx], hash, m)) {
+            return agg->slots[idx];
+        }
+    }
+    if (agg->n_series + 1 > agg->n_slots / 2) {
+        grow(agg);
+        return series_find(agg, m);
+    }
+    agg->slots[idx] = series_new(hash, m);
+    agg->n_series++;
+
+    return agg->slots[idx];
+}
+
+static double value_double(const collectd_value_t *v) {
+    switch (v->dstype) {
+    case COLLECTD_GAUGE:
+        return v->gauge;
+    case COLLECTD_DERIVE:
+        return v->derive;
+    default:
+        return v->counter;
+    }
+}
+
+static int add_metric(collectd_metric_t *m, void *ctx) {
+    aggregate_t *agg = (aggregate_t *)ctx;
+    agg_series_t *s = series_find(agg, m);
+
+    // A series that changed shape keeps the first one, the sample is lost
+    int same = s->n_values == m->n_values;
+    for (int i = 0; same && i < m->n_values; i++) {
+        same = s->values[i].last.dstype == m->values[i].dstype;
+    }
+    if (!same) {
+        agg->errs++;
+        return 0;
+    }
+    for (int i = 0; i < m->n_values; i++) {
+        agg_value_t *v = &s->values[i];
+        double d = value_double(&m->values[i]);
+
+        v->last.counter = m->values[i].counter; // whole union
+        if (v->last.dstype == COLLECTD_ABSOLUTE) {
+            v->abs_sum += m->values[i].counter;
+        }
+        if (isnan(d)) {
+            continue;
+        }
+        v->n++;
+        v->sum += d;
+        if (d < v->min) {
+            v->min = d;
+        }
+        if (d > v->max) {
+            v->max = d;
+        }
+    }
+    s->time = m->time;
+    s->samples++;
+    agg->samples++;
+
+    return 0;
+}
+
+int aggregate_add(aggregate_t *agg, const char *json, size_t len) {
+    long samples = agg->samples;
+
+    if (collectd_json_parse(json, len, add_metric, agg) < 0) {
+        // Metrics folded before the parse error are kept, only a message
+        // that contributed nothing goes out as it is
+        agg->errs++;
+        return agg->samples == samples ? -1 : 0;
+    }
+    return 0;
+}
+
+// Make room in agg->out for need more bytes at len
+static void out_reserve(aggregate_t *agg, size_t len, size_t need) {
+    size_t size = agg->out_size ? agg->out_size : 4096;
+
+    while (size < len + need) {
+        size *= 2;
+    }
+    if (size != agg->out_size) {
+        agg->out = realloc(agg->out, size);
+        agg->out_size = size;
+    }
+}
+
+static void out_lit(aggregate_t *agg, size_t *len, const char *s) {
+    size_t n = strlen(s);
+
+    out_reserve(agg, *len, n);
+    memcpy(agg->out + *len, s, n);
+    *len += n;
+}
+
+// Append to agg->out at *len, growing it as needed
+static void out_printf(aggregate_t *agg, size_t *len, const char *fmt, ...) {
+    va_list ap;
+
+    while (1) {
+        va_start(ap, fmt);
+        int n = vsnprintf(agg->out + *len, agg->out_size - *len, fmt, ap);
+        va_end(ap);
+        if (n < agg->out_size - *len) {
+            *len += n;
+            return;
+        }
+        agg->out_size = agg->out_size ? agg->out_size * 2 : 4096;
+        agg->out = realloc(agg->out, agg->out_size);
+    }
+}
+
+// The string quoted, the runs that need no escape copied as they are
+static void out_str(aggregate_t *agg, size_t *len, const collectd_str_t *s) {
+    static const char hex[] = "0123456789abcdef";
+    size_t from = 0;
+
+    // Escaped as \u00XX, a byte takes 6
+    out_reserve(agg, *len, s->size * 6 + 2);
+    char *p = agg->out + *len;
+    *p++ = '"';
+    for (size_t i = 0; i < s->size; i++) {
+        unsigned char ch = s->start[i];
+
+        if (ch != '"' && ch != '\\' && ch >= 0x20) {
+            continue;
+        }
+        memcpy(p, s->start + from, i - from);
+        p += i - from;
+        from = i + 1;
+        *p++ = '\\';
+        if (ch < 0x20) {
+            memcpy(p, "u00", 3);
+            p[3] = hex[ch >> 4];
+            p[4] = hex[ch & 0xf];
+            p += 5;
+        } else {
+            *p++ = ch;
+        }
+    }
+    memcpy(p, s->start + from, s->size - from);
+    p += s->size - from;
+    *p++ = '"';
+    *len = p - agg->out;
+}
+
+static void out_value(aggregate_t *agg, size_t *len, const agg_value_t *v) {
+    double d;
+
+    switch (v->last.dstype) {
+    case COLLECTD_DERIVE:
+        out_printf(agg, len, "%ld", (long)v->last.derive);
+        return;
+    case COLLECTD_COUNTER:
+        out_printf(agg, len, "%lu", (unsigned long)v->last.counter);
+        return;
+    case COLLECTD_ABSOLUTE:
+        out_printf(agg, len, "%lu", (unsigned long)v->abs_sum);
+        return;
+    }
+    switch (agg->fn) {
+    case AGG_LAST:
+        d = v->last.gauge;
+        break;
+    case AGG_MIN:
+        d = v->n ? v->min : NAN;
+        break;
+    case AGG_MAX:
+        d = v->n ? v->max : NAN;
+        break;
+    case AGG_SUM:
+        d = v->n ? v->sum : NAN;
+        break;
+    default:
+        d = v->n ? v->sum / v->n : NAN;
+    }
+    if (isnan(d)) {
+        out_printf(agg, len, "null");
+    } else {
+        out_printf(agg, len, "%.15g", d);
+    }
+}
+
+// The series as a one element collectd JSON array
+static size_t series_json(aggregate_t *agg, const agg_series_t *s) {
+    size_t len = 0;
+
+    out_lit(agg, &len, "[{\"values\":[");
+    for (int i = 0; i < s->n_values; i++) {
+        out_lit(agg, &len, i ? "," : "");
+        out_value(agg, &len, &s->values[i]);
+    }
+    out_lit(agg, &len, "],\"dstypes\":[");
+    for (int i = 0; i < s->n_values; i++) {
+        out_lit(agg, &len, i ? ",\"" : "\"");
+        out_lit(agg, &len, dstype_names[s->values[i].last.dstype]);
+        out_lit(agg, &len, "\"");
+    }
+    out_lit(agg, &len, "],\"dsnames\":[");
+    for (int i = 0; i < s->n_values; i++) {
+        out_lit(agg, &len, i ? "," : "");
+        out_str(agg, &len, &s->values[i].last.dsname);
+    }
+    out_printf(agg, &len, "],\"time\":%.3f,\"interval\":%d.000,\"host\":",
+               s->time, agg->window);
+    out_str(agg, &len, &s->host);
+    out_lit(agg, &len, ",\"plugin\":");
+    out_str(agg, &len, &s->plugin);
+    out_lit(agg, &len, ",\"plugin_instance\":");
+    out_str(agg, &len, &s->plugin_instance);
+    out_lit(agg, &len, ",\"type\":");
+    out_str(agg, &len, &s->type);
+    out_lit(agg, &len, ",\"type_instance\":");
+    out_str(agg, &len, &s->type_instance);
+    out_printf(agg, &len, ",\"meta\":{\"samples\":%ld}}]", s->samples);
+
+    return len;
+}
+
+void aggregate_flush(aggregate_t *agg, aggregate_emit_cb cb, void *ctx) {
+    for (uint32_t i = 0; i < agg->n_slots; i++) {
+        agg_series_t *s = agg->slots[i];
+        if (s == NULL) {
+            continue;
+        }
+        size_t len = series_json(agg, s);
+        cb(agg->out, len, ctx);
+        agg->emitted++;
+
+        free(s);
+        agg->slots[i] = NULL;
+    }
+    agg->n_series = 0;
+    next_window(agg);
+}
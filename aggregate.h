@@ -0,0 +1,75 @@
+#ifndef _AGGREGATE_H
+#define _AGGREGATE_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+#include "collectd_json.h"
+
+#define AGGREGATE_MIN_SLOTS 1024 /* power of 2, the table grows at half full */
+
+// Value sent for gauges when a window closes.  Derives and counters are
+// cumulative, they always send the last value, absolutes send the sum.
+enum aggregate_fn { AGG_LAST, AGG_MIN, AGG_MAX, AGG_AVG, AGG_SUM };
+
+typedef struct {
+    collectd_value_t last; // dstype, dsname and the last raw value
+    long n;                // samples that were not NaN
+    double min;
+    double max;
+    double sum;
+    uint64_t abs_sum; // absolute only, kept exact
+} agg_value_t;
+
+// One series, a host/plugin/plugin_instance/type/type_instance, in a single
+// allocation: the struct, n_values agg_value_t, then the string bytes
+typedef struct {
+    uint32_t hash;
+    double time; // of the latest sample
+    long samples;
+    collectd_str_t host;
+    collectd_str_t plugin;
+    collectd_str_t plugin_instance;
+    collectd_str_t type;
+    collectd_str_t type_instance;
+    int n_values;
+    agg_value_t values[];
+} agg_series_t;
+
+// Owned by the sender thread
+typedef struct {
+    int window; // seconds
+    enum aggregate_fn fn;
+    struct timespec window_end; // CLOCK_REALTIME, aligned to the window
+
+    agg_series_t **slots; // open addressing, linear probing
+    uint32_t n_slots;
+    uint32_t n_series;
+
+    char *out; // JSON of the series being emitted
+    size_t out_size;
+
+    // stats
+    volatile long samples;
+    volatile long emitted;
+    volatile long errs; // not collectd JSON, or a series changed shape
+} aggregate_t;
+
+// Called once per series when a window closes, with one collectd JSON
+// message
+typedef int (*aggregate_emit_cb)(const char *json, size_t len, void *ctx);
+
+extern aggregate_t *aggregate_alloc(int window, enum aggregate_fn fn);
+
+extern int aggregate_fn_parse(const char *name, enum aggregate_fn *fn);
+
+// Fold a collectd JSON message into the window, -1 if it is not one
+extern int aggregate_add(aggregate_t *agg, const char *json, size_t len);
+
+// Whether the current window is over
+extern int aggregate_due(aggregate_t *agg);
+
+// Emit every series of the window, then start the next one empty
+extern void aggregate_flush(aggregate_t *agg, aggregate_emit_cb cb, void *ctx);
+
+#endif
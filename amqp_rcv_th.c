@@ -13,38 +13,228 @@
 #include <proton/types.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "bridge.h"
+#include "probes.h"
+#include "socket_snd_th.h"
 
 #define LISTEN_BACKLOG 16
+#define RECONNECT_MIN_MS 100
 
 static int exit_code = 0;
 
+/* Set once we close on purpose, nothing reconnects after that */
+static bool closing = false;
+
+/* --reconnect: failed attempts in a row, when the last connection went
+ * away (CLOCK_MONOTONIC ns, 0 while connected) and the jitter seed */
+static int reconnect_attempt = 0;
+static uint64_t disconnected_at = 0;
+static bool connected = false;
+static unsigned int reconnect_seed;
+
 static time_t start_time;
 
+/* Stage accounting of the proactor thread we are running in */
+static __thread stage_acct_t *rcv_acct;
+
+static char rcv_th_names[MAX_AMQP_THREADS][32];
+
+static long conn_seq = 0;
+
+/* Connection context, what was already counted of its transport */
+typedef struct {
+    uint64_t frames_out;
+} conn_frames_t;
+
 /* Close the connection and the listener so so we will get a
  * PN_PROACTOR_INACTIVE event and exit, once all outstanding events
  * are processed.
  */
 static void close_all(pn_connection_t *c, app_data_t *app) {
+    closing = true;
     if (c)
         pn_connection_close(c);
     if (app->listener)
         pn_listener_close(app->listener);
 }
 
+/* Whether losing the router connection means connecting again */
+static bool reconnecting(app_data_t *app) {
+    return app->reconnect_max_ms > 0 && !app->standalone && !closing;
+}
+
 static void check_condition(pn_event_t *e, pn_condition_t *cond,
                             app_data_t *app) {
     if (pn_condition_is_set(cond)) {
         fprintf(stderr, "%s: %s: %s\n", pn_event_type_name(pn_event_type(e)),
                 pn_condition_get_name(cond),
                 pn_condition_get_description(cond));
+        if (reconnecting(app)) {
+            /* PN_TRANSPORT_CLOSED schedules the next connection */
+            if (pn_event_connection(e))
+                pn_connection_close(pn_event_connection(e));
+            return;
+        }
         close_all(pn_event_connection(e), app);
         exit_code = 1;
     }
 }
 
+/* Add the frames the connection sent since the last call to the stats */
+static void count_frames(app_data_t *app, pn_connection_t *c,
+                         pn_transport_t *t) {
+    conn_frames_t *cf = c ? pn_connection_get_context(c) : NULL;
+
+    if (cf && t) {
+        uint64_t frames = pn_transport_get_frames_output(t);
+        __atomic_add_fetch(&app->amqp_frames_out, frames - cf->frames_out,
+                           __ATOMIC_RELAXED);
+        cf->frames_out = frames;
+    }
+}
+
+static uint64_t rcv_clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Connect to the router, the proactor reports how it went */
+static void connect_router(app_data_t *app) {
+    char addr[PN_MAX_ADDR];
+
+    pn_proactor_addr(addr, sizeof(addr), app->amqp_con.host,
+                     app->amqp_con.port);
+    /* Initialize Sasl transport */
+    pn_transport_t *pnt = pn_transport();
+    pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
+    if (app->verbose > 1) {
+        pn_transport_trace(pnt, PN_TRACE_FRM);
+    }
+    pn_proactor_connect2(app->proactor, NULL, pnt, addr);
+}
+
+/* Try again after an exponential backoff with jitter, so that bridges that
+ * lost the same router do not all come back at once.  What is in the rings
+ * stays there, the sender keeps draining it meanwhile.
+ */
+static void schedule_reconnect(app_data_t *app) {
+    int delay = app->reconnect_max_ms;
+
+    if (reconnect_attempt < 16 &&
+        (RECONNECT_MIN_MS << reconnect_attempt) < delay) {
+        delay = RECONNECT_MIN_MS << reconnect_attempt;
+    }
+    reconnect_attempt++;
+    delay = delay / 2 + rand_r(&reconnect_seed) % (delay / 2 + 1);
+
+    if (connected) {
+        connected = false;
+        disconnected_at = rcv_clock_ns();
+        __atomic_add_fetch(&app->amqp_reconnect_kept,
+                           rb_set_queued(app->lanes), __ATOMIC_RELAXED);
+    }
+    printf("Reconnecting to %s in %dms\n", app->amqp_con.url, delay);
+    fflush(stdout);
+    pn_proactor_set_timeout(app->proactor, delay);
+}
+
+/* The router took us back */
+static void reconnected(app_data_t *app) {
+    connected = true;
+    reconnect_attempt = 0;
+    if (disconnected_at) {
+        uint64_t ns = rcv_clock_ns() - disconnected_at;
+
+        app->amqp_reconnect_last_ns = ns;
+        __atomic_add_fetch(&app->amqp_reconnect_ns, ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&app->amqp_reconnects, 1, __ATOMIC_RELAXED);
+        printf("Reconnected after %.1fms\n", ns / 1e6);
+        disconnected_at = 0;
+    }
+}
+
+/* Whether links for this address ask for pre-settled deliveries */
+static bool presettle_wanted(app_data_t *app, const char *address) {
+    if (app->presettled == NULL) {
+        return false;
+    }
+    return *app->presettled == '\0' ||
+           (address && strstr(address, app->presettled));
+}
+
+/* The --lane address rule of an inbound link, NULL if none matches */
+static lane_rule_t *link_rule(app_data_t *app, pn_link_t *l) {
+    const char *address = pn_terminus_get_address(pn_link_remote_target(l));
+
+    for (int i = 0; address && i < app->n_lane_rules; i++) {
+        lane_rule_t *rule = &app->lane_rules[i];
+        if (rule->address && strstr(address, rule->address)) {
+            return rule;
+        }
+    }
+    return NULL;
+}
+
+/* The lane a link writes to: the shared ring buffer when connected to a
+ * router, a ring of its own for every inbound link in standalone mode.
+ * NULL if there is no room for another lane.
+ */
+static rb_lane_t *link_lane(app_data_t *app, pn_link_t *l) {
+    rb_lane_t *lane = pn_link_get_context(l);
+
+    if (lane == NULL) {
+        if (!app->standalone) {
+            lane = app->lane;
+        } else {
+            lane_rule_t *rule = link_rule(app, l);
+            char name[RB_LANE_NAME_LEN];
+            snprintf(name, sizeof(name), "%s%sconn-%ld/%s",
+                     rule ? rule->name : "", rule ? "/" : "",
+                     __atomic_add_fetch(&conn_seq, 1, __ATOMIC_RELAXED),
+                     pn_link_name(l));
+
+            rb_rwbytes_t *rb = rb_alloc_elastic(
+                rule ? rule->count : app->conn_ring_buffer_count,
+                app->rb_max_count, app->ring_buffer_size, app->amqp_block);
+            if (rb) {
+                rb_set_policy(rb, &app->rb_policy);
+            }
+            lane = rb_set_add_prio(app->lanes, rb, name,
+                                   rule ? rule->prio : RB_LANE_DEFAULT_PRIO,
+                                   rule ? rule->weight : 1);
+            if (lane == NULL) {
+                rb_free(rb);
+                pn_condition_format(pn_link_condition(l),
+                                    "amqp:resource-limit-exceeded",
+                                    "Too many inbound links");
+                pn_link_close(l);
+                return NULL;
+            }
+        }
+        pn_link_set_context(l, lane);
+    }
+    return lane;
+}
+
+/* The shared lane of the first --lane content rule the message matches */
+static rb_lane_t *content_lane(app_data_t *app, const pn_rwbytes_t *m) {
+    for (int i = 0; i < app->n_lane_rules; i++) {
+        lane_rule_t *rule = &app->lane_rules[i];
+        if (rule->content &&
+            memmem(m->start, m->size, rule->content, strlen(rule->content))) {
+            return rule->lane;
+        }
+    }
+    return NULL;
+}
+
 /* This function handles events when we are acting as the receiver */
 static void handle_receive(app_data_t *app, pn_event_t *event,
                            int *batch_done) {
@@ -57,8 +247,16 @@ static void handle_receive(app_data_t *app, pn_event_t *event,
         size_t size = pn_delivery_pending(d);
         bool too_long = false;
 
+        PROBE2(delivery, l, size);
+
+        rb_lane_t *lane = link_lane(app, l);
+        if (lane == NULL) {
+            return;
+        }
+        rb_rwbytes_t *rb = lane->rb;
+
         pn_rwbytes_t *m =
-            rb_get_head(app->rbin); /* Append data to incoming message buffer */
+            rb_get_head(rb); /* Append data to incoming message buffer */
         assert(m);
         ssize_t recv;
         // First time through m->size = 0 for a partial message...
@@ -93,29 +291,64 @@ static void handle_receive(app_data_t *app, pn_event_t *event,
             if (too_long) {
                 m->size = 0; /* Forget the data we accumulated */
             } else {
-                rb_put(app->rbin);
-                app->amqp_received++;
+                pn_rwbytes_t msg = *m;
+                bool kept;
+                rb_lane_t *to = app->n_content_rules ? content_lane(app, m)
+                                                     : NULL;
+                if (to == NULL && app->fair) {
+                    to = fair_lane(app->fair, m->start, m->size);
+                }
+                if (to) {
+                    /* Copied out, the link's own buffer is reused and its
+                     * credit is not touched */
+                    kept = rb_lane_put_copy(to, m);
+                    m->size = 0;
+                } else {
+                    if (!app->inline_mode ||
+                        inline_message(app, lane, *m) < 0) {
+                        kept = rb_put(rb) != NULL;
+                    } else {
+                        kept = true;
+                        m->size = 0; /* Sent, reuse the buffer */
+                    }
+                    lane->received++;
+                }
+                /* Only what goes on, a replay must not send what the ring
+                 * dropped.  The buffer stays ours until our next put. */
+                if (kept && app->capture) {
+                    capture_write(app->capture, msg.start, msg.size);
+                }
+                __atomic_add_fetch(&app->amqp_received, 1, __ATOMIC_RELAXED);
             }
 
-            pn_delivery_update(d, PN_ACCEPTED);
+            if (pn_delivery_settled(d)) {
+                /* Pre-settled by the sender, no disposition goes back */
+                __atomic_add_fetch(&app->amqp_presettled, 1,
+                                   __ATOMIC_RELAXED);
+            } else {
+                pn_delivery_update(d, PN_ACCEPTED);
+            }
             pn_delivery_settle(d); /* settle and free d */
 
             int link_credit = pn_link_credit(l);
-            app->link_credit += link_credit;
-            int free = rb_free_size(app->rbin);
+            __atomic_add_fetch(&app->link_credit, link_credit,
+                               __ATOMIC_RELAXED);
+            int free = rb_free_size(rb);
             if (free == 0 && app->amqp_block) {
-                pthread_mutex_lock(&app->rbin->rb_mutex);
-                pthread_cond_wait(&app->rbin->rb_free, &app->rbin->rb_mutex);
-                pthread_mutex_unlock(&app->rbin->rb_mutex);
-                free = rb_free_size(app->rbin);
+                pthread_mutex_lock(&rb->rb_mutex);
+                pthread_cond_wait(&rb->rb_free, &rb->rb_mutex);
+                pthread_mutex_unlock(&rb->rb_mutex);
+                free = rb_free_size(rb);
             }
             if (!app->amqp_block) {
                 free++;
             }
             int credit = free - link_credit;
             if (credit > 0) {
+                PROBE2(credit, l, credit);
                 pn_link_flow(l, credit);
             }
+            lane->credit = pn_link_credit(l);
             if ((app->message_count > 0) &&
                 (app->sock_sent >= app->message_count)) {
                 close_all(pn_event_connection(event), app);
@@ -123,7 +356,7 @@ static void handle_receive(app_data_t *app, pn_event_t *event,
                 exit_code = 1;
             }
         } else {
-            app->amqp_partial++;
+            __atomic_add_fetch(&app->amqp_partial, 1, __ATOMIC_RELAXED);
         }
     }
 }
@@ -136,7 +369,11 @@ static bool handle(app_data_t *app, pn_event_t *event, int *batch_done) {
     case PN_DELIVERY: {
         pn_link_t *l = pn_event_link(event);
         if (l) { /* Only delegate link-related events */
+            stage_switch(rcv_acct, STAGE_DELIVERY);
             handle_receive(app, event, batch_done);
+            count_frames(app, pn_event_connection(event),
+                         pn_event_transport(event));
+            stage_switch(rcv_acct, STAGE_EVENTS);
         }
         break;
     }
@@ -159,17 +396,82 @@ static bool handle(app_data_t *app, pn_event_t *event, int *batch_done) {
         }
         pn_connection_t *c = pn_event_connection(event);
         pn_connection_set_container(c, app->container_id);
+        pn_connection_set_context(c, calloc(1, sizeof(conn_frames_t)));
         pn_connection_open(c);
         pn_session_t *s = pn_session(c);
         pn_session_open(s);
         {
             pn_link_t *l = pn_receiver(s, "sa_receiver");
             pn_terminus_set_address(pn_link_source(l), app->amqp_con.address);
-            pn_link_open(l);
-            /* cannot receive without granting credit: */
-            pn_link_flow(l, rb_free_size(app->rbin));
+            if (presettle_wanted(app, app->amqp_con.address)) {
+                /* At most once: no dispositions, checked on the attach */
+                pn_link_set_snd_settle_mode(l, PN_SND_SETTLED);
+                pn_link_set_rcv_settle_mode(l, PN_RCV_FIRST);
+            }
+            rb_lane_t *lane = link_lane(app, l);
+            if (lane) {
+                /* A delivery the last connection cut short never ends */
+                pn_rwbytes_t *m = rb_get_head(lane->rb);
+                if (m) {
+                    m->size = 0;
+                }
+                pn_link_open(l);
+                /* cannot receive without granting credit, all of the free
+                 * space at once even when reconnecting to a full ring.
+                 * Blocking, no delivery would come to replenish 0 credit,
+                 * wait for room like a delivery into a full ring does: */
+                rb_rwbytes_t *rb = lane->rb;
+                int credit = rb_free_size(rb);
+                if (credit == 0 && app->amqp_block) {
+                    /* --control may turn blocking off meanwhile, nothing
+                     * wakes a wait for room after that */
+                    pthread_mutex_lock(&rb->rb_mutex);
+                    while ((credit = rb_free_size(rb)) == 0 &&
+                           app->amqp_block) {
+                        pthread_cond_wait(&rb->rb_free, &rb->rb_mutex);
+                    }
+                    pthread_mutex_unlock(&rb->rb_mutex);
+                }
+                pn_link_flow(l, credit ? credit : 1);
+            }
+        }
+        break;
+
+    case PN_LINK_REMOTE_OPEN: {
+        /* Links attached by the peer, in standalone mode */
+        pn_link_t *l = pn_event_link(event);
+        if (pn_link_is_receiver(l) &&
+            (pn_link_state(l) & PN_LOCAL_UNINIT)) {
+            rb_lane_t *lane = link_lane(app, l);
+            if (lane) {
+                /* The sender decides, echo what it settles */
+                pn_link_set_snd_settle_mode(l,
+                                            pn_link_remote_snd_settle_mode(l));
+                pn_link_open(l);
+                pn_link_flow(l, rb_free_size(lane->rb));
+            }
+        } else if (pn_link_is_receiver(l) &&
+                   pn_link_snd_settle_mode(l) == PN_SND_SETTLED &&
+                   pn_link_remote_snd_settle_mode(l) != PN_SND_SETTLED) {
+            /* Deliveries that come unsettled are accepted as usual */
+            printf("%s: pre-settled deliveries refused, settling each one\n",
+                   pn_link_name(l));
+            __atomic_add_fetch(&app->amqp_presettle_refused, 1,
+                               __ATOMIC_RELAXED);
         }
         break;
+    }
+
+    case PN_LINK_FINAL: {
+        /* Hand the lane to the consumer, it frees it once drained */
+        pn_link_t *l = pn_event_link(event);
+        rb_lane_t *lane = pn_link_get_context(l);
+        if (lane && lane != app->lane) {
+            pn_link_set_context(l, NULL);
+            rb_lane_close(lane);
+        }
+        break;
+    }
 
     case PN_CONNECTION_BOUND: {
         if (app->verbose) {
@@ -194,6 +496,9 @@ static bool handle(app_data_t *app, pn_event_t *event, int *batch_done) {
         }
         pn_connection_open(pn_event_connection(event)); /* Complete the open */
         printf("%s ==> (%s)\n", app->container_id, app->amqp_con.url);
+        if (!app->standalone) {
+            reconnected(app);
+        }
         break;
     }
 
@@ -212,9 +517,13 @@ static bool handle(app_data_t *app, pn_event_t *event, int *batch_done) {
         if (app->verbose) {
             printf("PN_SESSION_INIT %s\n", app->container_id);
         }
-        pn_session_set_incoming_capacity(pn_event_session(event),
-                                         app->ring_buffer_size *
-                                             app->ring_buffer_count);
+        // Room for what the ring can grow to, credit keeps it in check
+        pn_session_set_incoming_capacity(
+            pn_event_session(event),
+            (size_t)app->ring_buffer_size *
+                (app->rb_max_count > app->ring_buffer_count
+                     ? app->rb_max_count
+                     : app->ring_buffer_count));
         pn_session_set_outgoing_window(pn_event_session(event),
                                        app->ring_buffer_count);
         break;
@@ -228,10 +537,22 @@ static bool handle(app_data_t *app, pn_event_t *event, int *batch_done) {
     }
 
     case PN_TRANSPORT_CLOSED:
+        count_frames(app, pn_event_connection(event),
+                     pn_event_transport(event));
         check_condition(event,
                         pn_transport_condition(pn_event_transport(event)), app);
+        if (reconnecting(app)) {
+            schedule_reconnect(app);
+        }
         break;
 
+    case PN_CONNECTION_FINAL: {
+        pn_connection_t *c = pn_event_connection(event);
+        free(pn_connection_get_context(c));
+        pn_connection_set_context(c, NULL);
+        break;
+    }
+
     case PN_CONNECTION_REMOTE_CLOSE:
         check_condition(
             event, pn_connection_remote_condition(pn_event_connection(event)),
@@ -255,6 +576,9 @@ static bool handle(app_data_t *app, pn_event_t *event, int *batch_done) {
         break;
 
     case PN_PROACTOR_TIMEOUT:
+        if (reconnecting(app)) {
+            connect_router(app);
+        }
         break;
 
     case PN_LISTENER_CLOSE:
@@ -264,6 +588,7 @@ static bool handle(app_data_t *app, pn_event_t *event, int *batch_done) {
         break;
 
     case PN_PROACTOR_INACTIVE:
+    case PN_PROACTOR_INTERRUPT:
         return false;
         break;
 
@@ -274,18 +599,26 @@ static bool handle(app_data_t *app, pn_event_t *event, int *batch_done) {
     return exit_code == 0;
 }
 
-void run(app_data_t *app) {
+void run(app_data_t *app, int th_index) {
     /* Loop and handle events */
     int batch_done = 0;
 
-    start_time = clock();
+    rcv_acct = &app->rcv_acct[th_index];
+    snprintf(rcv_th_names[th_index], sizeof(rcv_th_names[th_index]),
+             th_index ? "amqp_rcv_th/%d" : "amqp_rcv_th", th_index);
+    stage_start(rcv_acct, rcv_th_names[th_index], STAGE_EVENTS);
 
     do {
         batch_done = 0;
+        stage_switch(rcv_acct, STAGE_PROACTOR_WAIT);
         pn_event_batch_t *events = pn_proactor_wait(app->proactor);
+        stage_switch(rcv_acct, STAGE_EVENTS);
+        PROBE(batch_start);
         pn_event_t *e;
+        int n_events = 0;
         for (e = pn_event_batch_next(events); e;
              e = pn_event_batch_next(events)) {
+            n_events++;
             if (!handle(app, e, &batch_done)) {
                 return;
             }
@@ -293,12 +626,29 @@ void run(app_data_t *app) {
                 break;
             }
         }
+        PROBE1(batch_end, n_events);
 
-        app->amqp_total_batches++;
+        __atomic_add_fetch(&app->amqp_total_batches, 1, __ATOMIC_RELAXED);
         pn_proactor_done(app->proactor, events);
     } while (true);
 }
 
+typedef struct {
+    app_data_t *app;
+    int th_index;
+} run_arg_t;
+
+/* Additional proactor threads, --amqp_threads */
+static void *amqp_run_th(void *arg_ptr) {
+    run_arg_t *arg = (run_arg_t *)arg_ptr;
+
+    run(arg->app, arg->th_index);
+    /* Pass the exit on to the next thread */
+    pn_proactor_interrupt(arg->app->proactor);
+
+    return NULL;
+}
+
 double amqp_rcv_clock() {
     time_t stop_time = clock();
 
@@ -320,28 +670,36 @@ void *amqp_rcv_th(void *app_ptr) {
 
     app_data_t *app = (app_data_t *)app_ptr;
 
-    char addr[PN_MAX_ADDR];
-
     /* Create the proactor and connect */
     app->proactor = pn_proactor();
+    reconnect_seed = time(NULL) ^ getpid();
     if (app->standalone) {
+        char addr[PN_MAX_ADDR];
+
         app->listener = pn_listener();
-    }
-    pn_proactor_addr(addr, sizeof(addr), app->amqp_con.host,
-                     app->amqp_con.port);
-    if (app->standalone) {
+        pn_proactor_addr(addr, sizeof(addr), app->amqp_con.host,
+                         app->amqp_con.port);
         pn_proactor_listen(app->proactor, app->listener, addr, LISTEN_BACKLOG);
     } else {
-        /* Initialize Sasl transport */
-        pn_transport_t *pnt = pn_transport();
-        pn_sasl_set_allow_insecure_mechs(pn_sasl(pnt), true);
-        if (app->verbose > 1) {
-            pn_transport_trace(pnt, PN_TRACE_FRM);
-        }
-        pn_proactor_connect2(app->proactor, NULL, pnt, addr);
+        connect_router(app);
     }
 
-    run(app);
+    start_time = clock();
+
+    pthread_t run_th[MAX_AMQP_THREADS];
+    run_arg_t run_args[MAX_AMQP_THREADS];
+    for (int i = 1; i < app->amqp_threads; i++) {
+        run_args[i].app = app;
+        run_args[i].th_index = i;
+        pthread_create(&run_th[i], NULL, amqp_run_th, &run_args[i]);
+    }
+
+    run(app, 0);
+
+    pn_proactor_interrupt(app->proactor);
+    for (int i = 1; i < app->amqp_threads; i++) {
+        pthread_join(run_th[i], NULL);
+    }
 
     pn_proactor_free(app->proactor);
 
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Compare --inline with the threaded sender: the same load through a
+# standalone bridge started either way, latency and the bridge's CPU time
+# per message side by side.
+#
+# usage: benches/inline.sh [messages] [msgs/s] [body bytes]
+#
+# Run from a checkout with qpid-proton installed, port 5673 free.
+set -e
+
+cd "$(dirname "$0")/.."
+make bridge benches/inline_bench >/dev/null
+
+COUNT=${1:-100000}
+RATE=${2:-10000}
+SIZE=${3:-300}
+PORT=5673
+GW=/tmp/inline_bench
+
+for mode in "" "--inline"; do
+    ./bridge --standalone --amqp_url "amqp://127.0.0.1:$PORT/collectd/bench" \
+        --gw_unix="$GW" $mode >/dev/null &
+    pid=$!
+    sleep 1
+    printf '%-10s ' "${mode:-threaded}"
+    benches/inline_bench -p "$pid" -a "127.0.0.1:$PORT" -g "$GW" \
+        -n "$COUNT" -r "$RATE" -s "$SIZE" || true
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+done
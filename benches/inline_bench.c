@@ -0,0 +1,329 @@
+// Measure --inline against the threaded sender, end to end through a
+// running bridge
+//
+// usage: inline_bench -p bridge_pid [-a host:port] [-t address]
+//                     [-g gw_unix_path] [-n messages] [-r msgs/s] [-s bytes]
+//
+// Sends pre-settled messages with a binary body of -s bytes to a bridge in
+// --standalone mode, at -r messages per second (0 for as fast as credit
+// allows).  Every body starts with the CLOCK_MONOTONIC ns it was sent at,
+// and the unix socket the bridge sends to (--gw_unix) reads them back, so
+// the latency covers the AMQP receive, the handoff and the send.  The
+// bridge's CPU time per message comes from /proc/pid/stat.
+//
+// benches/inline.sh runs it against the bridge with and without --inline.
+
+#define _GNU_SOURCE
+#include <proton/connection.h>
+#include <proton/delivery.h>
+#include <proton/link.h>
+#include <proton/message.h>
+#include <proton/proactor.h>
+#include <proton/session.h>
+#include <proton/transport.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BODY_MAX 4096
+#define IDLE_S 2 /* no datagram for that long after the last send ends it */
+
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *address;
+    const char *gw_unix;
+    long count;
+    double rate;
+    size_t size;
+    pid_t pid;
+
+    pn_proactor_t *proactor;
+    pn_link_t *sender;
+    pn_message_t *msg;
+    uint64_t start;
+    long sent;
+    volatile bool sending; // cleared once the last message went
+
+    int sock;
+    uint64_t *lat_ns; // per message received
+    long received;
+} bench_t;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// utime + stime of the process, all of its threads, in us
+static double cpu_us(pid_t pid) {
+    char path[64];
+    unsigned long utime, stime;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    // Fields 14 and 15, after the command in parentheses
+    int n = fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                      "%lu %lu",
+                   &utime, &stime);
+    fclose(f);
+    if (n != 2) {
+        fprintf(stderr, "%s: unexpected format\n", path);
+        exit(1);
+    }
+    return (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+}
+
+static int open_gw(bench_t *b) {
+    struct sockaddr_un name = {.sun_family = AF_UNIX};
+    struct timeval idle = {.tv_sec = IDLE_S};
+
+    if (strlen(b->gw_unix) >= sizeof(name.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", b->gw_unix);
+        return -1;
+    }
+    strcpy(name.sun_path, b->gw_unix);
+    unlink(b->gw_unix);
+    b->sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (b->sock == -1 ||
+        bind(b->sock, (struct sockaddr *)&name, sizeof(name)) == -1) {
+        perror(b->gw_unix);
+        return -1;
+    }
+    setsockopt(b->sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    return 0;
+}
+
+// Read back what the bridge sends, until everything came or it went quiet
+static void *receiver(void *arg) {
+    bench_t *b = arg;
+    char buf[BODY_MAX + 64];
+
+    while (b->received < b->count) {
+        ssize_t len = recv(b->sock, buf, sizeof(buf) - 1, 0);
+        uint64_t now = clock_ns();
+
+        if (len < 0) {
+            if (!b->sending) {
+                break;
+            }
+            continue;
+        }
+        buf[len] = '\0';
+        if (strncmp(buf, "{\"t\":", 5) == 0) {
+            b->lat_ns[b->received++] = now - strtoull(buf + 5, NULL, 10);
+        }
+    }
+    return NULL;
+}
+
+static void send_one(bench_t *b) {
+    char body[BODY_MAX];
+    static char encoded[BODY_MAX + 64];
+    size_t size = sizeof(encoded);
+
+    int len = snprintf(body, sizeof(body), "{\"t\":%020llu,\"pad\":\"",
+                       (unsigned long long)clock_ns());
+    while ((size_t)len < b->size - 2) {
+        body[len++] = 'x';
+    }
+    body[len++] = '"';
+    body[len++] = '}';
+
+    pn_message_clear(b->msg);
+    pn_data_put_binary(pn_message_body(b->msg), pn_bytes(len, body));
+    if (pn_message_encode(b->msg, encoded, &size) != 0) {
+        fprintf(stderr, "encode failed\n");
+        exit(1);
+    }
+    pn_delivery_t *d = pn_delivery(
+        b->sender, pn_dtag((const char *)&b->sent, sizeof(b->sent)));
+    pn_link_send(b->sender, encoded, size);
+    pn_link_advance(b->sender);
+    pn_delivery_settle(d);
+    b->sent++;
+}
+
+// Send what is due by now, as far as credit goes
+static void send_due(bench_t *b) {
+    long due = b->count;
+
+    if (b->sender == NULL || !b->sending) {
+        return;
+    }
+    if (b->rate > 0) {
+        due = (clock_ns() - b->start) / 1e9 * b->rate;
+        due = due > b->count ? b->count : due;
+    }
+    while (b->sent < due && pn_link_credit(b->sender) > 0) {
+        send_one(b);
+    }
+    if (b->sent == b->count) {
+        b->sending = false;
+        pn_connection_close(pn_session_connection(pn_link_session(b->sender)));
+    }
+}
+
+// False once the connection is gone
+static bool handle(bench_t *b, pn_event_t *event) {
+    switch (pn_event_type(event)) {
+    case PN_CONNECTION_INIT: {
+        pn_connection_t *c = pn_event_connection(event);
+        pn_connection_set_container(c, "inline_bench");
+        pn_connection_open(c);
+        pn_session_t *s = pn_session(c);
+        pn_session_open(s);
+        b->sender = pn_sender(s, "inline_bench");
+        pn_terminus_set_address(pn_link_target(b->sender), b->address);
+        pn_link_set_snd_settle_mode(b->sender, PN_SND_SETTLED);
+        pn_link_open(b->sender);
+        b->start = clock_ns();
+        pn_proactor_set_timeout(b->proactor, 1);
+        break;
+    }
+    case PN_LINK_FLOW:
+        send_due(b);
+        break;
+    case PN_PROACTOR_TIMEOUT:
+        send_due(b);
+        if (b->sending) {
+            pn_proactor_set_timeout(b->proactor, 1);
+        }
+        break;
+    case PN_TRANSPORT_CLOSED:
+        if (b->sending) {
+            fprintf(stderr, "connection lost after %ld messages\n", b->sent);
+            b->sending = false;
+        }
+        return false;
+    default:
+        break;
+    }
+    return true;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double pct_us(bench_t *b, double pct) {
+    long i = b->received * pct / 100;
+
+    return b->lat_ns[i < b->received ? i : b->received - 1] / 1e3;
+}
+
+int main(int argc, char **argv) {
+    bench_t b = {.host = "127.0.0.1",
+                 .port = "5672",
+                 .address = "collectd/bench",
+                 .gw_unix = "/tmp/inline_bench",
+                 .count = 100000,
+                 .rate = 10000,
+                 .size = 300,
+                 .sending = true};
+    char addr[PN_MAX_ADDR];
+    char *colon;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:t:g:n:r:s:p:")) != -1) {
+        switch (opt) {
+        case 'a':
+            b.host = optarg;
+            if ((colon = strrchr(optarg, ':')) != NULL) {
+                *colon = '\0';
+                b.port = colon + 1;
+            }
+            break;
+        case 't':
+            b.address = optarg;
+            break;
+        case 'g':
+            b.gw_unix = optarg;
+            break;
+        case 'n':
+            b.count = atol(optarg);
+            break;
+        case 'r':
+            b.rate = atof(optarg);
+            break;
+        case 's':
+            b.size = atol(optarg);
+            break;
+        case 'p':
+            b.pid = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s -p bridge_pid [-a host:port] [-t address] "
+                    "[-g gw_unix_path] [-n messages] [-r msgs/s] "
+                    "[-s bytes]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (b.pid <= 0 || b.count <= 0 || b.size < 32 || b.size > BODY_MAX) {
+        fprintf(stderr, "-p is required, -n must be positive and -s "
+                        "32..%d\n",
+                BODY_MAX);
+        return 1;
+    }
+    b.lat_ns = malloc(b.count * sizeof(uint64_t));
+    b.msg = pn_message();
+    if (b.lat_ns == NULL || open_gw(&b) == -1) {
+        return 1;
+    }
+
+    pthread_t th;
+    pthread_create(&th, NULL, receiver, &b);
+    double cpu = cpu_us(b.pid);
+
+    b.proactor = pn_proactor();
+    pn_proactor_addr(addr, sizeof(addr), b.host, b.port);
+    pn_proactor_connect2(b.proactor, NULL, NULL, addr);
+    for (bool run = true; run;) {
+        pn_event_batch_t *events = pn_proactor_wait(b.proactor);
+        pn_event_t *e;
+
+        while (run && (e = pn_event_batch_next(events)) != NULL) {
+            run = handle(&b, e);
+        }
+        pn_proactor_done(b.proactor, events);
+    }
+    pthread_join(th, NULL);
+    cpu = cpu_us(b.pid) - cpu;
+
+    if (b.received == 0) {
+        fprintf(stderr, "nothing came back on %s\n", b.gw_unix);
+        return 1;
+    }
+    qsort(b.lat_ns, b.received, sizeof(uint64_t), cmp_u64);
+    printf("sent %ld, received %ld, latency us p50 %.1f p99 %.1f max %.1f, "
+           "bridge CPU %.2f us/msg\n",
+           b.sent, b.received, pct_us(&b, 50), pct_us(&b, 99),
+           pct_us(&b, 100), cpu / b.received);
+
+    pn_proactor_free(b.proactor);
+    pn_message_free(b.msg);
+    close(b.sock);
+    unlink(b.gw_unix);
+    free(b.lat_ns);
+
+    return 0;
+}
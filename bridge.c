@@ -21,16 +21,21 @@
 #include <proton/transport.h>
 #include <pthread.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "amqp_rcv_th.h"
+#include "control_th.h"
 #include "rb.h"
+#include "replay_th.h"
+#include "synth_th.h"
 #include "socket_snd_th.h"
 #include "utils.h"
 
@@ -51,6 +56,49 @@ enum program_args {
     ARG_RING_BUFFER_SIZE,
     ARG_VERBOSE,
     ARG_AMQP_BLOCK,
+    ARG_STATS_SHM,
+    ARG_GW_SHM,
+    ARG_SHM_RING_FILE,
+    ARG_SHM_RING_SIZE,
+    ARG_CAPTURE,
+    ARG_REPLAY,
+    ARG_REPLAY_SPEED,
+    ARG_AMQP_THREADS,
+    ARG_CONN_RING_BUFFER_COUNT,
+    ARG_PASSTHROUGH,
+    ARG_PASSTHROUGH_HEADER,
+    ARG_TRANSCODE,
+    ARG_AGGREGATE,
+    ARG_AGGREGATE_FN,
+    ARG_LANE,
+    ARG_LANE_SCHED,
+    ARG_FAIR_KEY,
+    ARG_FAIR_QUEUE,
+    ARG_DROP_POLICY,
+    ARG_DROP_SAMPLE,
+    ARG_DROP_WATERMARK,
+    ARG_DROP_TTL,
+    ARG_DROP_EXPIRED,
+    ARG_INLINE,
+    ARG_UDP_GSO,
+    ARG_UDP_GSO_PAD,
+    ARG_RESOLVE_PERIOD,
+    ARG_SEQ_HEADER,
+    ARG_RB_MEM_MAX,
+    ARG_PACE,
+    ARG_PACE_BYTES,
+    ARG_PACE_BURST,
+    ARG_PRESETTLED,
+    ARG_RECONNECT,
+    ARG_CONTROL,
+    ARG_RB_FILE,
+    ARG_SOURCE,
+    ARG_SYNTHETIC_RATE,
+    ARG_SINK,
+    ARG_OSLO_UNWRAP,
+    ARG_DEDUP,
+    ARG_DEDUP_KEY,
+    ARG_DEDUP_MAX,
     ARG_HELP
 };
 
@@ -74,6 +122,19 @@ struct option_info option_info[] = {
      "host[:port]",
      "Connect to gateway with inet socket (%s)",
      DEFAULT_INET_TARGET},
+    {{"gw_shm", optional_argument, 0, ARG_GW_SHM},
+     "/path/to/socket",
+     "Write to gateway through a shared memory ring, handed over this socket "
+     "(%s)",
+     DEFAULT_SHM_RING_SOCKET_PATH},
+    {{"shm_ring_file", required_argument, 0, ARG_SHM_RING_FILE},
+     "/dev/shm/name",
+     "Back the shared memory ring with a named file instead of a memfd",
+     ""},
+    {{"shm_ring_size", required_argument, 0, ARG_SHM_RING_SIZE},
+     "bytes",
+     "Size of the shared memory ring data area (%s)",
+     DEFAULT_SHM_RING_SIZE},
     {{"block", no_argument, 0, ARG_BLOCK},
      "",
      "Outgoing socket connection will block (%s)",
@@ -82,14 +143,34 @@ struct option_info option_info[] = {
      "4096",
      "Number of message buffers between AMQP and Outgoing (%s)",
      DEFAULT_RING_BUFFER_COUNT},
+    {{"conn_rbc", required_argument, 0, ARG_CONN_RING_BUFFER_COUNT},
+     "1024",
+     "Number of message buffers per inbound link in standalone mode (%s)",
+     DEFAULT_CONN_RING_BUFFER_COUNT},
     {{"rbs", required_argument, 0, ARG_RING_BUFFER_SIZE},
      "2048",
      "Size of a message buffer between AMQP and Outgoing (%s)",
      DEFAULT_RING_BUFFER_SIZE},
+    {{"rb_file", required_argument, 0, ARG_RB_FILE},
+     "/var/lib/sg-bridge/ring",
+     "Keep the ring buffer in this file, sent on restart what it still holds",
+     ""},
+    {{"rb_mem_max", required_argument, 0, ARG_RB_MEM_MAX},
+     "MB",
+     "Let all ring buffers together grow to this, 0 for fixed size",
+     ""},
     {{"stat_period", required_argument, 0, ARG_STAT_PERIOD},
      "period_in_seconds",
      "How often to print stats, 0 for no stats (%s)",
      DEFAULT_STATS_PERIOD},
+    {{"standalone", no_argument, 0, ARG_STANDALONE},
+     "",
+     "Listen on the AMQP URL for inbound connections",
+     ""},
+    {{"amqp_threads", required_argument, 0, ARG_AMQP_THREADS},
+     "threads",
+     "Number of threads running the AMQP proactor (%s)",
+     DEFAULT_AMQP_THREADS},
     {{"cid", required_argument, 0, ARG_CID},
      "connection_id",
      "AMQP container ID (should be unique) (%s)",
@@ -106,6 +187,154 @@ struct option_info option_info[] = {
      "",
      "Stop reading incoming messages if the buffer is full (%s)",
      DEFAULT_AMQP_BLOCK},
+    {{"stats_shm", optional_argument, 0, ARG_STATS_SHM},
+     "/dev/shm/name",
+     "Publish stats in a shared memory file (%s)",
+     DEFAULT_STATS_SHM_PATH},
+    {{"capture", required_argument, 0, ARG_CAPTURE},
+     "/path/to/file",
+     "Record every received AMQP message to a capture file",
+     ""},
+    {{"replay", required_argument, 0, ARG_REPLAY},
+     "/path/to/file",
+     "Replay a capture file instead of connecting to AMQP",
+     ""},
+    {{"source", required_argument, 0, ARG_SOURCE},
+     "amqp|synthetic",
+     "Where messages come from, synthetic generates collectd messages (%s)",
+     DEFAULT_SOURCE},
+    {{"synthetic_rate", required_argument, 0, ARG_SYNTHETIC_RATE},
+     "msgs/s",
+     "Rate of the synthetic source, 0 for as fast as the sender goes (%s)",
+     DEFAULT_SYNTHETIC_RATE},
+    {{"sink", required_argument, 0, ARG_SINK},
+     "socket|null",
+     "Where messages go, null decodes them but sends nothing (%s)",
+     DEFAULT_SINK},
+    {{"replay_speed", required_argument, 0, ARG_REPLAY_SPEED},
+     "factor",
+     "Replay speed relative to the recording, 0 for maximum (%s)",
+     DEFAULT_REPLAY_SPEED},
+    {{"passthrough", no_argument, 0, ARG_PASSTHROUGH},
+     "",
+     "Forward raw AMQP messages without decoding them",
+     ""},
+    {{"passthrough_header", no_argument, 0, ARG_PASSTHROUGH_HEADER},
+     "",
+     "Prefix passthrough messages with a header naming their link",
+     ""},
+    {{"transcode", no_argument, 0, ARG_TRANSCODE},
+     "",
+     "Send collectd JSON as compact binary records (see transcode.h)",
+     ""},
+    {{"oslo_unwrap", no_argument, 0, ARG_OSLO_UNWRAP},
+     "",
+     "Send only the payload of oslo.messaging envelopes (ceilometer)",
+     ""},
+    {{"dedup", required_argument, 0, ARG_DEDUP},
+     "seconds",
+     "Drop messages seen before within this window, for redundant routers",
+     ""},
+    {{"dedup_key", required_argument, 0, ARG_DEDUP_KEY},
+     "body|id",
+     "What makes messages the same, the AMQP message id or the body (%s)",
+     DEFAULT_DEDUP_KEY},
+    {{"dedup_max", required_argument, 0, ARG_DEDUP_MAX},
+     "messages",
+     "Messages --dedup remembers per window, 32 to 64 bytes each (%s)",
+     DEFAULT_DEDUP_MAX},
+    {{"aggregate", required_argument, 0, ARG_AGGREGATE},
+     "seconds",
+     "Send collectd metrics once per window, one message per series",
+     ""},
+    {{"aggregate_fn", required_argument, 0, ARG_AGGREGATE_FN},
+     "last|min|max|avg|sum",
+     "Value sent for aggregated gauges (%s)",
+     DEFAULT_AGGREGATE_FN},
+    {{"lane", required_argument, 0, ARG_LANE},
+     "name=N,prio=P,weight=W,rbc=C,address=A|content=S",
+     "Priority lane for links by address or messages by content (repeatable)",
+     ""},
+    {{"lane_sched", required_argument, 0, ARG_LANE_SCHED},
+     "strict|weighted|fair",
+     "How the sender picks between lanes (%s)",
+     DEFAULT_LANE_SCHED},
+    {{"fair_key", required_argument, 0, ARG_FAIR_KEY},
+     "key",
+     "A lane per source named by this JSON field (host for collectd), "
+     "served fairly, lane prio is ignored, not with --amqp_block",
+     ""},
+    {{"fair_queue", required_argument, 0, ARG_FAIR_QUEUE},
+     "count",
+     "Number of message buffers per --fair_key source (%s)",
+     DEFAULT_FAIR_QUEUE},
+    {{"drop_policy", required_argument, 0, ARG_DROP_POLICY},
+     "newest|oldest",
+     "Which messages a full ring buffer drops (%s)",
+     DEFAULT_DROP_POLICY},
+    {{"drop_sample", required_argument, 0, ARG_DROP_SAMPLE},
+     "N|P",
+     "Above the watermark keep 1 in N messages, or with probability P < 1",
+     ""},
+    {{"drop_watermark", required_argument, 0, ARG_DROP_WATERMARK},
+     "percent",
+     "Ring buffer use at which sampling starts (%s)",
+     DEFAULT_DROP_WATERMARK},
+    {{"drop_ttl", required_argument, 0, ARG_DROP_TTL},
+     "ms",
+     "Drop messages that waited longer in the ring buffer",
+     ""},
+    {{"drop_expired", no_argument, 0, ARG_DROP_EXPIRED},
+     "",
+     "Drop messages past their AMQP ttl or absolute-expiry-time",
+     ""},
+    {{"udp_gso", required_argument, 0, ARG_UDP_GSO},
+     "N",
+     "Send up to N same size datagrams per syscall with UDP GSO (gw_inet)",
+     ""},
+    {{"udp_gso_pad", no_argument, 0, ARG_UDP_GSO_PAD},
+     "",
+     "Pad datagrams with spaces so different sizes batch too (JSON only)",
+     ""},
+    {{"resolve_period", required_argument, 0, ARG_RESOLVE_PERIOD},
+     "seconds",
+     "Look up the gw_inet host again this often, 0 for never (%s)",
+     DEFAULT_RESOLVE_PERIOD},
+    {{"seq_header", no_argument, 0, ARG_SEQ_HEADER},
+     "",
+     "Prefix datagrams with a sequence number and timestamp, see seq_header.h",
+     ""},
+    {{"presettled", optional_argument, 0, ARG_PRESETTLED},
+     "address",
+     "Ask for pre-settled (at most once) deliveries on links to addresses "
+     "that contain this, all links without it",
+     ""},
+    {{"reconnect", optional_argument, 0, ARG_RECONNECT},
+     "max_ms",
+     "Reconnect to the router instead of exiting, backing off up to this "
+     "(%s)",
+     DEFAULT_RECONNECT_MAX},
+    {{"control", required_argument, 0, ARG_CONTROL},
+     "/run/sg-bridge/control",
+     "Take tuning commands on this unix socket, send it \"help\"",
+     ""},
+    {{"pace", required_argument, 0, ARG_PACE},
+     "msgs/s",
+     "Send no more than this many messages per second",
+     ""},
+    {{"pace_bytes", required_argument, 0, ARG_PACE_BYTES},
+     "bytes/s",
+     "Send no more than this many bytes per second",
+     ""},
+    {{"pace_burst", required_argument, 0, ARG_PACE_BURST},
+     "ms",
+     "How many milliseconds worth of --pace can go out at once (%s)",
+     DEFAULT_PACE_BURST},
+    {{"inline", no_argument, 0, ARG_INLINE},
+     "",
+     "Send single body messages from the AMQP thread, queue lists and when "
+     "the socket is full; no --udp_gso batching",
+     ""},
     {{"help", no_argument, 0, ARG_HELP}, "", "Print help.", ""}};
 
 static void usage(char *program) {
@@ -136,6 +365,50 @@ static void usage(char *program) {
     }
 }
 
+// name=N,prio=P,weight=W,rbc=C and one of address=A or content=S
+static int parse_lane_rule(char *spec, lane_rule_t *rule) {
+    enum { NAME, PRIO, WEIGHT, RBC, ADDRESS, CONTENT };
+    char *const tokens[] = {"name",    "prio",    "weight", "rbc",
+                            "address", "content", NULL};
+    char *value;
+
+    rule->prio = 0;
+    rule->weight = 1;
+    rule->count = atoi(DEFAULT_CONN_RING_BUFFER_COUNT);
+    while (*spec != '\0') {
+        switch (getsubopt(&spec, tokens, &value)) {
+        case NAME:
+            rule->name = value;
+            break;
+        case PRIO:
+            rule->prio = value ? atoi(value) : 0;
+            break;
+        case WEIGHT:
+            rule->weight = value ? atoi(value) : 1;
+            break;
+        case RBC:
+            rule->count = value ? atoi(value) : 0;
+            break;
+        case ADDRESS:
+            rule->address = value;
+            break;
+        case CONTENT:
+            rule->content = value;
+            break;
+        default:
+            fprintf(stderr, "Unknown lane option: %s\n", value);
+            return -1;
+        }
+    }
+    if (rule->name == NULL || rule->count < 2 ||
+        (rule->address == NULL) == (rule->content == NULL)) {
+        fprintf(stderr, "A lane needs a name, rbc >= 2 and either an address "
+                        "or a content match\n");
+        return -1;
+    }
+    return 0;
+}
+
 static int match_regex(char *regmatch, char *matches[], int n_matches,
                        const char *to_match) {
     /* "M" contains the matches found. */
@@ -178,6 +451,14 @@ int main(int argc, char **argv) {
     app_data_t app = {0};
     char cid_buf[100];
     int opt, index;
+    int aggregate_window = 0;
+    enum aggregate_fn aggregate_fn;
+    double pace = 0, pace_bytes = 0;
+    int dedup_window = 0, dedup_max = atoi(DEFAULT_DEDUP_MAX);
+    const char *fair_key = NULL;
+    bool lane_sched_given = false;
+    int fair_queue = atoi(DEFAULT_FAIR_QUEUE);
+    int pace_burst = atoi(DEFAULT_PACE_BURST);
 
     srand(time(0));
 
@@ -194,9 +475,17 @@ int main(int argc, char **argv) {
     app.socket_flags = MSG_DONTWAIT;
     app.peer_host = DEFAULT_INET_HOST;
     app.peer_port = DEFAULT_INET_PORT;
+    app.resolve_period = atoi(DEFAULT_RESOLVE_PERIOD);
     app.ring_buffer_size = atoi(DEFAULT_RING_BUFFER_SIZE);
     app.ring_buffer_count = atoi(DEFAULT_RING_BUFFER_COUNT);
     app.amqp_block = false; /* disabled */
+    app.shm_ring_size = atol(DEFAULT_SHM_RING_SIZE);
+    app.replay_speed = atof(DEFAULT_REPLAY_SPEED);
+    app.synthetic_rate = atof(DEFAULT_SYNTHETIC_RATE);
+    app.amqp_threads = atoi(DEFAULT_AMQP_THREADS);
+    app.conn_ring_buffer_count = atoi(DEFAULT_CONN_RING_BUFFER_COUNT);
+    aggregate_fn_parse(DEFAULT_AGGREGATE_FN, &aggregate_fn);
+    app.rb_policy.sample_mark_pct = atoi(DEFAULT_DROP_WATERMARK);
 
     int num_args = sizeof(option_info) / sizeof(struct option_info);
     struct option *longopts = malloc(sizeof(struct option) * num_args);
@@ -228,6 +517,31 @@ int main(int argc, char **argv) {
                 app.ring_buffer_size = atoi(optarg);
             }
             break;
+        case ARG_SOURCE:
+            if (strcmp(optarg, "synthetic") == 0) {
+                app.synthetic = 1;
+            } else if (strcmp(optarg, "amqp") != 0) {
+                fprintf(stderr, "Unknown source: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case ARG_SYNTHETIC_RATE:
+            app.synthetic_rate = atof(optarg);
+            break;
+        case ARG_SINK:
+            if (strcmp(optarg, "null") == 0) {
+                app.null_sink = 1;
+            } else if (strcmp(optarg, "socket") != 0) {
+                fprintf(stderr, "Unknown sink: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case ARG_RB_FILE:
+            app.rb_file = optarg;
+            break;
+        case ARG_RB_MEM_MAX:
+            app.rb_mem_max = atoi(optarg);
+            break;
         case ARG_GW_INET:
             if (optarg != NULL) {
                 char *matches[4];
@@ -241,6 +555,36 @@ int main(int argc, char **argv) {
             }
             app.domain = AF_INET;
             break;
+        case ARG_GW_SHM:
+            app.shm_ring_sock =
+                optarg != NULL ? optarg : DEFAULT_SHM_RING_SOCKET_PATH;
+            break;
+        case ARG_SHM_RING_FILE:
+            app.shm_ring_file = optarg;
+            break;
+        case ARG_SHM_RING_SIZE:
+            app.shm_ring_size = atol(optarg);
+            break;
+        case ARG_CAPTURE:
+            app.capture_file = optarg;
+            break;
+        case ARG_REPLAY:
+            app.replay_file = optarg;
+            break;
+        case ARG_REPLAY_SPEED:
+            app.replay_speed = atof(optarg);
+            break;
+        case ARG_AMQP_THREADS:
+            app.amqp_threads = atoi(optarg);
+            if (app.amqp_threads < 1 || app.amqp_threads > MAX_AMQP_THREADS) {
+                fprintf(stderr, "amqp_threads must be 1..%d\n",
+                        MAX_AMQP_THREADS);
+                exit(1);
+            }
+            break;
+        case ARG_CONN_RING_BUFFER_COUNT:
+            app.conn_ring_buffer_count = atoi(optarg);
+            break;
         case ARG_CID:
             strncpy(cid_buf, optarg, sizeof(cid_buf) - 1);
             break;
@@ -260,6 +604,175 @@ int main(int argc, char **argv) {
         case ARG_AMQP_BLOCK:
             app.amqp_block = true;
             break;
+        case ARG_PASSTHROUGH_HEADER:
+            app.passthrough_header = 1;
+            /* fall through */
+        case ARG_PASSTHROUGH:
+            app.passthrough = 1;
+            break;
+        case ARG_TRANSCODE:
+            if (app.transcode == NULL) {
+                app.transcode = transcode_alloc();
+            }
+            break;
+        case ARG_OSLO_UNWRAP:
+            if (app.oslo == NULL) {
+                app.oslo = oslo_alloc();
+            }
+            break;
+        case ARG_DEDUP:
+            dedup_window = atoi(optarg);
+            if (dedup_window <= 0) {
+                fprintf(stderr, "Invalid dedup window: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case ARG_DEDUP_KEY:
+            if (strcmp(optarg, "id") == 0) {
+                app.dedup_id = 1;
+            } else if (strcmp(optarg, "body") != 0) {
+                fprintf(stderr, "Unknown dedup key: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case ARG_DEDUP_MAX:
+            dedup_max = atoi(optarg);
+            if (dedup_max <= 0 || dedup_max > DEDUP_MAX_KEYS) {
+                fprintf(stderr, "dedup_max must be 1..%d\n", DEDUP_MAX_KEYS);
+                exit(1);
+            }
+            break;
+        case ARG_AGGREGATE:
+            aggregate_window = atoi(optarg);
+            if (aggregate_window <= 0) {
+                fprintf(stderr, "Invalid aggregation window: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case ARG_PACE:
+        case ARG_PACE_BYTES: {
+            char *end;
+            double rate = strtod(optarg, &end);
+            if (*end || rate <= 0) {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                exit(1);
+            }
+            *(opt == ARG_PACE ? &pace : &pace_bytes) = rate;
+            break;
+        }
+        case ARG_PRESETTLED:
+            app.presettled = optarg ? optarg : "";
+            break;
+        case ARG_CONTROL:
+            app.control = optarg;
+            break;
+        case ARG_RECONNECT:
+            app.reconnect_max_ms =
+                atoi(optarg ? optarg : DEFAULT_RECONNECT_MAX);
+            if (app.reconnect_max_ms < 1) {
+                fprintf(stderr, "Invalid reconnect backoff: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case ARG_PACE_BURST:
+            pace_burst = atoi(optarg);
+            break;
+        case ARG_AGGREGATE_FN:
+            if (aggregate_fn_parse(optarg, &aggregate_fn) != 0) {
+                fprintf(stderr, "Unknown aggregation: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case ARG_LANE:
+            if (app.n_lane_rules == MAX_LANE_RULES) {
+                fprintf(stderr, "At most %d lanes\n", MAX_LANE_RULES);
+                exit(1);
+            }
+            if (parse_lane_rule(optarg, &app.lane_rules[app.n_lane_rules]) !=
+                0) {
+                exit(1);
+            }
+            app.n_lane_rules++;
+            break;
+        case ARG_FAIR_KEY:
+            fair_key = optarg;
+            break;
+        case ARG_FAIR_QUEUE:
+            fair_queue = atoi(optarg);
+            break;
+        case ARG_LANE_SCHED:
+            if (strcmp(optarg, "strict") == 0) {
+                app.lane_sched = RB_SCHED_STRICT;
+            } else if (strcmp(optarg, "weighted") == 0) {
+                app.lane_sched = RB_SCHED_WEIGHTED;
+            } else if (strcmp(optarg, "fair") == 0) {
+                app.lane_sched = RB_SCHED_FAIR;
+            } else {
+                fprintf(stderr, "Unknown lane scheduler: %s\n", optarg);
+                exit(1);
+            }
+            lane_sched_given = true;
+            break;
+        case ARG_DROP_POLICY:
+            if (strcmp(optarg, "newest") == 0) {
+                app.rb_policy.reserve_pct = 0;
+            } else if (strcmp(optarg, "oldest") == 0) {
+                app.rb_policy.reserve_pct = DEFAULT_DROP_RESERVE_PCT;
+            } else {
+                fprintf(stderr, "Unknown drop policy: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case ARG_DROP_SAMPLE: {
+            double rate = atof(optarg);
+            if (rate >= 1) {
+                app.rb_policy.sample_n = rate;
+            } else if (rate > 0) {
+                app.rb_policy.sample_p = rate;
+            } else {
+                fprintf(stderr, "Invalid sampling: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case ARG_DROP_WATERMARK:
+            app.rb_policy.sample_mark_pct = atoi(optarg);
+            break;
+        case ARG_DROP_TTL:
+            app.rb_policy.ttl_ns = atol(optarg) * 1000000ULL;
+            break;
+        case ARG_UDP_GSO:
+            app.udp_gso = atoi(optarg);
+            if (app.udp_gso < 0 || app.udp_gso > 64) {
+                fprintf(stderr, "udp_gso must be 0..64\n");
+                exit(1);
+            }
+            break;
+        case ARG_UDP_GSO_PAD:
+            app.udp_gso_pad = 1;
+            break;
+        case ARG_RESOLVE_PERIOD:
+            app.resolve_period = atoi(optarg);
+            break;
+        case ARG_SEQ_HEADER:
+            app.seq_header = 1;
+            app.rb_policy.stamp = true; /* enqueue times for the header */
+            break;
+        case ARG_INLINE:
+            app.inline_mode = 1;
+            break;
+        case ARG_DROP_EXPIRED:
+            app.drop_expired = 1;
+            app.rb_policy.stamp = true; /* ttl counts from the enqueue */
+            break;
+        case ARG_STATS_SHM:
+            if (optarg != NULL) {
+                app.stats_shm_path = strdup(optarg);
+            } else {
+                // Named after the container ID, which may come later
+                app.stats_shm_path = DEFAULT_STATS_SHM_PATH;
+            }
+            break;
         case 'h':
         case ARG_HELP:
             usage(argv[0]);
@@ -294,40 +807,350 @@ int main(int argc, char **argv) {
         printf("Standalone mode\n");
     }
 
-    app.rbin =
-        rb_alloc(app.ring_buffer_count, app.ring_buffer_size, app.amqp_block);
+    if (app.passthrough) {
+        printf("Passthrough mode%s\n",
+               app.passthrough_header ? " with header" : "");
+        if (app.transcode || aggregate_window || app.oslo || dedup_window) {
+            fprintf(stderr, "--transcode, --aggregate, --oslo_unwrap and "
+                            "--dedup need decoding, not --passthrough\n");
+            exit(1);
+        }
+    }
+
+    // Source lanes are fed by copy and never block the link, and they are
+    // always served fairly
+    if (fair_key && app.amqp_block) {
+        fprintf(stderr, "--fair_key source lanes never block, "
+                        "not with --amqp_block\n");
+        exit(1);
+    }
+    if (fair_key && lane_sched_given && app.lane_sched != RB_SCHED_FAIR) {
+        fprintf(stderr, "--fair_key serves lanes fairly, not with "
+                        "--lane_sched strict or weighted\n");
+        exit(1);
+    }
+
+    // Padding with spaces only suits JSON, not AMQP or the compact encoding
+    if (app.udp_gso_pad && (app.passthrough || app.transcode)) {
+        fprintf(stderr, "--udp_gso_pad pads JSON, not --passthrough or "
+                        "--transcode output\n");
+        exit(1);
+    }
+
+    if (app.rb_mem_max > 0) {
+        app.rb_max_count =
+            (long)app.rb_mem_max * 1024 * 1024 / app.ring_buffer_size;
+        printf("Elastic ring buffers, up to %d buffers\n", app.rb_max_count);
+    }
+
+    if (app.seq_header) {
+        // Unique across bridges started in the same second
+        if (getrandom(&app.seq_stream, sizeof(app.seq_stream), 0) !=
+            sizeof(app.seq_stream)) {
+            struct timespec now;
+
+            clock_gettime(CLOCK_REALTIME, &now);
+            app.seq_stream = (uint32_t)getpid() * 2654435761U ^ now.tv_nsec ^
+                             now.tv_sec;
+        }
+        printf("Sequence header, stream %08x\n", app.seq_stream);
+    }
+
+    if (app.inline_mode) {
+        printf("Inline mode\n");
+        pthread_mutex_init(&app.send_mutex, NULL);
+    }
+
+    if (pace || pace_bytes) {
+        printf("Pacing output to %g msgs/s, %g bytes/s, %dms bursts\n", pace,
+               pace_bytes, pace_burst);
+        app.pacer = pacer_alloc(pace, pace_bytes, pace_burst);
+    }
+
+    if (dedup_window) {
+        printf("Dropping duplicate %s within %ds\n",
+               app.dedup_id ? "message ids" : "bodies", dedup_window);
+        app.dedup = dedup_alloc(dedup_window, dedup_max);
+        if (app.dedup == NULL) {
+            fprintf(stderr, "No memory for %d dedup keys\n", dedup_max);
+            exit(1);
+        }
+    }
+
+    if (aggregate_window) {
+        printf("Aggregating collectd metrics over %ds\n", aggregate_window);
+        app.aggregate = aggregate_alloc(aggregate_window, aggregate_fn);
+    }
+
+    if (app.replay_file) {
+        printf("Replay mode\n");
+        app.amqp_block = true; /* replay waits for room in the ring */
+    }
+
+    if (app.synthetic) {
+        app.amqp_block = true; /* so does the synthetic source */
+    }
+
+    if (app.null_sink) {
+        printf("Null sink, nothing is sent\n");
+    }
+
+    int recovered = 0, damaged = 0, taken = 0;
+    if (app.rb_file) {
+        // A file ring has a fixed size
+        app.rbin = rb_alloc_file(app.rb_file, app.ring_buffer_count,
+                                 app.ring_buffer_size, app.amqp_block,
+                                 &recovered, &damaged, &taken);
+        if (app.rbin == NULL) {
+            exit(1);
+        }
+        printf("Ring buffer in %s, %d messages to send from before, %d of "
+               "them damaged, %d maybe sent already\n",
+               app.rb_file, recovered, damaged, taken);
+    } else {
+        app.rbin = rb_alloc_elastic(app.ring_buffer_count, app.rb_max_count,
+                                    app.ring_buffer_size, app.amqp_block);
+    }
+    rb_set_policy(app.rbin, &app.rb_policy);
+    app.lanes = rb_set_alloc();
+    app.lanes->sched = app.lane_sched;
+    if (app.rb_max_count) {
+        // One budget, however many lanes --fair_key or the links add
+        rb_set_budget(app.lanes, (long)app.rb_mem_max * 1024 * 1024);
+    }
+    app.lane = rb_set_add(app.lanes, app.rbin,
+                          app.standalone ? "default" : app.amqp_con.address);
+
+    for (int i = 0; i < app.n_lane_rules; i++) {
+        lane_rule_t *rule = &app.lane_rules[i];
+
+        if (rule->content) {
+            // Shared by all links, it never blocks them
+            rb_rwbytes_t *rb = rb_alloc_elastic(rule->count, app.rb_max_count,
+                                                app.ring_buffer_size, 0);
+            rb_set_policy(rb, &app.rb_policy);
+            rule->lane = rb_set_add_prio(app.lanes, rb, rule->name,
+                                         rule->prio, rule->weight);
+            rule->lane->shared = true;
+            app.n_content_rules++;
+        } else if (!app.standalone &&
+                   strstr(app.amqp_con.address, rule->address)) {
+            app.lane->prio = rule->prio;
+            app.lane->weight = rule->weight;
+        }
+        printf("Lane %s: prio %d, weight %d, %d buffers, %s \"%s\"\n",
+               rule->name, rule->prio, rule->weight, rule->count,
+               rule->content ? "content" : "address",
+               rule->content ? rule->content : rule->address);
+    }
+    if (fair_key) {
+        // Content rules come first, the rest goes by source
+        app.lanes->sched = RB_SCHED_FAIR;
+        app.fair = fair_alloc(fair_key, app.lanes, fair_queue,
+                              app.rb_max_count, app.ring_buffer_size,
+                              &app.rb_policy);
+        if (app.fair == NULL) {
+            fprintf(stderr, "Invalid fair key: %s\n", fair_key);
+            exit(1);
+        }
+        printf("A lane of %d buffers per \"%s\", served fairly\n",
+               fair_queue, fair_key);
+    }
+
+    if (app.capture_file) {
+        app.capture = capture_open(app.capture_file);
+        if (app.capture == NULL) {
+            fprintf(stderr, "Failed to create capture file %s\n",
+                    app.capture_file);
+            exit(1);
+        }
+    }
+
+    if (app.stats_shm_path) {
+        if (strcmp(app.stats_shm_path, DEFAULT_STATS_SHM_PATH) == 0 &&
+            asprintf(&app.stats_shm_path, DEFAULT_STATS_SHM_PATH,
+                     app.container_id) < 0) {
+            exit(1);
+        }
+        app.stats_shm = stats_shm_open(app.stats_shm_path);
+        if (app.stats_shm == NULL) {
+            fprintf(stderr, "Failed to create stats page %s\n",
+                    app.stats_shm_path);
+            exit(1);
+        }
+    }
+
+    if (app.control) {
+        pthread_t control;
+
+        if (control_open(app.control) == -1) {
+            exit(1);
+        }
+        // A client that hangs up before its answer must not end the bridge
+        signal(SIGPIPE, SIG_IGN);
+        pthread_create(&control, NULL, control_th, (void *)&app);
+        pthread_detach(control);
+        printf("Control socket %s\n", app.control);
+    }
+
+    stage_calibrate();
+
+    // What a previous run left in --rb_file goes out before any new credit
+    if (recovered) {
+        app.socket_snd_th_running = true;
+        pthread_create(&app.socket_snd_th, NULL, socket_snd_th, (void *)&app);
+        while (rb_queued(app.rbin)) {
+            usleep(10000);
+        }
+    }
 
     app.amqp_rcv_th_running = true;
-    pthread_create(&app.amqp_rcv_th, NULL, amqp_rcv_th, (void *)&app);
-    app.socket_snd_th_running = true;
-    pthread_create(&app.socket_snd_th, NULL, socket_snd_th, (void *)&app);
+    pthread_create(&app.amqp_rcv_th, NULL,
+                   app.replay_file ? replay_th
+                   : app.synthetic ? synth_th
+                                   : amqp_rcv_th,
+                   (void *)&app);
+
+    if (!recovered) {
+        app.socket_snd_th_running = true;
+        pthread_create(&app.socket_snd_th, NULL, socket_snd_th, (void *)&app);
+    }
 
     long last_amqp_received = 0;
     long last_overrun = 0;
     long last_out = 0;
     long last_sock_overrun = 0;
     long last_link_credit = 0;
+    long report_sent = 0, report_bytes = 0; // at the previous stat period
+    long report_frames = 0, report_received = 0;
+    long report_waits = 0;
+    uint64_t report_wait_ns = 0;
+    int report_queued = 0;
+    uint64_t last_rcv_ticks[MAX_AMQP_THREADS][STAGE_MAX] = {{0}};
+    uint64_t last_snd_ticks[STAGE_MAX] = {0};
 
     long sleep_count = 1;
 
     while (1) {
         sleep(1);
-        if (sleep_count == app.stat_period) {
+        stats_shm_update(app.stats_shm, &app);
+        capture_flush(app.capture);
+        rb_sync(app.rbin);
+        long overruns = rb_set_overruns(app.lanes);
+        app.ring_drops = overruns + rb_set_drops(app.lanes, RB_DROP_OLDEST) +
+                         rb_set_drops(app.lanes, RB_DROP_SAMPLED) +
+                         rb_set_drops(app.lanes, RB_DROP_AGED) +
+                         rb_set_drops(app.lanes, RB_DROP_TOO_LONG);
+        int stat_period = __atomic_load_n(&app.stat_period, __ATOMIC_RELAXED);
+        if (stat_period && sleep_count >= stat_period) {
             printf("in: %ld(%ld), amqp_overrun: %ld(%ld), out: %ld(%ld), "
                    "sock_overrun: %ld(%ld), link_credit_average: %f\n",
                    app.amqp_received, app.amqp_received - last_amqp_received,
-                   app.rbin->overruns, app.rbin->overruns - last_overrun,
+                   overruns, overruns - last_overrun,
                    app.sock_sent, app.sock_sent - last_out,
                    app.sock_would_block,
                    app.sock_would_block - last_sock_overrun,
                    (app.link_credit - last_link_credit) /
                        (float)(app.amqp_received - last_amqp_received));
+            for (int i = 0; i < app.amqp_threads; i++) {
+                stage_report(&app.rcv_acct[i], last_rcv_ticks[i]);
+            }
+            uint64_t snd_busy = stage_report(&app.snd_acct, last_snd_ticks);
+            long sent = app.sock_sent - report_sent;
+            if (sent > 0) {
+                printf("out cost: %.0f ns/msg, %.0f bytes/msg\n",
+                       (double)snd_busy / sent,
+                       (double)(app.sock_bytes - report_bytes) / sent);
+            }
+            report_sent = app.sock_sent;
+            report_bytes = app.sock_bytes;
+            long received = app.amqp_received - report_received;
+            if (received > 0) {
+                printf("amqp frames out: %.2f/msg, pre-settled: %ld, "
+                       "refused: %ld\n",
+                       (double)(app.amqp_frames_out - report_frames) /
+                           received,
+                       app.amqp_presettled, app.amqp_presettle_refused);
+            }
+            report_frames = app.amqp_frames_out;
+            if (app.amqp_reconnects) {
+                printf("amqp reconnects: %ld, last took %.1fms, %.1fms "
+                       "disconnected in total, %ld messages kept\n",
+                       app.amqp_reconnects, app.amqp_reconnect_last_ns / 1e6,
+                       app.amqp_reconnect_ns / 1e6, app.amqp_reconnect_kept);
+            }
+            report_received = app.amqp_received;
+            if (app.standalone || app.n_lane_rules || app.fair) {
+                rb_set_report(app.lanes, stdout);
+            }
+            if (app.fair) {
+                printf("fair: %d sources, %ld messages without a source\n",
+                       app.fair->n_sources, app.fair->unclassified);
+            }
+            if (app.rb_policy.reserve_pct || app.rb_policy.sample_n ||
+                app.rb_policy.sample_p > 0 || app.rb_policy.ttl_ns ||
+                app.drop_expired || app.n_content_rules || app.fair) {
+                printf("drops: oldest: %ld, sampled: %ld, aged: %ld, "
+                       "expired: %ld, too long: %ld\n",
+                       rb_set_drops(app.lanes, RB_DROP_OLDEST),
+                       rb_set_drops(app.lanes, RB_DROP_SAMPLED),
+                       rb_set_drops(app.lanes, RB_DROP_AGED),
+                       app.amqp_expired,
+                       rb_set_drops(app.lanes, RB_DROP_TOO_LONG));
+            }
+            if (app.rb_max_count) {
+                printf("rings: %ld grows, %ld shrinks, %ldkB of buffers\n",
+                       rb_set_grows(app.lanes), rb_set_shrinks(app.lanes),
+                       rb_set_mem(app.lanes) / 1024);
+            }
+            if (app.pacer) {
+                int queued = rb_set_queued(app.lanes);
+                printf("pace: %ld waits, paced %.1fms, queued: %d(%+d)\n",
+                       app.pacer->waits - report_waits,
+                       (app.pacer->wait_ns - report_wait_ns) / 1e6, queued,
+                       queued - report_queued);
+                report_waits = app.pacer->waits;
+                report_wait_ns = app.pacer->wait_ns;
+                report_queued = queued;
+            }
+            if (app.udp_gso) {
+                printf("udp_gso: %ld sends of several datagrams\n",
+                       app.gso_sends);
+            }
+            if (app.inline_mode) {
+                printf("inline: %ld sent, %ld queued\n", app.inline_sent,
+                       app.inline_queued);
+            }
+            if (app.aggregate) {
+                printf("aggregate: %ld samples, %ld series sent, "
+                       "%ld not collectd\n",
+                       app.aggregate->samples, app.aggregate->emitted,
+                       app.aggregate->errs);
+            }
+            if (app.dedup) {
+                long checked = app.dedup->checked;
+                printf("dedup: %ld checked, %ld duplicates (%.1f%%), %ld "
+                       "early rotations\n",
+                       checked, app.dedup->dups,
+                       checked ? 100.0 * app.dedup->dups / checked : 0.0,
+                       app.dedup->early);
+            }
+            if (app.oslo) {
+                printf("oslo: %ld unwrapped, %ld passed as they were\n",
+                       app.oslo->unwrapped, app.oslo->passed);
+            }
+            if (app.transcode) {
+                printf("transcode: %ld msgs, %ld not collectd, %ld resets, "
+                       "%d strings\n",
+                       app.transcode->msgs, app.transcode->errs,
+                       app.transcode->resets, app.transcode->n_strings);
+            }
 
             sleep_count = 1;
         }
         sleep_count++;
         last_amqp_received = app.amqp_received;
-        last_overrun = app.rbin->overruns;
+        last_overrun = overruns;
         last_out = app.sock_sent;
         last_sock_overrun = app.sock_would_block;
         last_link_credit = app.link_credit;
@@ -339,6 +1162,8 @@ int main(int argc, char **argv) {
 
             pthread_join(app.amqp_rcv_th, NULL);
 
+            capture_close(app.capture);
+            stats_shm_close(app.stats_shm, app.stats_shm_path);
             exit(0);
         }
         if (app.amqp_rcv_th_running == 0) {
@@ -349,6 +1174,8 @@ int main(int argc, char **argv) {
             printf("Joining socket_snd_th...\n");
             pthread_join(app.socket_snd_th, NULL);
 
+            capture_close(app.capture);
+            stats_shm_close(app.stats_shm, app.stats_shm_path);
             exit(0);
         }
     }
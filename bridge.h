@@ -9,7 +9,18 @@
 #include <proton/proactor.h>
 #include <proton/sasl.h>
 
+#include "aggregate.h"
+#include "capture.h"
+#include "dedup.h"
+#include "fair.h"
+#include "oslo.h"
+#include "pacer.h"
 #include "rb.h"
+#include "rb_set.h"
+#include "shm_ring.h"
+#include "stage_acct.h"
+#include "stats_shm.h"
+#include "transcode.h"
 
 #define DEFAULT_UNIX_SOCKET_PATH "/tmp/smartgateway"
 #define DEFAULT_AMQP_URL "amqp://127.0.0.1:5672/collectd/telemetry"
@@ -24,6 +35,28 @@
 #define DEFAULT_RING_BUFFER_COUNT "5000"
 #define DEFAULT_RING_BUFFER_SIZE "2048"
 #define DEFAULT_AMQP_BLOCK "false"
+#define DEFAULT_STATS_SHM_PATH "/dev/shm/sg-bridge-%s"
+#define DEFAULT_SHM_RING_SOCKET_PATH "/tmp/smartgateway-shm"
+#define DEFAULT_SHM_RING_SIZE "16777216"
+#define DEFAULT_REPLAY_SPEED "1.0"
+#define DEFAULT_AMQP_THREADS "1"
+#define DEFAULT_CONN_RING_BUFFER_COUNT "1024"
+#define DEFAULT_AGGREGATE_FN "avg"
+#define DEFAULT_LANE_SCHED "strict"
+#define DEFAULT_FAIR_QUEUE "64"
+#define DEFAULT_DROP_POLICY "newest"
+#define DEFAULT_DROP_RESERVE_PCT 5
+#define DEFAULT_DROP_WATERMARK "80"
+#define DEFAULT_RESOLVE_PERIOD "60"
+#define DEFAULT_PACE_BURST "10"
+#define DEFAULT_SOURCE "amqp"
+#define DEFAULT_SYNTHETIC_RATE "0"
+#define DEFAULT_SINK "socket"
+#define DEFAULT_DEDUP_KEY "body"
+#define DEFAULT_DEDUP_MAX "262144"
+#define DEFAULT_RECONNECT_MAX "30000"
+
+#define MAX_AMQP_THREADS 16
 
 #define AMQP_URL_REGEX                                                         \
     "^(amqps*)://(([a-z]+)(:([a-z]+))*@)*([a-zA-Z_0-9.-]+)(:([0-9]+))*(.+)$"
@@ -37,7 +70,25 @@ typedef struct {
     char *url;
 } amqp_connection;
 
+#define MAX_LANE_RULES 8
+
+// --lane: a priority lane and the traffic that goes to it
 typedef struct {
+    char *name;
+    int prio;   // see rb_lane_t
+    int weight; // see rb_lane_t
+    int count;  // ring buffer entries
+
+    // Links whose address contains this get a lane of their own with the
+    // rule's priority
+    char *address;
+    // Messages that contain these bytes, from any link, are copied to one
+    // shared lane
+    char *content;
+    rb_lane_t *lane; // the shared lane of a content rule
+} lane_rule_t;
+
+typedef struct app_data {
     // Parameters section
     int standalone;
     int verbose;
@@ -45,6 +96,11 @@ typedef struct {
     int stat_period;
     int ring_buffer_size;
     int ring_buffer_count;
+    int rb_mem_max;      // MB all rings may grow to, 0 for fixed size rings
+    int rb_max_count;    // the same in buffers
+    const char *rb_file; // rbin lives in this file, survives restarts
+    int conn_ring_buffer_count; // per inbound link in standalone mode
+    int amqp_threads;
 
     amqp_connection amqp_con;
     const char *container_id;
@@ -53,6 +109,46 @@ typedef struct {
     int socket_flags;
 
     char *peer_host, *peer_port;
+    char *volatile retarget; // host:port for the sender to switch to
+    int resolve_period; // seconds between lookups of peer_host, 0 for once
+    int udp_gso;        // datagrams per UDP_SEGMENT send, 0 for no GSO
+    int udp_gso_pad;    // pad datagrams to one segment size with spaces
+
+    char *stats_shm_path;
+
+    const char *shm_ring_sock; // output to a shared memory ring if set
+    const char *shm_ring_file; // named ring file instead of a memfd
+    long shm_ring_size;
+
+    const char *capture_file; // record committed messages
+    const char *replay_file;  // replay instead of connecting to AMQP
+    double replay_speed;      // 0 for as fast as possible
+    int synthetic;            // generate messages instead of AMQP
+    double synthetic_rate;    // msgs/s, 0 for as fast as possible
+
+    int inline_mode;        // the proactor thread sends, rings are the fallback
+    int passthrough;        // forward raw AMQP messages, no decoding
+    int passthrough_header; // prefix them with a passthrough_hdr_t
+
+    rb_policy_t rb_policy;  // overload policy of every ring
+    int drop_expired;       // honour the AMQP ttl and absolute-expiry-time
+    const char *presettled; // at most once on links to matching addresses,
+                            // "" for all
+    int reconnect_max_ms;   // longest backoff, 0 to exit when disconnected
+    const char *control;    // unix socket for live tuning if set
+
+    lane_rule_t lane_rules[MAX_LANE_RULES];
+    int n_lane_rules;
+    int n_content_rules;
+    rb_sched_t lane_sched;
+    fair_t *fair; // a lane per source, by a key of the body, if set
+
+    transcode_t *transcode; // collectd JSON to binary records if set
+    aggregate_t *aggregate; // collectd metrics per window if set
+    pacer_t *pacer;         // output rate limit if set
+    oslo_t *oslo;           // unwrap oslo.messaging envelopes if set
+    dedup_t *dedup;         // drop duplicates if set
+    int dedup_id;           // by message id rather than by body
 
     // Runtime
     pthread_t amqp_rcv_th;
@@ -66,6 +162,12 @@ typedef struct {
     pn_rwbytes_t msgout; /* Buffers for incoming/outgoing messages */
 
     rb_rwbytes_t *rbin;
+    rb_set_t *lanes; // rbin plus one lane per inbound link in standalone
+    rb_lane_t *lane; // the lane of rbin
+
+    capture_t *capture;
+
+    stats_shm_t *stats_shm;
 
     /* Rcv stats */
     volatile long amqp_received;
@@ -73,6 +175,13 @@ typedef struct {
     volatile long amqp_total_batches;
     volatile long amqp_link_credit;
     volatile bool amqp_block;
+    volatile long amqp_presettled;        // deliveries needing no disposition
+    volatile long amqp_presettle_refused; // links the sender settles itself
+    volatile long amqp_frames_out;        // all AMQP frames we sent
+    volatile long amqp_reconnects;        // connections to the router regained
+    volatile long amqp_reconnect_ns;      // spent disconnected, in total
+    volatile long amqp_reconnect_last_ns; // the last time
+    volatile long amqp_reconnect_kept;    // ring entries that outlived one
 
     /* Ring buffer stats */
     volatile long link_credit;
@@ -80,12 +189,35 @@ typedef struct {
     /* Snd stats */
     long sock_sent;
     long amqp_decode_errs;
+    long amqp_expired;
     long sock_would_block;
+    long sock_bytes;
+    long gso_sends;   // UDP_SEGMENT sends of several datagrams
+    long sock_unsent; // datagrams that failed to send, for any reason
+
+    /* --seq_header */
+    int seq_header;
+    uint32_t seq_stream; // random per run
+    uint64_t seq;
+    volatile long ring_drops; // overruns and policy drops, every second
+    long snd_done;               // messages the sender thread took, handled
+    volatile long snd_out;       // of those, the ones no GSO batch holds back
+    long inline_sent;            // handled in a proactor thread, --inline
+    volatile long inline_queued; // given to the sender thread instead
+    pthread_mutex_t send_mutex;  // held by whoever decodes, with --inline
+
+    /* Time per pipeline stage */
+    stage_acct_t rcv_acct[MAX_AMQP_THREADS];
+    stage_acct_t snd_acct;
 
     // Use a struct big enough more most things
     struct sockaddr_un sa;
     socklen_t sa_len;
     int send_sock;
+
+    shm_ring_t *shm_ring;
+    volatile long shm_ring_doorbells; // of shm_ring, kept by the sender
+    int null_sink; // count what would be sent, without sending it
 } app_data_t;
 
 #endif
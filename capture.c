@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include <features.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)
+
+#define REC_SIZE(len)                                                          \
+    ((sizeof(capture_rec_t) + (len) + CAPTURE_ALIGN - 1) &                     \
+     ~(uint64_t)(CAPTURE_ALIGN - 1))
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+capture_t *capture_open(const char *path) {
+    capture_t *cap = calloc(1, sizeof(capture_t));
+
+    if ((cap->file = fopen(path, "w")) == NULL) {
+        perror("capture open");
+        free(cap);
+        return NULL;
+    }
+    setvbuf(cap->file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    cap->path = strdup(path);
+    pthread_mutex_init(&cap->mutex, NULL);
+    memcpy(cap->hdr.magic, CAPTURE_MAGIC, sizeof(cap->hdr.magic));
+    cap->hdr.version = CAPTURE_VERSION;
+    cap->hdr.index_stride = CAPTURE_INDEX_STRIDE;
+    cap->hdr.start_time = realtime_ns();
+    cap->hdr.data_end = sizeof(capture_hdr_t);
+
+    fwrite(&cap->hdr, sizeof(cap->hdr), 1, cap->file);
+
+    return cap;
+}
+
+// Append one message
+int capture_write(capture_t *cap, const char *data, size_t len) {
+    static const char pad[CAPTURE_ALIGN];
+    capture_rec_t rec = {0, len, 0};
+    uint64_t size = REC_SIZE(len);
+    int err = 0;
+
+    pthread_mutex_lock(&cap->mutex);
+    rec.time = realtime_ns() - cap->hdr.start_time;
+
+    if (cap->hdr.count % CAPTURE_INDEX_STRIDE == 0) {
+        if (cap->hdr.index_count == cap->index_alloc) {
+            cap->index_alloc = cap->index_alloc ? cap->index_alloc * 2 : 1024;
+            cap->index =
+                realloc(cap->index, cap->index_alloc * sizeof(capture_idx_t));
+        }
+        cap->index[cap->hdr.index_count].time = rec.time;
+        cap->index[cap->hdr.index_count].offset = cap->hdr.data_end;
+        cap->hdr.index_count++;
+    }
+
+    if (fwrite(&rec, sizeof(rec), 1, cap->file) != 1 ||
+        fwrite(data, 1, len, cap->file) != len ||
+        fwrite(pad, 1, size - sizeof(rec) - len, cap->file) !=
+            size - sizeof(rec) - len) {
+        err = -1;
+    } else {
+        cap->hdr.data_end += size;
+        cap->hdr.count++;
+    }
+    pthread_mutex_unlock(&cap->mutex);
+
+    return err;
+}
+
+// Push buffered records to the file, safe to call from any thread
+void capture_flush(capture_t *cap) {
+    if (cap) {
+        fflush(cap->file);
+    }
+}
+
+// Write the index and the final header
+void capture_close(capture_t *cap) {
+    if (cap == NULL) {
+        return;
+    }
+    cap->hdr.index_offset = cap->hdr.data_end;
+    fwrite(cap->index, sizeof(capture_idx_t), cap->hdr.index_count,
+           cap->file);
+    fseek(cap->file, 0, SEEK_SET);
+    fwrite(&cap->hdr, sizeof(cap->hdr), 1, cap->file);
+    fclose(cap->file);
+
+    printf("Captured %lu messages to %s\n", cap->hdr.count, cap->path);
+
+    free(cap->index);
+    free(cap->path);
+    free(cap);
+}
+
+capture_map_t *capture_map(const char *path) {
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(capture_hdr_t)) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        close(fd);
+        return NULL;
+    }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("capture mmap");
+        return NULL;
+    }
+
+    capture_map_t *cm = calloc(1, sizeof(capture_map_t));
+    cm->map = map;
+    cm->size = st.st_size;
+    cm->hdr = (const capture_hdr_t *)map;
+    if (memcmp(cm->hdr->magic, CAPTURE_MAGIC, sizeof(cm->hdr->magic)) ||
+        cm->hdr->version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: unsupported capture file\n", path);
+        capture_unmap(cm);
+        return NULL;
+    }
+    // Without an index the capture was not closed, use what is there
+    cm->end = cm->hdr->index_offset ? cm->hdr->data_end : cm->size;
+    cm->pos = sizeof(capture_hdr_t);
+
+    return cm;
+}
+
+// Next record, NULL at the end or at a truncated record
+const capture_rec_t *capture_next(capture_map_t *cm) {
+    if (cm->pos + sizeof(capture_rec_t) > cm->end) {
+        return NULL;
+    }
+    const capture_rec_t *rec = (const capture_rec_t *)(cm->map + cm->pos);
+    if (cm->pos + REC_SIZE(rec->len) > cm->end) {
+        return NULL;
+    }
+    cm->pos += REC_SIZE(rec->len);
+
+    return rec;
+}
+
+void capture_unmap(capture_map_t *cm) {
+    if (cm == NULL) {
+        return;
+    }
+    munmap((void *)cm->map, cm->size);
+    free(cm);
+}
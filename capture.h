@@ -0,0 +1,77 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H 1
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "SGBCAP01"
+#define CAPTURE_VERSION 1
+#define CAPTURE_ALIGN 8
+#define CAPTURE_INDEX_STRIDE 256 /* records per index entry */
+
+// Capture file of raw AMQP messages, as committed to the ring buffer.
+//
+//   capture_hdr_t
+//   records: capture_rec_t followed by len bytes, padded to CAPTURE_ALIGN
+//   index:   capture_idx_t[index_count], one entry per index_stride records
+//
+// All integers are native endian.  The header is rewritten when the capture
+// is closed.  If the writer died first index_offset is 0 and data_end may
+// be stale, a reader then walks the records up to the end of the file.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t index_stride;
+    uint64_t start_time; // CLOCK_REALTIME in ns when the capture started
+    uint64_t count;      // number of records
+    uint64_t data_end;   // file offset after the last record
+    uint64_t index_offset;
+    uint64_t index_count;
+} capture_hdr_t;
+
+typedef struct {
+    uint64_t time; // ns since start_time
+    uint32_t len;
+    uint32_t flags; // reserved, 0
+} capture_rec_t;
+
+typedef struct {
+    uint64_t time;
+    uint64_t offset;
+} capture_idx_t;
+
+// Writer
+typedef struct {
+    FILE *file;
+    char *path;
+    pthread_mutex_t mutex; // several proactor threads may write
+    capture_hdr_t hdr;
+    capture_idx_t *index;
+    uint64_t index_alloc;
+} capture_t;
+
+// Reader, the whole file is mapped read only
+typedef struct {
+    const char *map;
+    uint64_t size;
+    const capture_hdr_t *hdr;
+    uint64_t end;
+    uint64_t pos;
+} capture_map_t;
+
+extern capture_t *capture_open(const char *path);
+
+extern int capture_write(capture_t *cap, const char *data, size_t len);
+
+extern void capture_flush(capture_t *cap);
+
+extern void capture_close(capture_t *cap);
+
+extern capture_map_t *capture_map(const char *path);
+
+extern const capture_rec_t *capture_next(capture_map_t *map);
+
+extern void capture_unmap(capture_map_t *map);
+
+#endif
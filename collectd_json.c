@@ -0,0 +1,460 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "collectd_json.h"
+
+#define MAX_DEPTH 32
+#define MAX_NUMBER_LEN 64
+
+typedef struct {
+    const char *p;
+    const char *end;
+
+    char scratch[COLLECTD_SCRATCH_SIZE];
+    size_t scratch_used;
+} cursor_t;
+
+// Raw tokens of the values array, converted once the dstypes are known
+typedef struct {
+    const char *start;
+    size_t size; // 0 for null
+} number_t;
+
+static inline void skip_ws(cursor_t *c) {
+    while (c->p < c->end &&
+           (*c->p == ' ' || *c->p == '\n' || *c->p == '\r' || *c->p == '\t')) {
+        c->p++;
+    }
+}
+
+// Skip white space and consume ch if it is next
+static inline bool accept(cursor_t *c, char ch) {
+    skip_ws(c);
+    if (c->p < c->end && *c->p == ch) {
+        c->p++;
+        return true;
+    }
+    return false;
+}
+
+static int utf8_put(char *out, unsigned cp) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    return 3;
+}
+
+// Unescape a string that contains backslashes into the scratch area
+static int unescape(cursor_t *c, const char *s, const char *e,
+                    collectd_str_t *out) {
+    char *dst = c->scratch + c->scratch_used;
+    char *limit = c->scratch + sizeof(c->scratch);
+
+    out->start = dst;
+    while (s < e) {
+        if (limit - dst < 4) {
+            return -1;
+        }
+        if (*s != '\\') {
+            *dst++ = *s++;
+            continue;
+        }
+        if (++s == e) {
+            return -1;
+        }
+        switch (*s++) {
+        case 'b':
+            *dst++ = '\b';
+            break;
+        case 'f':
+            *dst++ = '\f';
+            break;
+        case 'n':
+            *dst++ = '\n';
+            break;
+        case 'r':
+            *dst++ = '\r';
+            break;
+        case 't':
+            *dst++ = '\t';
+            break;
+        case 'u': {
+            char hex[5] = {0};
+            if (e - s < 4) {
+                return -1;
+            }
+            memcpy(hex, s, 4);
+            s += 4;
+            // Surrogate pairs are not expected in metric names
+            dst += utf8_put(dst, strtoul(hex, NULL, 16));
+            break;
+        }
+        default: // '"', '\\' and '/'
+            *dst++ = s[-1];
+        }
+    }
+    out->size = dst - out->start;
+    c->scratch_used += out->size;
+
+    return 0;
+}
+
+static int parse_string(cursor_t *c, collectd_str_t *out) {
+    bool escaped = false;
+
+    if (!accept(c, '"')) {
+        return -1;
+    }
+    const char *s = c->p;
+    const char *q = memchr(s, '"', c->end - s);
+
+    // Fast path, no escapes before the closing quote
+    if (q != NULL && memchr(s, '\\', q - s) == NULL) {
+        c->p = q + 1;
+        out->start = s;
+        out->size = q - s;
+        return 0;
+    }
+    while (c->p < c->end && *c->p != '"') {
+        if (*c->p == '\\') {
+            escaped = true;
+            c->p++;
+        }
+        c->p++;
+    }
+    if (c->p >= c->end) {
+        return -1;
+    }
+    const char *e = c->p++;
+
+    if (!escaped) {
+        out->start = s;
+        out->size = e - s;
+        return 0;
+    }
+    return unescape(c, s, e, out);
+}
+
+// A number, or null which is how collectd writes a NaN gauge
+static int parse_number(cursor_t *c, number_t *out) {
+    skip_ws(c);
+    const char *s = c->p;
+
+    if (c->end - s >= 4 && memcmp(s, "null", 4) == 0) {
+        c->p += 4;
+        out->start = s;
+        out->size = 0;
+        return 0;
+    }
+    while (c->p < c->end && *c->p != '\0' &&
+           strchr("0123456789+-.eE", *c->p)) {
+        c->p++;
+    }
+    if (c->p == s || c->p - s >= MAX_NUMBER_LEN) {
+        return -1;
+    }
+    out->start = s;
+    out->size = c->p - s;
+
+    return 0;
+}
+
+// Exact for up to 15 digits and 22 decimals, which covers what collectd
+// writes, anything else goes to strtod()
+static bool fast_double(const number_t *n, double *out) {
+    static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                   1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                   1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *p = n->start, *end = n->start + n->size;
+    uint64_t mantissa = 0;
+    int digits = 0, decimals = -1;
+    bool neg = false;
+
+    if (p < end && *p == '-') {
+        neg = true;
+        p++;
+    }
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9') {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits++;
+            if (decimals >= 0) {
+                decimals++;
+            }
+        } else if (*p == '.' && decimals < 0) {
+            decimals = 0;
+        } else {
+            return false;
+        }
+    }
+    if (digits == 0 || digits > 15 || decimals > 22) {
+        return false;
+    }
+    *out = decimals > 0 ? mantissa / pow10[decimals] : mantissa;
+    if (neg) {
+        *out = -*out;
+    }
+    return true;
+}
+
+static double number_double(const number_t *n) {
+    char buf[MAX_NUMBER_LEN];
+    double d;
+
+    if (n->size == 0) {
+        return NAN;
+    }
+    if (fast_double(n, &d)) {
+        return d;
+    }
+    memcpy(buf, n->start, n->size);
+    buf[n->size] = '\0';
+
+    return strtod(buf, NULL);
+}
+
+static int convert_value(const number_t *n, collectd_value_t *v) {
+    char buf[MAX_NUMBER_LEN];
+
+    if (v->dstype == COLLECTD_GAUGE) {
+        v->gauge = number_double(n);
+        return 0;
+    }
+    if (n->size == 0) {
+        return -1;
+    }
+    memcpy(buf, n->start, n->size);
+    buf[n->size] = '\0';
+    if (v->dstype == COLLECTD_DERIVE) {
+        v->derive = strtoll(buf, NULL, 10);
+    } else {
+        v->counter = strtoull(buf, NULL, 10);
+    }
+    return 0;
+}
+
+static int parse_dstype(cursor_t *c, uint8_t *dstype) {
+    collectd_str_t s;
+
+    if (parse_string(c, &s) != 0) {
+        return -1;
+    }
+    if (s.size == 5 && memcmp(s.start, "gauge", 5) == 0) {
+        *dstype = COLLECTD_GAUGE;
+    } else if (s.size == 6 && memcmp(s.start, "derive", 6) == 0) {
+        *dstype = COLLECTD_DERIVE;
+    } else if (s.size == 7 && memcmp(s.start, "counter", 7) == 0) {
+        *dstype = COLLECTD_COUNTER;
+    } else if (s.size == 8 && memcmp(s.start, "absolute", 8) == 0) {
+        *dstype = COLLECTD_ABSOLUTE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Skip any JSON value, for the keys we do not use
+static int skip_value(cursor_t *c) {
+    int depth = 0;
+    collectd_str_t str;
+
+    do {
+        skip_ws(c);
+        if (c->p >= c->end) {
+            return -1;
+        }
+        switch (*c->p) {
+        case '"':
+            if (parse_string(c, &str) != 0) {
+                return -1;
+            }
+            break;
+        case '{':
+        case '[':
+            if (++depth > MAX_DEPTH) {
+                return -1;
+            }
+            c->p++;
+            break;
+        case '}':
+        case ']':
+            if (--depth < 0) {
+                return -1;
+            }
+            c->p++;
+            break;
+        case ',':
+        case ':':
+            c->p++;
+            break;
+        default: { // numbers and literals
+            const char *s = c->p;
+            while (c->p < c->end && *c->p != '\0' &&
+                   !strchr(",:[]{}\" \t\r\n", *c->p)) {
+                c->p++;
+            }
+            if (c->p == s) {
+                return -1;
+            }
+        }
+        }
+    } while (depth > 0);
+
+    return 0;
+}
+
+static bool key_is(const collectd_str_t *key, const char *name) {
+    return key->size == strlen(name) &&
+           memcmp(key->start, name, key->size) == 0;
+}
+
+// "[" item ("," item)* "]", calls item for each element
+#define PARSE_ARRAY(c, n, max, item)                                           \
+    do {                                                                       \
+        (n) = 0;                                                               \
+        if (!accept(c, '[')) {                                                 \
+            return -1;                                                         \
+        }                                                                      \
+        if (!accept(c, ']')) {                                                 \
+            do {                                                               \
+                if ((n) == (max) || (item) != 0) {                             \
+                    return -1;                                                 \
+                }                                                              \
+                (n)++;                                                         \
+            } while (accept(c, ','));                                          \
+            if (!accept(c, ']')) {                                             \
+                return -1;                                                     \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+static int parse_metric(cursor_t *c, collectd_metric_t *m) {
+    number_t numbers[COLLECTD_MAX_VALUES];
+    int n_numbers = -1, n_dstypes = -1, n_dsnames = -1;
+    collectd_str_t key;
+    number_t n;
+
+    memset(m, 0, offsetof(collectd_metric_t, values));
+    c->scratch_used = 0;
+
+    if (!accept(c, '{')) {
+        return -1;
+    }
+    if (accept(c, '}')) {
+        return -1;
+    }
+    do {
+        if (parse_string(c, &key) != 0 || !accept(c, ':')) {
+            return -1;
+        }
+        int err = 0;
+        if (key_is(&key, "values")) {
+            PARSE_ARRAY(c, n_numbers, COLLECTD_MAX_VALUES,
+                        parse_number(c, &numbers[n_numbers]));
+        } else if (key_is(&key, "dstypes")) {
+            PARSE_ARRAY(c, n_dstypes, COLLECTD_MAX_VALUES,
+                        parse_dstype(c, &m->values[n_dstypes].dstype));
+        } else if (key_is(&key, "dsnames")) {
+            PARSE_ARRAY(c, n_dsnames, COLLECTD_MAX_VALUES,
+                        parse_string(c, &m->values[n_dsnames].dsname));
+        } else if (key_is(&key, "time")) {
+            err = parse_number(c, &n);
+            m->time = number_double(&n);
+        } else if (key_is(&key, "interval")) {
+            err = parse_number(c, &n);
+            m->interval = number_double(&n);
+        } else if (key_is(&key, "host")) {
+            err = parse_string(c, &m->host);
+        } else if (key_is(&key, "plugin")) {
+            err = parse_string(c, &m->plugin);
+        } else if (key_is(&key, "plugin_instance")) {
+            err = parse_string(c, &m->plugin_instance);
+        } else if (key_is(&key, "type")) {
+            err = parse_string(c, &m->type);
+        } else if (key_is(&key, "type_instance")) {
+            err = parse_string(c, &m->type_instance);
+        } else {
+            err = skip_value(c);
+        }
+        if (err) {
+            return -1;
+        }
+    } while (accept(c, ','));
+
+    if (!accept(c, '}')) {
+        return -1;
+    }
+    // dsnames may be left out, values and dstypes must match
+    if (n_numbers < 0 || n_numbers != n_dstypes ||
+        (n_dsnames >= 0 && n_dsnames != n_numbers)) {
+        return -1;
+    }
+    if (n_dsnames < 0) {
+        for (int i = 0; i < n_numbers; i++) {
+            m->values[i].dsname.size = 0;
+        }
+    }
+    m->n_values = n_numbers;
+    for (int i = 0; i < n_numbers; i++) {
+        if (convert_value(&numbers[i], &m->values[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int collectd_json_parse(const char *json, size_t len, collectd_metric_cb cb,
+                        void *ctx) {
+    cursor_t c; // not zeroed, the scratch area is large
+    collectd_metric_t m;
+    int count = 0;
+    int err;
+
+    c.p = json;
+    c.end = json + len;
+    skip_ws(&c);
+    if (c.p < c.end && *c.p == '{') {
+        if (parse_metric(&c, &m) != 0) {
+            return -1;
+        }
+        if ((err = cb(&m, ctx)) != 0) {
+            return err;
+        }
+        count = 1;
+    } else {
+        if (!accept(&c, '[')) {
+            return -1;
+        }
+        if (!accept(&c, ']')) {
+            do {
+                if (parse_metric(&c, &m) != 0) {
+                    return -1;
+                }
+                if ((err = cb(&m, ctx)) != 0) {
+                    return err;
+                }
+                count++;
+            } while (accept(&c, ','));
+            if (!accept(&c, ']')) {
+                return -1;
+            }
+        }
+    }
+    // Some senders NUL terminate the body
+    skip_ws(&c);
+    if (c.p < c.end && *c.p == '\0') {
+        c.p++;
+    }
+    return c.p == c.end ? count : -1;
+}
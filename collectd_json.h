@@ -0,0 +1,60 @@
+#ifndef _COLLECTD_JSON_H
+#define _COLLECTD_JSON_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COLLECTD_MAX_VALUES 64
+#define COLLECTD_SCRATCH_SIZE 4096 /* unescaped strings of one metric */
+
+enum collectd_dstype {
+    COLLECTD_GAUGE,
+    COLLECTD_DERIVE,
+    COLLECTD_COUNTER,
+    COLLECTD_ABSOLUTE
+};
+
+// Not NUL terminated, points into the message or into the parser scratch
+typedef struct {
+    const char *start;
+    size_t size;
+} collectd_str_t;
+
+typedef struct {
+    uint8_t dstype;
+    collectd_str_t dsname;
+    union {
+        double gauge; // NaN for a JSON null
+        int64_t derive;
+        uint64_t counter; // counter and absolute
+    };
+} collectd_value_t;
+
+// One element of collectd's JSON array format:
+//   {"values":[..],"dstypes":[..],"dsnames":[..],"time":..,"interval":..,
+//    "host":"..","plugin":"..","plugin_instance":"..","type":"..",
+//    "type_instance":".."}
+// Other keys, like "meta", are skipped.
+typedef struct {
+    double time;     // seconds since the epoch
+    double interval; // seconds
+    collectd_str_t host;
+    collectd_str_t plugin;
+    collectd_str_t plugin_instance;
+    collectd_str_t type;
+    collectd_str_t type_instance;
+    int n_values;
+    collectd_value_t values[COLLECTD_MAX_VALUES];
+} collectd_metric_t;
+
+// Called for every metric in turn, the strings are valid until it returns.
+// A non zero return stops the parse and is passed back to the caller.
+typedef int (*collectd_metric_cb)(collectd_metric_t *metric, void *ctx);
+
+// Parse a JSON array of metrics, or a single metric object, in one pass
+// without allocating.  Returns the number of metrics, or -1 if the message
+// is not collectd JSON, or the callback's return value if it stopped.
+extern int collectd_json_parse(const char *json, size_t len,
+                               collectd_metric_cb cb, void *ctx);
+
+#endif
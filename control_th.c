@@ -0,0 +1,301 @@
+// --control: live tuning over a local unix socket, without a restart.
+// One command per line, each answered by its output and then "ok" or
+// "error: <why>" on a line of their own.  "help" lists the commands.
+//
+//   echo queues | socat - UNIX-CONNECT:/run/sg-bridge/control
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bridge.h"
+#include "control_th.h"
+
+#define CONTROL_IDLE_S 60 /* a client silent that long is let go */
+
+// Returns NULL when done, or why the command failed
+typedef const char *(*control_fn)(app_data_t *app, char *arg, FILE *out);
+
+typedef struct {
+    const char *name;
+    const char *args;
+    control_fn fn;
+    const char *help;
+} control_cmd_t;
+
+static const char *cmd_help(app_data_t *app, char *arg, FILE *out);
+
+static int control_sock = -1;
+
+// The overload policy as changed so far, app->rb_policy is the one the
+// lanes started with
+static rb_policy_t live_policy;
+
+int control_open(const char *path) {
+    struct sockaddr_un name = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(name.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+    strcpy(name.sun_path, path);
+    unlink(path);
+    control_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (control_sock == -1 ||
+        bind(control_sock, (struct sockaddr *)&name, sizeof(name)) == -1 ||
+        listen(control_sock, 1) == -1) {
+        perror(path);
+        return -1;
+    }
+    return control_sock;
+}
+
+static int parse_bool(const char *arg) {
+    if (arg && (strcmp(arg, "on") == 0 || strcmp(arg, "1") == 0)) {
+        return 1;
+    }
+    if (arg && (strcmp(arg, "off") == 0 || strcmp(arg, "0") == 0)) {
+        return 0;
+    }
+    return -1;
+}
+
+static const char *cmd_queues(app_data_t *app, char *arg, FILE *out) {
+    rb_set_report(app->lanes, out);
+    fprintf(out, "queued: %d, free: %d, overruns: %ld, sent: %ld\n",
+            rb_set_queued(app->lanes), rb_free_size(app->rbin),
+            rb_set_overruns(app->lanes), app->sock_sent);
+    return NULL;
+}
+
+static const char *cmd_stat_period(app_data_t *app, char *arg, FILE *out) {
+    if (arg == NULL || atoi(arg) < 0) {
+        return "seconds expected";
+    }
+    __atomic_store_n(&app->stat_period, atoi(arg), __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static const char *cmd_pace(app_data_t *app, char *arg, FILE *out) {
+    char *bytes = arg ? strchr(arg, ' ') : NULL;
+    double msg_rate = arg ? atof(arg) : -1;
+    double byte_rate = bytes ? atof(bytes) : 0;
+
+    if (msg_rate < 0 || byte_rate < 0) {
+        return "msgs/s and optionally bytes/s expected";
+    }
+    if (app->pacer) {
+        pacer_set_rate(app->pacer, msg_rate, byte_rate);
+    } else if (msg_rate || byte_rate) {
+        // Never freed, rates of 0 turn it off
+        __atomic_store_n(&app->pacer,
+                         pacer_alloc(msg_rate, byte_rate,
+                                     atoi(DEFAULT_PACE_BURST)),
+                         __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static const char *cmd_drop_policy(app_data_t *app, char *arg, FILE *out) {
+    rb_policy_t policy = live_policy;
+
+    if (arg && strcmp(arg, "newest") == 0) {
+        policy.reserve_pct = 0;
+    } else if (arg && strcmp(arg, "oldest") == 0) {
+        policy.reserve_pct = DEFAULT_DROP_RESERVE_PCT;
+    } else {
+        return "newest or oldest expected";
+    }
+    live_policy = policy;
+    rb_set_policy_all(app->lanes, &policy);
+    return NULL;
+}
+
+static const char *cmd_drop_sample(app_data_t *app, char *arg, FILE *out) {
+    rb_policy_t policy = live_policy;
+    double rate = arg ? atof(arg) : -1;
+
+    if (rate < 0) {
+        return "N, P < 1 or 0 for off expected";
+    }
+    policy.sample_n = rate >= 1 ? rate : 0;
+    policy.sample_p = rate < 1 ? rate : 0;
+    live_policy = policy;
+    rb_set_policy_all(app->lanes, &policy);
+    return NULL;
+}
+
+static const char *cmd_drop_watermark(app_data_t *app, char *arg,
+                                      FILE *out) {
+    rb_policy_t policy = live_policy;
+    int pct = arg ? atoi(arg) : -1;
+
+    if (pct < 0 || pct > 100) {
+        return "percent expected";
+    }
+    policy.sample_mark_pct = pct;
+    live_policy = policy;
+    rb_set_policy_all(app->lanes, &policy);
+    return NULL;
+}
+
+static const char *cmd_amqp_block(app_data_t *app, char *arg, FILE *out) {
+    int block = parse_bool(arg);
+
+    if (block < 0) {
+        return "on or off expected";
+    }
+    if (block && app->fair) {
+        return "--fair_key source lanes never block";
+    }
+    if (!block && (app->synthetic || app->replay_file)) {
+        // They wait for room in the ring rather than overrun it
+        return "the synthetic source and replay always block";
+    }
+    if (block) {
+        rb_set_wake_producers(app->lanes, true);
+        app->amqp_block = true;
+    } else {
+        app->amqp_block = false;
+        rb_set_wake_producers(app->lanes, false);
+    }
+    return NULL;
+}
+
+static const char *cmd_block(app_data_t *app, char *arg, FILE *out) {
+    int block = parse_bool(arg);
+
+    if (block < 0) {
+        return "on or off expected";
+    }
+    if (block) {
+        __atomic_and_fetch(&app->socket_flags, ~MSG_DONTWAIT,
+                           __ATOMIC_RELAXED);
+    } else {
+        __atomic_or_fetch(&app->socket_flags, MSG_DONTWAIT, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static const char *cmd_gw_inet(app_data_t *app, char *arg, FILE *out) {
+    if (app->domain != AF_INET || app->shm_ring_sock) {
+        return "not sending to --gw_inet";
+    }
+    if (arg == NULL || strrchr(arg, ':') == NULL) {
+        return "host:port expected";
+    }
+    // The sender switches with its next message
+    free(__atomic_exchange_n(&app->retarget, strdup(arg), __ATOMIC_RELEASE));
+    return NULL;
+}
+
+static const char *cmd_rbc(app_data_t *app, char *arg, FILE *out) {
+    if (arg == NULL || atoi(arg) <= 0) {
+        return "count expected";
+    }
+    int limit = rb_set_limit(app->rbin, atoi(arg));
+    if (limit < 0) {
+        return "the ring is not elastic, see --rb_mem_max";
+    }
+    fprintf(out, "rbc: %d, between %d and %d\n", limit, app->rbin->segment,
+            app->rbin->count);
+    return NULL;
+}
+
+static const control_cmd_t commands[] = {
+    {"help", "", cmd_help, "This list"},
+    {"queues", "", cmd_queues, "Queue depth of every lane"},
+    {"stat_period", "seconds", cmd_stat_period, "0 for no periodic stats"},
+    {"pace", "msgs/s [bytes/s]", cmd_pace, "Output rate limit, 0 for none"},
+    {"drop_policy", "newest|oldest", cmd_drop_policy,
+     "Which messages a full ring buffer drops"},
+    {"drop_sample", "N|P|0", cmd_drop_sample,
+     "Above the watermark keep 1 in N, or with probability P"},
+    {"drop_watermark", "percent", cmd_drop_watermark,
+     "Queued part of the ring where sampling starts"},
+    {"amqp_block", "on|off", cmd_amqp_block,
+     "Stop granting credit when the ring is full"},
+    {"block", "on|off", cmd_block, "Blocking sends to the gateway"},
+    {"gw_inet", "host:port", cmd_gw_inet, "Send to another gateway"},
+    {"rbc", "count", cmd_rbc, "Entries the elastic ring buffer may use"},
+    {NULL}};
+
+static const char *cmd_help(app_data_t *app, char *arg, FILE *out) {
+    for (const control_cmd_t *c = commands; c->name; c++) {
+        fprintf(out, "%-14s %-18s %s\n", c->name, c->args, c->help);
+    }
+    return NULL;
+}
+
+static void serve(app_data_t *app, int conn) {
+    struct timeval idle = {.tv_sec = CONTROL_IDLE_S};
+    int out_fd = dup(conn);
+    FILE *in = fdopen(conn, "r");
+    FILE *out = out_fd == -1 ? NULL : fdopen(out_fd, "w");
+    char *line = NULL;
+    size_t size = 0;
+
+    if (in == NULL || out == NULL) {
+        perror("control");
+        if (in) {
+            fclose(in);
+        } else {
+            close(conn);
+        }
+        if (out) {
+            fclose(out);
+        } else if (out_fd != -1) {
+            close(out_fd);
+        }
+        return;
+    }
+    // Another client waits behind this one
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    while (getline(&line, &size, in) > 0) {
+        char *save;
+        char *name = strtok_r(line, " \t\r\n", &save);
+        char *arg = strtok_r(NULL, "\r\n", &save);
+        const control_cmd_t *c = commands;
+
+        if (name == NULL) {
+            continue;
+        }
+        while (c->name && strcmp(c->name, name) != 0) {
+            c++;
+        }
+        const char *err = c->name ? c->fn(app, arg, out) : "unknown command";
+        if (err) {
+            fprintf(out, "error: %s\n", err);
+        } else {
+            fprintf(out, "ok\n");
+            if (strcmp(name, "help") != 0 && strcmp(name, "queues") != 0) {
+                printf("control: %s %s\n", name, arg ? arg : "");
+                fflush(stdout);
+            }
+        }
+        fflush(out);
+    }
+    free(line);
+    fclose(in);
+    fclose(out);
+}
+
+void *control_th(void *app_ptr) {
+    app_data_t *app = (app_data_t *)app_ptr;
+
+    live_policy = app->rb_policy;
+    while (1) {
+        int conn = accept(control_sock, NULL, NULL);
+        if (conn == -1) {
+            perror("control: accept");
+            continue;
+        }
+        serve(app, conn);
+    }
+    return NULL;
+}
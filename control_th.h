@@ -0,0 +1,11 @@
+#ifndef _CONTROL_TH_H
+#define _CONTROL_TH_H 1
+
+// Bind the --control unix socket, -1 on failure
+extern int control_open(const char *path);
+
+// Serve commands on the socket control_open() returned, one client at a
+// time, until the process exits
+extern void *control_th(void *app_ptr);
+
+#endif
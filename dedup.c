@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dedup.h"
+
+static uint64_t dedup_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+dedup_t *dedup_alloc(int window_s, int max_keys) {
+    dedup_t *dd = calloc(1, sizeof(dedup_t));
+
+    if (dd == NULL) {
+        return NULL;
+    }
+    // Half full at most, so probes stay short
+    dd->n_slots = 1024;
+    while (dd->n_slots < 2 * (uint32_t)max_keys) {
+        dd->n_slots *= 2;
+    }
+    for (int i = 0; i < 2; i++) {
+        if ((dd->gen[i] = calloc(dd->n_slots, sizeof(uint64_t))) == NULL) {
+            dedup_free(dd);
+            return NULL;
+        }
+    }
+    dd->window_ns = window_s * 1000000000ULL;
+    dd->rotate_at = dedup_clock() + dd->window_ns;
+
+    return dd;
+}
+
+void dedup_free(dedup_t *dd) {
+    if (dd == NULL) {
+        return;
+    }
+    free(dd->gen[0]);
+    free(dd->gen[1]);
+    free(dd);
+}
+
+// The slot of key in generation g, or the empty one where it would go
+static uint64_t *dedup_slot(dedup_t *dd, int g, uint64_t key) {
+    uint32_t mask = dd->n_slots - 1;
+    uint32_t idx = key & mask;
+
+    while (dd->gen[g][idx] != 0 && dd->gen[g][idx] != key) {
+        idx = (idx + 1) & mask;
+    }
+    return &dd->gen[g][idx];
+}
+
+// The current generation becomes the old one, the old one is cleared
+static void dedup_rotate(dedup_t *dd, uint64_t now) {
+    dd->cur ^= 1;
+    memset(dd->gen[dd->cur], 0, dd->n_slots * sizeof(uint64_t));
+    dd->used[dd->cur] = 0;
+    dd->rotate_at = now + dd->window_ns;
+}
+
+// Start a new generation when the current one is a window old or full
+static void dedup_age(dedup_t *dd) {
+    uint64_t now = dedup_clock();
+
+    if (now >= dd->rotate_at) {
+        dedup_rotate(dd, now);
+    } else if (dd->used[dd->cur] >= dd->n_slots / 2) {
+        dd->early++;
+        dedup_rotate(dd, now);
+    }
+}
+
+bool dedup_has(dedup_t *dd, uint64_t key) {
+    key = key ? key : 1; // 0 marks empty slots
+    dedup_age(dd);
+
+    if (*dedup_slot(dd, dd->cur, key) == key ||
+        *dedup_slot(dd, dd->cur ^ 1, key) == key) {
+        dd->checked++;
+        dd->dups++;
+        return true;
+    }
+    return false;
+}
+
+void dedup_add(dedup_t *dd, uint64_t key) {
+    key = key ? key : 1;
+    dedup_age(dd);
+
+    uint64_t *slot = dedup_slot(dd, dd->cur, key);
+    if (*slot != key) {
+        *slot = key;
+        dd->used[dd->cur]++;
+    }
+    dd->checked++;
+}
+
+bool dedup_seen(dedup_t *dd, uint64_t key) {
+    if (dedup_has(dd, key)) {
+        return true;
+    }
+    dedup_add(dd, key);
+
+    return false;
+}
@@ -0,0 +1,44 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEDUP_MAX_KEYS (1 << 26) /* 2GB of tables */
+
+// --dedup: drop messages already seen within a time window, as sent twice
+// by redundant router paths.  Keys are 64 bit hashes kept in two
+// generations of a fixed size table: lookups check both, inserts go to the
+// current one, and the older one is cleared when the current one is a
+// window old or half full.  A key is remembered for one to two windows,
+// less under a rate the table cannot hold.
+typedef struct {
+    uint64_t *gen[2]; // open addressing, linear probing, 0 for empty
+    uint32_t n_slots; // per generation, a power of 2
+    uint32_t used[2];
+    int cur;
+    uint64_t window_ns;
+    uint64_t rotate_at; // CLOCK_MONOTONIC ns
+
+    // stats
+    volatile long checked;
+    volatile long dups;
+    volatile long early; // rotations because a generation was half full
+} dedup_t;
+
+// A window of window_s seconds, holding up to max_keys keys each, 1 to
+// DEDUP_MAX_KEYS
+extern dedup_t *dedup_alloc(int window_s, int max_keys);
+
+extern void dedup_free(dedup_t *dd);
+
+// Whether key was seen in the window, remember it if not
+extern bool dedup_seen(dedup_t *dd, uint64_t key);
+
+// Whether key was seen in the window, without remembering it
+extern bool dedup_has(dedup_t *dd, uint64_t key);
+
+// Remember a key dedup_has() did not find, once the message went out
+extern void dedup_add(dedup_t *dd, uint64_t key);
+
+#endif
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fair.h"
+#include "utils.h"
+
+// A lane of its own for a source, called with the mutex held
+static rb_lane_t *add_lane(fair_t *fair, const char *name) {
+    rb_rwbytes_t *rb = rb_alloc_elastic(fair->count, fair->max_count,
+                                        fair->buf_size, 0);
+    if (rb == NULL) {
+        return NULL;
+    }
+    rb_set_policy(rb, fair->policy);
+
+    rb_lane_t *lane = rb_set_add(fair->set, rb, name);
+    if (lane == NULL) {
+        rb_free(rb);
+        return NULL;
+    }
+    lane->shared = true;
+
+    return lane;
+}
+
+fair_t *fair_alloc(const char *key, rb_set_t *set, int count,
+                   int max_count, int buf_size, const rb_policy_t *policy) {
+    if (strlen(key) >= FAIR_NAME_LEN) {
+        return NULL;
+    }
+    fair_t *fair = calloc(1, sizeof(fair_t));
+
+    fair->pattern_len = snprintf(fair->pattern, sizeof(fair->pattern),
+                                 "\"%s\":", key);
+    fair->set = set;
+    fair->count = count;
+    fair->max_count = max_count;
+    fair->buf_size = buf_size;
+    fair->policy = policy;
+    pthread_mutex_init(&fair->mutex, NULL);
+
+    // Made up front, so there is always room for it
+    pthread_mutex_lock(&fair->mutex);
+    fair->other = add_lane(fair, "source/other");
+    pthread_mutex_unlock(&fair->mutex);
+    if (fair->other == NULL) {
+        free(fair);
+        return NULL;
+    }
+    return fair;
+}
+
+// The string value of the key, the first one in the message
+static const char *source_value(fair_t *fair, const char *msg, size_t len,
+                                size_t *value_len) {
+    const char *end = msg + len;
+    const char *p = memmem(msg, len, fair->pattern, fair->pattern_len);
+
+    if (p == NULL) {
+        return NULL;
+    }
+    for (p += fair->pattern_len; p < end && *p == ' '; p++)
+        ;
+    if (p == end || *p != '"') {
+        return NULL;
+    }
+    p++;
+    const char *q = memchr(p, '"', end - p);
+    if (q == NULL) {
+        return NULL;
+    }
+    *value_len = q - p;
+
+    return p;
+}
+
+static rb_lane_t *find_source(fair_t *fair, int from, int to, uint32_t hash,
+                              const char *value, size_t len) {
+    size_t cmp = len < FAIR_NAME_LEN - 1 ? len : FAIR_NAME_LEN - 1;
+
+    for (int i = from; i < to; i++) {
+        fair_source_t *s = &fair->sources[i];
+        if (s->hash == hash && s->len == len &&
+            memcmp(s->name, value, cmp) == 0) {
+            return s->lane;
+        }
+    }
+    return NULL;
+}
+
+rb_lane_t *fair_lane(fair_t *fair, const char *msg, size_t len) {
+    size_t value_len;
+    const char *value = source_value(fair, msg, len, &value_len);
+
+    if (value == NULL) {
+        __atomic_add_fetch(&fair->unclassified, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    uint32_t hash = fnv1a(FNV1A_INIT, value, value_len);
+    int n = __atomic_load_n(&fair->n_sources, __ATOMIC_ACQUIRE);
+    rb_lane_t *lane = find_source(fair, 0, n, hash, value, value_len);
+    if (lane) {
+        return lane;
+    }
+    if (n == FAIR_MAX_SOURCES ||
+        __atomic_load_n(&fair->full, __ATOMIC_RELAXED)) {
+        return fair->other;
+    }
+
+    pthread_mutex_lock(&fair->mutex);
+    // Another thread may have added it meanwhile
+    lane = find_source(fair, n, fair->n_sources, hash, value, value_len);
+    if (lane == NULL && !fair->full && fair->n_sources < FAIR_MAX_SOURCES) {
+        fair_source_t *s = &fair->sources[fair->n_sources];
+        char name[RB_LANE_NAME_LEN];
+
+        s->hash = hash;
+        s->len = value_len;
+        snprintf(s->name, sizeof(s->name), "%.*s", (int)value_len, value);
+        snprintf(name, sizeof(name), "source/%s", s->name);
+        if ((s->lane = add_lane(fair, name)) != NULL) {
+            lane = s->lane;
+            __atomic_store_n(&fair->n_sources, fair->n_sources + 1,
+                             __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&fair->full, true, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&fair->mutex);
+
+    return lane ? lane : fair->other;
+}
@@ -0,0 +1,54 @@
+#ifndef _FAIR_H
+#define _FAIR_H 1
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rb_set.h"
+
+#define FAIR_MAX_SOURCES 32
+#define FAIR_NAME_LEN 48
+
+// --fair_key: messages are sorted by the value of a JSON string field, the
+// "host" of collectd metrics for example, into a small non blocking lane
+// per value.  With RB_SCHED_FAIR every source then gets its share of the
+// output, and a flooding one overruns its own lane only.  Sources past
+// FAIR_MAX_SOURCES share one lane.
+typedef struct {
+    uint32_t hash;
+    size_t len;
+    char name[FAIR_NAME_LEN]; // the value, cut short if longer
+    rb_lane_t *lane;
+} fair_source_t;
+
+// Looked up from every proactor thread, sources are only ever added
+typedef struct {
+    char pattern[FAIR_NAME_LEN + 4]; // "key":
+    size_t pattern_len;
+
+    rb_set_t *set;
+    int count;     // ring buffer entries per source
+    int max_count; // for elastic rings, 0 for fixed ones
+    int buf_size;
+    const rb_policy_t *policy;
+
+    fair_source_t sources[FAIR_MAX_SOURCES];
+    volatile int n_sources;
+    rb_lane_t *other;      // for the sources that found no room
+    bool full;             // the set took no more lanes, stop trying
+    pthread_mutex_t mutex; // held to add a source
+
+    // stats
+    volatile long unclassified; // messages without the key, left on the link
+} fair_t;
+
+extern fair_t *fair_alloc(const char *key, rb_set_t *set, int count,
+                          int max_count, int buf_size,
+                          const rb_policy_t *policy);
+
+// The lane of the message's source, NULL if it names none
+extern rb_lane_t *fair_lane(fair_t *fair, const char *msg, size_t len);
+
+#endif
@@ -0,0 +1,262 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oslo.h"
+
+#define MAX_DEPTH 2 /* the envelope, or one under "request" */
+
+typedef struct {
+    const char *p;
+    const char *end;
+} cursor_t;
+
+oslo_t *oslo_alloc(void) { return calloc(1, sizeof(oslo_t)); }
+
+void oslo_free(oslo_t *oslo) {
+    if (oslo) {
+        free(oslo->out);
+        free(oslo);
+    }
+}
+
+static inline void skip_ws(cursor_t *c) {
+    while (c->p < c->end &&
+           (*c->p == ' ' || *c->p == '\n' || *c->p == '\r' || *c->p == '\t')) {
+        c->p++;
+    }
+}
+
+// Skip white space and consume ch if it is next
+static inline bool accept(cursor_t *c, char ch) {
+    skip_ws(c);
+    if (c->p < c->end && *c->p == ch) {
+        c->p++;
+        return true;
+    }
+    return false;
+}
+
+// Past the closing quote of the string the cursor is in
+static int skip_string(cursor_t *c) {
+    while (c->p < c->end) {
+        const char *q = memchr(c->p, '"', c->end - c->p);
+        if (q == NULL) {
+            return -1;
+        }
+        // Escaped if an odd number of backslashes precede it
+        const char *b = q;
+        while (b > c->p && b[-1] == '\\') {
+            b--;
+        }
+        c->p = q + 1;
+        if ((q - b) % 2 == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Any JSON value, nested ones by counting brackets outside of strings
+static int skip_value(cursor_t *c) {
+    int depth = 0;
+
+    skip_ws(c);
+    do {
+        if (c->p >= c->end) {
+            return -1;
+        }
+        switch (*c->p++) {
+        case '"':
+            if (skip_string(c) < 0) {
+                return -1;
+            }
+            break;
+        case '{':
+        case '[':
+            depth++;
+            break;
+        case '}':
+        case ']':
+            depth--;
+            break;
+        case ',':
+            if (depth == 0) {
+                c->p--; // a scalar ended
+                return 0;
+            }
+            break;
+        default:
+            if (depth == 0) {
+                // A number, true, false or null
+                while (c->p < c->end && !strchr(",}] \t\r\n", *c->p)) {
+                    c->p++;
+                }
+                return 0;
+            }
+        }
+    } while (depth > 0);
+
+    return 0;
+}
+
+static bool key_is(const char *s, size_t len, const char *key) {
+    return len == strlen(key) && memcmp(s, key, len) == 0;
+}
+
+static int hex4(const char *s, unsigned *out) {
+    *out = 0;
+    for (int i = 0; i < 4; i++) {
+        char ch = s[i];
+        int d = ch >= '0' && ch <= '9'   ? ch - '0'
+                : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+                : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10
+                                         : -1;
+        if (d < 0) {
+            return -1;
+        }
+        *out = *out << 4 | d;
+    }
+    return 0;
+}
+
+static char *utf8_put(char *out, unsigned cp) {
+    if (cp < 0x80) {
+        *out++ = cp;
+    } else if (cp < 0x800) {
+        *out++ = 0xc0 | (cp >> 6);
+        *out++ = 0x80 | (cp & 0x3f);
+    } else if (cp < 0x10000) {
+        *out++ = 0xe0 | (cp >> 12);
+        *out++ = 0x80 | ((cp >> 6) & 0x3f);
+        *out++ = 0x80 | (cp & 0x3f);
+    } else {
+        *out++ = 0xf0 | (cp >> 18);
+        *out++ = 0x80 | ((cp >> 12) & 0x3f);
+        *out++ = 0x80 | ((cp >> 6) & 0x3f);
+        *out++ = 0x80 | (cp & 0x3f);
+    }
+    return out;
+}
+
+// Unescape the string the cursor is in to oslo->out, which is never
+// longer than the escaped string
+static int unescape(oslo_t *oslo, cursor_t *c, size_t *len) {
+    if (oslo->out_size < (size_t)(c->end - c->p)) {
+        oslo->out_size = c->end - c->p;
+        free(oslo->out);
+        if ((oslo->out = malloc(oslo->out_size)) == NULL) {
+            oslo->out_size = 0;
+            return -1;
+        }
+    }
+    char *dst = oslo->out;
+
+    while (c->p < c->end) {
+        // Copy up to the next quote or backslash in one go
+        const char *s = c->p;
+        while (c->p < c->end && *c->p != '"' && *c->p != '\\') {
+            c->p++;
+        }
+        memcpy(dst, s, c->p - s);
+        dst += c->p - s;
+        if (c->p == c->end) {
+            return -1;
+        }
+        if (*c->p++ == '"') {
+            *len = dst - oslo->out;
+            return 0;
+        }
+        if (c->p == c->end) {
+            return -1;
+        }
+        switch (*c->p++) {
+        case 'b':
+            *dst++ = '\b';
+            break;
+        case 'f':
+            *dst++ = '\f';
+            break;
+        case 'n':
+            *dst++ = '\n';
+            break;
+        case 'r':
+            *dst++ = '\r';
+            break;
+        case 't':
+            *dst++ = '\t';
+            break;
+        case 'u': {
+            unsigned cp, lo;
+            if (c->end - c->p < 4 || hex4(c->p, &cp) < 0) {
+                return -1;
+            }
+            c->p += 4;
+            // A surrogate pair is 12 escaped bytes for 4 UTF-8 ones
+            if (cp >= 0xd800 && cp < 0xdc00 && c->end - c->p >= 6 &&
+                c->p[0] == '\\' && c->p[1] == 'u' &&
+                hex4(c->p + 2, &lo) == 0 && lo >= 0xdc00 && lo < 0xe000) {
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                c->p += 6;
+            }
+            dst = utf8_put(dst, cp);
+            break;
+        }
+        default: // '"', '\\' and '/'
+            *dst++ = c->p[-1];
+        }
+    }
+    return -1;
+}
+
+// The members of the object the cursor is in, the payload once found
+static int parse_object(oslo_t *oslo, cursor_t *c, int depth, size_t *len) {
+    if (!accept(c, '{')) {
+        return -1;
+    }
+    do {
+        skip_ws(c);
+        if (!accept(c, '"')) {
+            return -1;
+        }
+        const char *key = c->p;
+        if (skip_string(c) < 0) {
+            return -1;
+        }
+        size_t key_len = c->p - 1 - key;
+        if (!accept(c, ':')) {
+            return -1;
+        }
+        if (key_is(key, key_len, "oslo.message") && accept(c, '"')) {
+            return unescape(oslo, c, len);
+        }
+        skip_ws(c);
+        if (key_is(key, key_len, "request") && depth < MAX_DEPTH &&
+            c->p < c->end && *c->p == '{') {
+            const char *value = c->p;
+            if (parse_object(oslo, c, depth + 1, len) == 0) {
+                return 0;
+            }
+            c->p = value;
+        }
+        if (skip_value(c) < 0) {
+            return -1;
+        }
+    } while (accept(c, ','));
+
+    return -1;
+}
+
+int oslo_unwrap(oslo_t *oslo, const char *json, size_t len,
+                const char **payload, size_t *payload_len) {
+    cursor_t c = {json, json + len};
+
+    if (parse_object(oslo, &c, 1, payload_len) < 0) {
+        oslo->passed++;
+        return -1;
+    }
+    *payload = oslo->out;
+    oslo->unwrapped++;
+
+    return 0;
+}
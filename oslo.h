@@ -0,0 +1,29 @@
+#ifndef _OSLO_H
+#define _OSLO_H 1
+
+#include <stddef.h>
+
+// --oslo_unwrap: ceilometer notifications come as an oslo.messaging
+// envelope,
+//   {"oslo.version":"2.0","oslo.message":"<the payload as a JSON string>"}
+// at the top level or under "request".  The payload is forwarded on its
+// own, unescaped, so the consumer parses JSON once.
+typedef struct {
+    char *out; // the last payload
+    size_t out_size;
+
+    // stats
+    volatile long unwrapped;
+    volatile long passed; // not an envelope, sent as they came
+} oslo_t;
+
+extern oslo_t *oslo_alloc(void);
+
+extern void oslo_free(oslo_t *oslo);
+
+// Find and unescape the payload in one pass over the message.  Returns -1
+// if json is not an envelope, the payload is valid until the next call.
+extern int oslo_unwrap(oslo_t *oslo, const char *json, size_t len,
+                       const char **payload, size_t *payload_len);
+
+#endif
@@ -0,0 +1,122 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pacer.h"
+
+static uint64_t pacer_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pacer_apply_rate(pacer_t *pacer, double msg_rate,
+                             double byte_rate) {
+    // Never less than one message, or one full UDP datagram
+    pacer->msg_burst = msg_rate * pacer->burst_ms / 1000;
+    pacer->msg_burst = pacer->msg_burst < 1 ? 1 : pacer->msg_burst;
+    pacer->byte_burst = byte_rate * pacer->burst_ms / 1000;
+    pacer->byte_burst = pacer->byte_burst < 65536 ? 65536 : pacer->byte_burst;
+    pacer->msg_rate = msg_rate;
+    pacer->byte_rate = byte_rate;
+}
+
+pacer_t *pacer_alloc(double msg_rate, double byte_rate, int burst_ms) {
+    pacer_t *pacer = calloc(1, sizeof(pacer_t));
+
+    pacer->burst_ms = burst_ms;
+    pacer_apply_rate(pacer, msg_rate, byte_rate);
+    pacer->msg_tokens = pacer->msg_burst;
+    pacer->byte_tokens = pacer->byte_burst;
+    pacer->last = pacer_clock();
+
+    return pacer;
+}
+
+// Handed over whole, the thread that takes tokens applies them
+void pacer_set_rate(pacer_t *pacer, double msg_rate, double byte_rate) {
+    double *rate = malloc(2 * sizeof(double));
+
+    if (rate == NULL) {
+        return;
+    }
+    rate[0] = msg_rate;
+    rate[1] = byte_rate;
+    free(__atomic_exchange_n(&pacer->next_rate, rate, __ATOMIC_RELEASE));
+}
+
+void pacer_free(pacer_t *pacer) {
+    if (pacer) {
+        free(pacer->next_rate);
+    }
+    free(pacer);
+}
+
+static void pacer_refill(pacer_t *pacer, uint64_t now) {
+    if (__atomic_load_n(&pacer->next_rate, __ATOMIC_RELAXED)) {
+        double *rate =
+            __atomic_exchange_n(&pacer->next_rate, NULL, __ATOMIC_ACQUIRE);
+        if (rate) {
+            pacer_apply_rate(pacer, rate[0], rate[1]);
+            free(rate);
+        }
+    }
+
+    double secs = (now - pacer->last) / 1e9;
+
+    pacer->last = now;
+    pacer->msg_tokens += secs * pacer->msg_rate;
+    if (pacer->msg_tokens > pacer->msg_burst) {
+        pacer->msg_tokens = pacer->msg_burst;
+    }
+    pacer->byte_tokens += secs * pacer->byte_rate;
+    if (pacer->byte_tokens > pacer->byte_burst) {
+        pacer->byte_tokens = pacer->byte_burst;
+    }
+}
+
+// ns until both buckets are out of debt
+static uint64_t pacer_debt_ns(pacer_t *pacer) {
+    double secs = 0;
+
+    if (pacer->msg_rate && pacer->msg_tokens < 0) {
+        secs = -pacer->msg_tokens / pacer->msg_rate;
+    }
+    if (pacer->byte_rate && pacer->byte_tokens < 0 &&
+        -pacer->byte_tokens / pacer->byte_rate > secs) {
+        secs = -pacer->byte_tokens / pacer->byte_rate;
+    }
+    return secs * 1e9;
+}
+
+bool pacer_ready(pacer_t *pacer) {
+    pacer_refill(pacer, pacer_clock());
+
+    return pacer_debt_ns(pacer) == 0;
+}
+
+void pacer_take(pacer_t *pacer, int n, size_t bytes, bool wait) {
+    uint64_t now = pacer_clock();
+
+    pacer_refill(pacer, now);
+    if (pacer->msg_rate) {
+        pacer->msg_tokens -= n;
+    }
+    if (pacer->byte_rate) {
+        pacer->byte_tokens -= bytes;
+    }
+
+    uint64_t debt = pacer_debt_ns(pacer);
+    if (debt == 0 || !wait) {
+        return;
+    }
+    // Absolute, so a signal does not stretch the sleep
+    uint64_t until = now + debt;
+    struct timespec ts = {until / 1000000000, until % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+    pacer->waits++;
+    pacer->wait_ns += pacer_clock() - now;
+}
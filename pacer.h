@@ -0,0 +1,47 @@
+#ifndef _PACER_H
+#define _PACER_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Token buckets for messages and bytes in front of the output, --pace.
+// Every send takes its tokens first, a bucket may go into debt for a batch
+// bigger than its burst, and the sender sleeps until it is paid back.
+typedef struct {
+    double msg_rate;  // per second, 0 for no limit
+    double byte_rate; // per second, 0 for no limit
+    double msg_burst; // bucket depths
+    double byte_burst;
+    int burst_ms;
+
+    double msg_tokens;
+    double byte_tokens;
+    uint64_t last; // CLOCK_MONOTONIC ns of the last refill
+
+    // Message and byte rates from pacer_set_rate(), for the next refill
+    double *volatile next_rate;
+
+    // stats
+    volatile long waits;
+    volatile uint64_t wait_ns;
+} pacer_t;
+
+// burst_ms of either rate can go out back to back
+extern pacer_t *pacer_alloc(double msg_rate, double byte_rate, int burst_ms);
+
+extern void pacer_free(pacer_t *pacer);
+
+// New rates, also while the pacer is in use, from any thread: the sender
+// picks them up with its next send
+extern void pacer_set_rate(pacer_t *pacer, double msg_rate, double byte_rate);
+
+// Whether a send could go out now, without waiting
+extern bool pacer_ready(pacer_t *pacer);
+
+// Take the tokens of n messages of bytes in total, then sleep until the
+// buckets are out of debt if wait is set.  Without wait the debt delays
+// the next send that waits.
+extern void pacer_take(pacer_t *pacer, int n, size_t bytes, bool wait);
+
+#endif
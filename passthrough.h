@@ -0,0 +1,23 @@
+#ifndef _PASSTHROUGH_H
+#define _PASSTHROUGH_H 1
+
+#include <stdint.h>
+
+#define PASSTHROUGH_MAGIC 0x5342 /* "SB" */
+#define PASSTHROUGH_VERSION 1
+
+// Optional header in front of every raw AMQP message forwarded with
+// --passthrough_header, all integers in network byte order:
+//
+//   passthrough_hdr_t
+//   name_len bytes: the lane the message came in on, the AMQP address
+//                   when connected to a router, conn-N/link in standalone
+//   msg_len bytes:  the AMQP encoded message as received, all sections
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t name_len;
+    uint32_t msg_len;
+} passthrough_hdr_t;
+
+#endif
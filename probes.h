@@ -0,0 +1,36 @@
+#ifndef _PROBES_H
+#define _PROBES_H 1
+
+// USDT probes for bpftrace and perf, provider "sg_bridge".  With
+// <sys/sdt.h> (systemtap-sdt-devel) each probe is a nop in the code and a
+// note in the ELF, without it they compile to nothing.  Examples using them
+// are in tools/bpftrace.
+//
+//   delivery(link, pending)       readable delivery, pending bytes
+//   rb_put(rb, start, size)       message committed to a ring
+//   rb_overrun(rb)                ring full, the newest message dropped
+//   rb_park(rb_or_set)            consumer waits for data
+//   rb_wake(rb_or_set)            consumer woke up
+//   decode_start(start, size)     the sender starts on a message
+//   decode_end(start, err)        and is done with it
+//   send(bytes, errno)            result of a send, errno 0 on success
+//   credit(link, credit)          credit granted to a link
+//   batch_start()                 proactor handed a batch of events
+//   batch_end(events)             and the batch is done
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE(name) DTRACE_PROBE(sg_bridge, name)
+#define PROBE1(name, a) DTRACE_PROBE1(sg_bridge, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(sg_bridge, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(sg_bridge, name, a, b, c)
+#else
+#define PROBE(name)                                                            \
+    do {                                                                       \
+    } while (0)
+#define PROBE1(name, a) PROBE(name)
+#define PROBE2(name, a, b) PROBE(name)
+#define PROBE3(name, a, b, c) PROBE(name)
+#endif
+
+#endif
@@ -2,81 +2,446 @@
 #include <features.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <proton/types.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "probes.h"
 #include "rb.h"
 #include "utils.h"
 
-rb_rwbytes_t *rb_alloc(int count, int buf_size, bool wake_producer) {
-    rb_rwbytes_t *rb = malloc(sizeof(rb_rwbytes_t));
-
-    rb->count = count;
+// An elastic ring starts with count entries and grows, count entries at a
+// time, up to max_count while it stays nearly full.  It shrinks again after
+// RB_SHRINK_NS at low occupancy.
+rb_rwbytes_t *rb_alloc_elastic(int count, int max_count, int buf_size,
+                               bool wake_producer) {
+    rb_rwbytes_t *rb = calloc(1, sizeof(rb_rwbytes_t));
+
+    max_count = max_count < count ? count : max_count;
+    rb->count = max_count;
+    rb->active = count;
+    rb->limit = max_count;
+    rb->segment = count;
     rb->buf_size = buf_size;
     rb->wake_producer = wake_producer;
 
-    if ((rb->ring_buffer = malloc(count * sizeof(pn_rwbytes_t))) == NULL) {
+    // Only the entries, the buffers come with the first use
+    if ((rb->ring_buffer = calloc(max_count, sizeof(pn_rwbytes_t))) == NULL) {
         free(rb);
 
         return NULL;
     }
+    if (max_count > count &&
+        (rb->spare = malloc(max_count * sizeof(char *))) == NULL) {
+        rb_free(rb);
 
-    for (int i = 0; i < count; i++) {
-        if ((rb->ring_buffer[i].start = malloc(buf_size)) == NULL) {
-            rb_free(rb);
-
-            return NULL;
-        }
-        rb->ring_buffer[i].size = 0;
+        return NULL;
     }
     rb->head = 0;
-    rb->tail = count - 1;
+    rb->tail = max_count - 1;
+    rb->reclaim = rb->tail;
 
     rb->overruns = 0;
     rb->processed = 0;
     rb->queue_block = 0;
 
-    rb->total_active.tv_sec = 0;
-    rb->total_active.tv_nsec = 0;
+    pthread_cond_init(&rb->rb_ready, NULL);
+    pthread_mutex_init(&rb->rb_mutex, NULL);
+    rb->ready_mutex = &rb->rb_mutex;
+    rb->ready_cond = &rb->rb_ready;
+    // Also without wake_producer, that --control can turn on
+    pthread_cond_init(&rb->rb_free, NULL);
 
-    rb->total_wait.tv_sec = 0;
-    rb->total_wait.tv_nsec = 0;
+    return rb;
+}
 
-    rb->total_t1.tv_sec = 0;
-    rb->total_t1.tv_nsec = 0;
+rb_rwbytes_t *rb_alloc(int count, int buf_size, bool wake_producer) {
+    return rb_alloc_elastic(count, count, buf_size, wake_producer);
+}
 
-    rb->total_t2.tv_sec = 0;
-    rb->total_t2.tv_nsec = 0;
+static rb_file_slot_t *rb_file_slot(rb_rwbytes_t *rb, int idx) {
+    return (rb_file_slot_t *)((char *)(rb->file + 1) + idx * rb->file_stride);
+}
 
-    pthread_cond_init(&rb->rb_ready, NULL);
-    pthread_mutex_init(&rb->rb_mutex, NULL);
+// Whether the file holds a ring of this shape with sane indexes
+static bool rb_file_valid(rb_file_hdr_t *hdr, int count, int buf_size) {
+    return hdr->magic == RB_FILE_MAGIC && hdr->version == RB_FILE_VERSION &&
+           hdr->count == count && hdr->buf_size == buf_size &&
+           hdr->head < count && hdr->tail < count && hdr->done < count &&
+           hdr->head != hdr->tail && hdr->head != hdr->done;
+}
+
+// Queue again what the file holds: the committed entries after the last
+// one known sent, those the consumer took but may not have sent included.
+// Entries that fail their checksum are kept empty.
+static void rb_file_recover(rb_rwbytes_t *rb, int *recovered, int *damaged,
+                            int *taken) {
+    int head = rb->file->head;
+    int tail = rb->file->done;
+
+    rb->head = head;
+    rb->tail = tail;
+    rb->reclaim = tail;
+    for (int i = (tail + 1) % rb->count; i != head; i = (i + 1) % rb->count) {
+        rb_file_slot_t *slot = rb_file_slot(rb, i);
+        pn_rwbytes_t *m = &rb->ring_buffer[i];
+
+        (*recovered)++;
+        if (slot->size <= rb->buf_size &&
+            fnv1a(FNV1A_INIT, m->start, slot->size) == slot->sum) {
+            m->size = slot->size;
+        } else {
+            (*damaged)++;
+        }
+    }
+    // Up to the one in hand, unless the header is from before a take
+    *taken = (rb->file->tail - tail + rb->count) % rb->count;
+    if (*taken > *recovered) {
+        *taken = 0;
+    }
+}
+
+rb_rwbytes_t *rb_alloc_file(const char *path, int count, int buf_size,
+                            bool wake_producer, int *recovered, int *damaged,
+                            int *taken) {
+    size_t stride = (sizeof(rb_file_slot_t) + buf_size + 7) & ~7UL;
+    size_t len = sizeof(rb_file_hdr_t) + count * stride;
+    struct stat st;
+
+    *recovered = *damaged = *taken = 0;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    // Two processes on one ring would send and overwrite each other's
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "%s: in use by another process\n", path);
+        } else {
+            perror(path);
+        }
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size != len && ftruncate(fd, len) < 0) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    rb_file_hdr_t *hdr =
+        mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
 
-    if (rb->wake_producer) {
-        pthread_cond_init(&rb->rb_free, NULL);
+    rb_rwbytes_t *rb = rb_alloc(count, buf_size, wake_producer);
+    if (rb == NULL) {
+        munmap(hdr, len);
+        close(fd);
+        return NULL;
+    }
+    rb->file = hdr;
+    rb->file_fd = fd;
+    rb->file_len = len;
+    rb->file_stride = stride;
+    for (int i = 0; i < count; i++) {
+        rb->ring_buffer[i].start = (char *)(rb_file_slot(rb, i) + 1);
     }
 
+    if (st.st_size == len && rb_file_valid(hdr, count, buf_size)) {
+        rb_file_recover(rb, recovered, damaged, taken);
+    } else {
+        // New, or of another size: start empty
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->magic = RB_FILE_MAGIC;
+        hdr->version = RB_FILE_VERSION;
+        hdr->count = count;
+        hdr->buf_size = buf_size;
+        hdr->head = rb->head;
+        hdr->tail = rb->tail;
+        hdr->done = rb->tail;
+    }
     return rb;
 }
 
+void rb_sync(rb_rwbytes_t *rb) {
+    if (rb && rb->file) {
+        msync(rb->file, rb->file_len, MS_ASYNC);
+    }
+}
+
+// Entries the producer must not overwrite: those queued, the one in hand
+// and in a file ring also those taken but not known sent
+static int rb_held(rb_rwbytes_t *rb) {
+    int from = rb->tail;
+
+    if (rb->file) {
+        from = __atomic_load_n(&rb->file->done, __ATOMIC_ACQUIRE);
+    }
+    return (rb->head - from - 1 + rb->count) % rb->count;
+}
+
+void rb_done(rb_rwbytes_t *rb) {
+    if (rb->file == NULL) {
+        return;
+    }
+    int done = rb->tail;
+    if (done == rb->file->done) {
+        return;
+    }
+    bool was_full = rb_free_size(rb) == 0;
+    __atomic_store_n(&rb->file->done, done, __ATOMIC_RELEASE);
+
+    // rb_take() does not make room in a file ring, this does
+    if (rb->wake_producer && was_full && rb_free_size(rb) > 0) {
+        pthread_mutex_lock(&rb->rb_mutex);
+        pthread_cond_broadcast(&rb->rb_free);
+        pthread_mutex_unlock(&rb->rb_mutex);
+    }
+}
+
 void rb_free(rb_rwbytes_t *rb) {
     if (rb == NULL) {
         return;
     }
+    if (rb->budget) {
+        __atomic_add_fetch(rb->budget, (long)rb->active * rb->buf_size,
+                           __ATOMIC_RELAXED);
+    }
+    if (rb->file) {
+        // The buffers are in the file, which keeps what is still queued
+        munmap(rb->file, rb->file_len);
+        close(rb->file_fd);
+        memset(rb->ring_buffer, 0, rb->count * sizeof(pn_rwbytes_t));
+    }
     for (int i = 0; i < rb->count; i++) {
         free(rb->ring_buffer[i].start);
     }
+    for (int i = 0; i < rb->n_spare; i++) {
+        free(rb->spare[i]);
+    }
     free(rb->ring_buffer);
+    free(rb->spare);
+    free(rb->put_time);
+    free(rb->next_policy);
     free(rb);
 }
 
+static uint64_t rb_clock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Policy sizes in entries, for the current size of the ring
+static void rb_policy_marks(rb_rwbytes_t *rb) {
+    if (rb->policy.reserve_pct) {
+        // At least one, and always leave the consumer something to read
+        rb->reserve = rb->active * rb->policy.reserve_pct / 100;
+        rb->reserve = rb->reserve < 1 ? 1 : rb->reserve;
+        rb->reserve =
+            rb->reserve > rb->active / 2 ? rb->active / 2 : rb->reserve;
+    }
+    if (rb->policy.sample_n || rb->policy.sample_p > 0) {
+        rb->sample_mark = rb->active * rb->policy.sample_mark_pct / 100;
+        rb->sample_mark = rb->sample_mark < 1 ? 1 : rb->sample_mark;
+    }
+}
+
+// Also while the ring is in use, as long as ttl_ns and stamp do not change
+void rb_set_policy(rb_rwbytes_t *rb, const rb_policy_t *policy) {
+    rb->policy = *policy;
+    rb_policy_marks(rb);
+    if ((policy->ttl_ns || policy->stamp) && rb->put_time == NULL) {
+        // Entries recovered from a file count from now
+        uint64_t now = rb_clock();
+
+        rb->put_time = malloc(rb->count * sizeof(uint64_t));
+        for (int i = 0; i < rb->count; i++) {
+            rb->put_time[i] = now;
+        }
+    }
+}
+
+void rb_offer_policy(rb_rwbytes_t *rb, const rb_policy_t *policy) {
+    rb_policy_t *copy = malloc(sizeof(rb_policy_t));
+
+    if (copy == NULL) {
+        return;
+    }
+    *copy = *policy;
+    free(__atomic_exchange_n(&rb->next_policy, copy, __ATOMIC_RELEASE));
+}
+
+int rb_set_limit(rb_rwbytes_t *rb, int limit) {
+    if (rb->spare == NULL) {
+        return -1;
+    }
+    limit = limit / rb->segment * rb->segment;
+    limit = limit < rb->segment ? rb->segment : limit;
+    limit = limit > rb->count ? rb->count : limit;
+    rb->limit = limit;
+
+    return limit;
+}
+
+void rb_share_budget(rb_rwbytes_t *rb, volatile long *budget) {
+    if (rb->spare == NULL) {
+        return;
+    }
+    rb->budget = budget;
+    __atomic_sub_fetch(budget, (long)rb->active * rb->buf_size,
+                       __ATOMIC_RELAXED);
+}
+
+// Take n more entries from the shared budget, false when it is spent
+static bool rb_budget_take(rb_rwbytes_t *rb, int n) {
+    if (rb->budget == NULL) {
+        return true;
+    }
+    long bytes = (long)n * rb->buf_size;
+    if (__atomic_sub_fetch(rb->budget, bytes, __ATOMIC_RELAXED) < 0) {
+        __atomic_add_fetch(rb->budget, bytes, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+// Enqueue time of the entry the consumer holds, 0 if not recorded
+uint64_t rb_tail_time(rb_rwbytes_t *rb) {
+    return rb->put_time ? rb->put_time[rb->tail] : 0;
+}
+
+// Sampling above the watermark, true to drop the message
+static bool rb_sample_drop(rb_rwbytes_t *rb) {
+    if (rb_queued(rb) < rb->sample_mark) {
+        return false;
+    }
+    if (rb->policy.sample_n) {
+        return ++rb->sample_seq % rb->policy.sample_n != 0;
+    }
+    return rand_r(&rb->sample_seq) >= rb->policy.sample_p * RAND_MAX;
+}
+
+// Elastic rings: move the buffers of entries the consumer is done with to
+// spare, the producer owns everything between head and tail
+static void rb_reclaim(rb_rwbytes_t *rb) {
+    int tail = rb->tail;
+
+    while (rb->reclaim != tail) {
+        pn_rwbytes_t *entry = &rb->ring_buffer[rb->reclaim];
+        if (entry->start) {
+            rb->spare[rb->n_spare++] = entry->start;
+            entry->start = NULL;
+        }
+        rb->reclaim = (rb->reclaim + 1) % rb->count;
+    }
+}
+
+static void rb_shrink(rb_rwbytes_t *rb, int active) {
+    if (rb->budget) {
+        long bytes = (long)(rb->active - active) * rb->buf_size;
+        __atomic_add_fetch(rb->budget, bytes, __ATOMIC_RELAXED);
+    }
+    rb->active = active;
+    rb->shrinks++;
+    rb_policy_marks(rb);
+
+    // Keep the buffers of what is queued and one segment's worth of spares
+    rb_reclaim(rb);
+    while (rb->n_spare > rb->segment) {
+        free(rb->spare[--rb->n_spare]);
+        rb->n_bufs--;
+    }
+}
+
+// Grow an elastic ring that stays nearly full, shrink one that has been
+// mostly empty for RB_SHRINK_NS
+static void rb_resize(rb_rwbytes_t *rb) {
+    int queued = rb_queued(rb);
+    int limit = rb->limit;
+
+    if (rb->active > limit) {
+        // Lowered by rb_set_limit(), what is queued above it still drains
+        rb_shrink(rb, limit);
+        return;
+    }
+    if (queued >= rb->active * 3 / 4) {
+        rb->low_since = 0;
+        if (rb->active < limit && ++rb->high_puts >= rb->segment / 4) {
+            int active = rb->active + rb->segment > limit
+                             ? limit
+                             : rb->active + rb->segment;
+            // Spent by other rings, try again after as many puts
+            rb->high_puts = 0;
+            if (!rb_budget_take(rb, active - rb->active)) {
+                return;
+            }
+            rb->active = active;
+            rb->grows++;
+            rb_policy_marks(rb);
+        }
+        return;
+    }
+    rb->high_puts = 0;
+    if (queued >= rb->active / 4 || rb->active == rb->segment) {
+        rb->low_since = 0;
+        return;
+    }
+    // Low, check the clock now and then
+    if (++rb->low_puts % 256) {
+        return;
+    }
+    uint64_t now = rb_clock();
+    if (rb->low_since == 0) {
+        rb->low_since = now;
+        return;
+    }
+    if (now - rb->low_since < RB_SHRINK_NS) {
+        return;
+    }
+    rb->low_since = now;
+    rb_shrink(rb, rb->active - rb->segment);
+}
+
 pn_rwbytes_t *rb_get_head(rb_rwbytes_t *rb) {
     if (rb == NULL) {
         return NULL;
     }
-    return &rb->ring_buffer[rb->head];
+    pn_rwbytes_t *m = &rb->ring_buffer[rb->head];
+
+    if (m->start == NULL) {
+        if (rb->spare) {
+            rb_reclaim(rb);
+        }
+        if (rb->n_spare) {
+            m->start = rb->spare[--rb->n_spare];
+        } else if ((m->start = malloc(rb->buf_size)) != NULL) {
+            rb->n_bufs++;
+        } else {
+            perror("rb_get_head");
+            return NULL;
+        }
+        m->size = 0;
+    }
+    return m;
 }
 
 pn_rwbytes_t *rb_get_tail(rb_rwbytes_t *rb) {
@@ -97,14 +462,46 @@ pn_rwbytes_t *rb_put(rb_rwbytes_t *rb) {
     }
     pn_rwbytes_t *next_buffer = NULL;
 
+    if (__atomic_load_n(&rb->next_policy, __ATOMIC_RELAXED)) {
+        rb_policy_t *policy =
+            __atomic_exchange_n(&rb->next_policy, NULL, __ATOMIC_ACQUIRE);
+        if (policy) {
+            rb_set_policy(rb, policy);
+            free(policy);
+        }
+    }
+    if (rb->sample_mark && rb_sample_drop(rb)) {
+        rb->drops[RB_DROP_SAMPLED]++;
+        rb->ring_buffer[rb->head].size = 0;
+        return NULL;
+    }
+
+    if (rb->spare) {
+        rb_resize(rb);
+    }
+
     int next = (rb->head + 1) % rb->count;
-    if (next != rb->tail) {
+    if (next != rb->tail && rb_held(rb) < rb->active - 2) {
+        if (rb->put_time) {
+            rb->put_time[rb->head] = rb_clock();
+        }
+        PROBE3(rb_put, rb, rb->ring_buffer[rb->head].start,
+               rb->ring_buffer[rb->head].size);
+        if (rb->file) {
+            pn_rwbytes_t *m = &rb->ring_buffer[rb->head];
+            rb_file_slot_t *slot = rb_file_slot(rb, rb->head);
+
+            slot->size = m->size;
+            slot->sum = fnv1a(FNV1A_INIT, m->start, m->size);
+            __atomic_store_n(&rb->file->head, next, __ATOMIC_RELEASE);
+        }
         rb->head = next;
         next_buffer = &rb->ring_buffer[rb->head];
-        pthread_mutex_lock(&rb->rb_mutex);
-        pthread_cond_broadcast(&rb->rb_ready);
-        pthread_mutex_unlock(&rb->rb_mutex);
+        pthread_mutex_lock(rb->ready_mutex);
+        pthread_cond_broadcast(rb->ready_cond);
+        pthread_mutex_unlock(rb->ready_mutex);
     } else {
+        PROBE1(rb_overrun, rb);
         rb->overruns++;
         rb->ring_buffer[rb->head].size = 0;
     }
@@ -112,50 +509,105 @@ pn_rwbytes_t *rb_put(rb_rwbytes_t *rb) {
     return next_buffer; // May be NULL
 }
 
+// Release the previous entry and hand out the next one
+static pn_rwbytes_t *rb_take(rb_rwbytes_t *rb, int next) {
+    // set data size to zero
+    rb->ring_buffer[rb->tail].size = 0;
+
+    rb->tail = next;
+    if (rb->file) {
+        __atomic_store_n(&rb->file->tail, next, __ATOMIC_RELEASE);
+    }
+
+    if (rb->wake_producer && rb_free_size(rb) == 1) {
+        pthread_mutex_lock(&rb->rb_mutex);
+        pthread_cond_broadcast(&rb->rb_free);
+        pthread_mutex_unlock(&rb->rb_mutex);
+    }
+
+    return &rb->ring_buffer[rb->tail];
+}
+
+// What the policy sheds of the oldest queued entry, -1 to keep it
+static int rb_shed(rb_rwbytes_t *rb, int next, uint64_t *now) {
+    if (rb->reserve && rb_free_size(rb) < rb->reserve) {
+        return RB_DROP_OLDEST;
+    }
+    if (rb->policy.ttl_ns) {
+        if (*now == 0) {
+            *now = rb_clock();
+        }
+        if (*now - rb->put_time[next] > rb->policy.ttl_ns) {
+            return RB_DROP_AGED;
+        }
+    }
+    return -1;
+}
+
 pn_rwbytes_t *rb_get(rb_rwbytes_t *rb) {
     if (rb == NULL) {
         return NULL;
     }
 
-    int next;
+    pn_rwbytes_t *m;
 
-    next = (rb->tail + 1) % rb->count;
-    while (next == rb->head) {
-        pthread_mutex_lock(&rb->rb_mutex);
-        pthread_cond_wait(&rb->rb_ready, &rb->rb_mutex);
-        pthread_mutex_unlock(&rb->rb_mutex);
+    while ((m = rb_try_get(rb)) == NULL) {
+        pthread_mutex_lock(rb->ready_mutex);
+        // Re-check under the lock, rb_put() may have signaled already
+        if (rb_empty(rb)) {
+            PROBE1(rb_park, rb);
+            pthread_cond_wait(rb->ready_cond, rb->ready_mutex);
+            PROBE1(rb_wake, rb);
+        }
+        pthread_mutex_unlock(rb->ready_mutex);
 
-        next = (rb->tail + 1) % rb->count;
         rb->queue_block++;
     }
-    // set data size to zero
-    rb->ring_buffer[rb->tail].size = 0;
 
-    rb->tail = next;
+    return m;
+}
 
-    if (rb->wake_producer && rb_free_size(rb) == 1) {
-        pthread_mutex_lock(&rb->rb_mutex);
-        pthread_cond_broadcast(&rb->rb_free);
-        pthread_mutex_unlock(&rb->rb_mutex);
-    }
+// Same as rb_get() but returns NULL instead of waiting, also when the
+// policy shed everything that was queued
+pn_rwbytes_t *rb_try_get(rb_rwbytes_t *rb) {
+    uint64_t now = 0;
+    int next;
 
-    rb->processed++;
+    while ((next = (rb->tail + 1) % rb->count) != rb->head) {
+        int drop = rb_shed(rb, next, &now);
+        if (drop < 0) {
+            rb->processed++;
+            return rb_take(rb, next);
+        }
+        rb_take(rb, next);
+        rb->drops[drop]++;
+    }
+    return NULL;
+}
 
-    return &rb->ring_buffer[rb->tail];
+bool rb_empty(rb_rwbytes_t *rb) {
+    return (rb->tail + 1) % rb->count == rb->head;
 }
 
-int rb_inuse_size(rb_rwbytes_t *rb) { return rb->count - rb_free_size(rb); }
+int rb_inuse_size(rb_rwbytes_t *rb) { return rb->active - rb_free_size(rb); }
 
+// Entries the producer may still fill, what link credit is granted from
 int rb_free_size(rb_rwbytes_t *rb) {
     assert(rb->head != rb->tail);
 
-    int head = rb->head;
-    int tail = rb->tail;
+    int free = rb->active - rb_held(rb) - 2;
 
-    return head > tail ? rb->count - (head - tail) - 1 : tail - head - 1;
+    return free < 0 ? 0 : free;
 }
 
-int rb_size(rb_rwbytes_t *rb) { return rb->count; }
+int rb_size(rb_rwbytes_t *rb) { return rb->active; }
+
+long rb_mem(rb_rwbytes_t *rb) { return (long)rb->n_bufs * rb->buf_size; }
+
+// Entries committed but not yet handed to the consumer
+int rb_queued(rb_rwbytes_t *rb) {
+    return (rb->head - rb->tail - 1 + rb->count) % rb->count;
+}
 
 long rb_get_overruns(rb_rwbytes_t *rb) { return rb->overruns; }
 
@@ -6,14 +6,82 @@
 #include <time.h>
 
 #include <pthread.h>
+#include <stdint.h>
+
+// Messages shed by an rb_policy_t or rb_lane_put_copy(), on top of the
+// newest ones rb_put() drops when the ring is full (overruns)
+enum rb_drop {
+    RB_DROP_OLDEST,   // discarded by the consumer to keep room for new ones
+    RB_DROP_SAMPLED,  // not kept by sampling above the watermark
+    RB_DROP_AGED,     // waited longer than the ttl
+    RB_DROP_TOO_LONG, // bigger than a buffer of the shared lane it was for
+    RB_DROP_MAX
+};
+
+// Overload policy of a ring, all off when zeroed.  Sizes are percent of the
+// ring so one policy fits rings of any size.
+typedef struct {
+    // Drop oldest: the consumer owns the tail, so it discards the oldest
+    // entries at dequeue while fewer than reserve_pct entries are free
+    int reserve_pct;
+    // Above sample_mark_pct queued entries keep 1 in sample_n messages, or
+    // each with probability sample_p when sample_n is 0
+    int sample_mark_pct;
+    int sample_n;
+    double sample_p;
+    // Shed at dequeue what was enqueued more than ttl_ns ago
+    uint64_t ttl_ns;
+    // Record enqueue times even without a ttl, see rb_tail_time()
+    bool stamp;
+} rb_policy_t;
+
+#define RB_SHRINK_NS 10000000000ULL /* low occupancy for this long */
+
+#define RB_FILE_MAGIC 0x53475242 /* "SGRB" */
+#define RB_FILE_VERSION 1
+
+// A ring in a file, rb_alloc_file(): this header, then count slots of
+// rb_file_slot_t and buf_size bytes each, padded to 8 bytes.  What was
+// committed survives the process, head and tail are updated with every
+// rb_put() and every entry the consumer takes, done with rb_done().
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t buf_size;
+    uint32_t head; // next entry to commit
+    uint32_t tail; // entry the consumer had last
+    uint32_t done; // last entry the consumer took that is known sent
+    uint32_t reserved;
+} rb_file_hdr_t;
 
 typedef struct {
-    pn_rwbytes_t *ring_buffer;
+    uint32_t size;
+    uint32_t sum; // fnv1a of the size bytes that follow
+} rb_file_slot_t;
 
-    int count;
+typedef struct {
+    pn_rwbytes_t *ring_buffer; // buffers are allocated on first use
+    uint64_t *put_time; // CLOCK_MONOTONIC ns per entry, with a policy
+
+    int count; // entries the ring can grow to
     int buf_size;
     bool wake_producer;
 
+    // Elastic rings use the first active entries worth of buffers, and grow
+    // or shrink by segment entries.  Everything below is the producer's.
+    volatile int active;
+    volatile int limit; // active never grows past it, see rb_set_limit()
+    int segment;
+    char **spare; // buffers of consumed entries, NULL unless elastic
+    int n_spare;
+    int reclaim; // next entry whose buffer goes to spare
+    int n_bufs;  // allocated
+    int high_puts;
+    unsigned low_puts;
+    uint64_t low_since;
+    volatile long *budget; // bytes left to the rings that share it, or NULL
+
     volatile int head;
     volatile int tail;
 
@@ -21,6 +89,11 @@ typedef struct {
     pthread_cond_t rb_ready;
     pthread_cond_t rb_free;
 
+    // Where rb_put() signals new data, rb_mutex/rb_ready unless the ring is
+    // a lane of an rb_set_t
+    pthread_mutex_t *ready_mutex;
+    pthread_cond_t *ready_cond;
+
     // stats
     //
     // Buffer full
@@ -28,14 +101,63 @@ typedef struct {
     // Number of messages procesed
     volatile long processed;
     volatile long queue_block;
-
-    struct timespec total_active, total_wait;
-    struct timespec total_t1, total_t2;
+    volatile long drops[RB_DROP_MAX];
+    volatile long grows;
+    volatile long shrinks;
+
+    // Set when the ring lives in a file
+    rb_file_hdr_t *file;
+    size_t file_len;
+    size_t file_stride; // bytes per slot
+    int file_fd;        // holds the lock on the file
+
+    rb_policy_t policy;
+    rb_policy_t *volatile next_policy; // from rb_offer_policy()
+    int reserve;     // entries
+    int sample_mark; // entries
+    unsigned sample_seq;
 
 } rb_rwbytes_t;
 
 extern rb_rwbytes_t *rb_alloc(int count, int buf_size, bool wake_producer);
 
+extern rb_rwbytes_t *rb_alloc_elastic(int count, int max_count, int buf_size,
+                                      bool wake_producer);
+
+// A ring in the file at path, that picks up what a previous process left
+// in it.  *recovered is the number of entries queued again, *damaged the
+// number of those that failed their checksum and were emptied, *taken the
+// number the consumer had taken, that may have been sent already.  Fails
+// when another process has the file.
+extern rb_rwbytes_t *rb_alloc_file(const char *path, int count, int buf_size,
+                                   bool wake_producer, int *recovered,
+                                   int *damaged, int *taken);
+
+// Start writing the file back to disk, against losing it with the machine
+extern void rb_sync(rb_rwbytes_t *rb);
+
+// Consumer of a file ring: what it took has gone out.  Until then those
+// entries keep their slots, to be sent again by the next process.  Does
+// nothing for other rings.
+extern void rb_done(rb_rwbytes_t *rb);
+
+extern void rb_set_policy(rb_rwbytes_t *rb, const rb_policy_t *policy);
+
+// Any thread, while the ring is in use: the producer applies the policy
+// with its next rb_put()
+extern void rb_offer_policy(rb_rwbytes_t *rb, const rb_policy_t *policy);
+
+// Elastic rings: the entries the ring may use from now on, rounded down to
+// whole segments.  Returns what was applied, -1 for a fixed size ring.
+extern int rb_set_limit(rb_rwbytes_t *rb, int limit);
+
+// Elastic rings: charge the active entries to *budget, bytes shared with
+// other rings, before the ring is used.  It grows only while the budget
+// covers it and gives back what it shrinks by or frees.
+extern void rb_share_budget(rb_rwbytes_t *rb, volatile long *budget);
+
+extern uint64_t rb_tail_time(rb_rwbytes_t *rb);
+
 extern pn_rwbytes_t *rb_get_head(rb_rwbytes_t *rb);
 
 extern pn_rwbytes_t *rb_get_tail(rb_rwbytes_t *rb);
@@ -44,6 +166,10 @@ extern pn_rwbytes_t *rb_put(rb_rwbytes_t *rb);
 
 extern pn_rwbytes_t *rb_get(rb_rwbytes_t *rb);
 
+extern pn_rwbytes_t *rb_try_get(rb_rwbytes_t *rb);
+
+extern bool rb_empty(rb_rwbytes_t *rb);
+
 extern void rb_free(rb_rwbytes_t *rb);
 
 extern int rb_free_size(rb_rwbytes_t *rb);
@@ -52,6 +178,10 @@ extern int rb_inuse_size(rb_rwbytes_t *rb);
 
 extern int rb_size(rb_rwbytes_t *rb);
 
+extern int rb_queued(rb_rwbytes_t *rb);
+
+extern long rb_mem(rb_rwbytes_t *rb);
+
 extern long rb_get_queue_block(rb_rwbytes_t *rb);
 
 #endif
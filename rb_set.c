@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <features.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "probes.h"
+#include "rb_set.h"
+
+rb_set_t *rb_set_alloc(void) {
+    rb_set_t *set = calloc(1, sizeof(rb_set_t));
+
+    pthread_mutex_init(&set->mutex, NULL);
+    pthread_cond_init(&set->ready, NULL);
+
+    return set;
+}
+
+// Add a lane for a new link, NULL if the set is full
+rb_lane_t *rb_set_add(rb_set_t *set, rb_rwbytes_t *rb, const char *name) {
+    return rb_set_add_prio(set, rb, name, RB_LANE_DEFAULT_PRIO, 1);
+}
+
+rb_lane_t *rb_set_add_prio(rb_set_t *set, rb_rwbytes_t *rb, const char *name,
+                           int prio, int weight) {
+    if (rb == NULL) {
+        return NULL;
+    }
+    rb_lane_t *lane = calloc(1, sizeof(rb_lane_t));
+    lane->rb = rb;
+    strncpy(lane->name, name, sizeof(lane->name) - 1);
+    lane->prio = prio;
+    lane->weight = weight > 0 ? weight : 1;
+    pthread_mutex_init(&lane->put_mutex, NULL);
+
+    // rb_put() on the lane wakes the consumer of the whole set
+    rb->ready_mutex = &set->mutex;
+    rb->ready_cond = &set->ready;
+
+    pthread_mutex_lock(&set->mutex);
+    if (set->n_lanes == RB_SET_MAX_LANES) {
+        pthread_mutex_unlock(&set->mutex);
+        free(lane);
+        return NULL;
+    }
+    // Not in use by the consumer yet, the producer is the caller
+    if (set->policy) {
+        rb_set_policy(rb, set->policy);
+    }
+    if (set->budgeted) {
+        rb_share_budget(rb, &set->budget);
+    }
+    set->lanes[set->n_lanes] = lane;
+    __atomic_store_n(&set->n_lanes, set->n_lanes + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&set->mutex);
+
+    return lane;
+}
+
+// Called by the producer after its last rb_put() on the lane
+void rb_lane_close(rb_lane_t *lane) {
+    pthread_mutex_lock(lane->rb->ready_mutex);
+    __atomic_store_n(&lane->closed, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(lane->rb->ready_cond);
+    pthread_mutex_unlock(lane->rb->ready_mutex);
+}
+
+// Commit a copy of msg to a shared lane, from any producer.  Never blocks,
+// a full lane counts an overrun like rb_put().  False if msg was dropped.
+bool rb_lane_put_copy(rb_lane_t *lane, const pn_rwbytes_t *msg) {
+    bool kept = false;
+
+    pthread_mutex_lock(&lane->put_mutex);
+    pn_rwbytes_t *m = rb_get_head(lane->rb);
+    if (m && msg->size <= lane->rb->buf_size) {
+        memcpy(m->start, msg->start, msg->size);
+        m->size = msg->size;
+        kept = rb_put(lane->rb) != NULL;
+        __atomic_add_fetch(&lane->received, 1, __ATOMIC_RELAXED);
+    } else if (m) {
+        lane->rb->drops[RB_DROP_TOO_LONG]++;
+    }
+    pthread_mutex_unlock(&lane->put_mutex);
+
+    return kept;
+}
+
+// Consumer only: free a closed and drained lane
+static void rb_set_retire(rb_set_t *set, int idx) {
+    pthread_mutex_lock(&set->mutex);
+    rb_lane_t *lane = set->lanes[idx];
+
+    set->retired_overruns += lane->rb->overruns;
+    set->retired_processed += lane->rb->processed;
+    set->retired_received += lane->received;
+    for (int i = 0; i < RB_DROP_MAX; i++) {
+        set->retired_drops[i] += lane->rb->drops[i];
+    }
+    set->retired_grows += lane->rb->grows;
+    set->retired_shrinks += lane->rb->shrinks;
+
+    set->lanes[idx] = set->lanes[set->n_lanes - 1];
+    set->n_lanes--;
+    // A lane allocated later at the same address is not the current one
+    if (set->current == lane) {
+        set->current = NULL;
+        set->burst = 0;
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    rb_free(lane->rb);
+    free(lane);
+}
+
+// Anything for the consumer to do, called with the mutex held
+static bool rb_set_pending(rb_set_t *set) {
+    for (int i = 0; i < set->n_lanes; i++) {
+        if (!rb_empty(set->lanes[i]->rb) || set->lanes[i]->closed) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Next message from any lane, lanes take turns.  Like rb_get() the
+// returned entry belongs to the consumer until the next call.
+pn_rwbytes_t *rb_set_get(rb_set_t *set) {
+    return rb_set_timedget(set, NULL);
+}
+
+// RB_SCHED_FAIR, some lane has data: the lanes after the current one take
+// turns to get their quantum, the first one with bytes left goes next.  A
+// lane that overdrew with a large message sits out turns until its debt is
+// paid, so every busy lane gets the same bytes whatever its message sizes.
+static int rb_set_next_fair(rb_set_t *set, int n) {
+    while (1) {
+        for (int i = 1; i <= n; i++) {
+            int idx = (set->next + i) % n;
+            rb_lane_t *lane = set->lanes[idx];
+
+            if (rb_empty(lane->rb)) {
+                continue;
+            }
+            lane->deficit += (long)RB_DRR_QUANTUM * lane->weight;
+            if (lane->deficit > 0) {
+                return idx;
+            }
+        }
+    }
+}
+
+// Index of the lane to serve next, -1 if all are empty.  Retires closed
+// and drained lanes on the way, *retired tells the caller to scan again.
+static int rb_set_pick(rb_set_t *set, int n, bool *retired) {
+    int best = -1, spent = -1;
+
+    *retired = false;
+    for (int i = 0; i < n; i++) {
+        int idx = (set->next + i) % n;
+        rb_lane_t *lane = set->lanes[idx];
+
+        if (rb_empty(lane->rb)) {
+            // An idle lane saves up nothing, but keeps its debt
+            if (lane->deficit > 0) {
+                lane->deficit = 0;
+            }
+            if (__atomic_load_n(&lane->closed, __ATOMIC_ACQUIRE) &&
+                rb_empty(lane->rb)) {
+                rb_set_retire(set, idx);
+                *retired = true;
+                return -1;
+            }
+            continue;
+        }
+        if (set->sched == RB_SCHED_FAIR) {
+            // Keep serving the current lane while it has bytes left
+            if (lane == set->current && lane->deficit > 0) {
+                return idx;
+            }
+            best = best < 0 ? idx : best;
+        } else if (set->sched == RB_SCHED_WEIGHTED) {
+            // Keep serving the current lane until it used its weight
+            if (lane == set->current) {
+                if (set->burst < lane->weight) {
+                    return idx;
+                }
+                spent = idx;
+            } else if (best < 0) {
+                best = idx;
+            }
+        } else if (best < 0 || lane->prio < set->lanes[best]->prio) {
+            best = idx;
+        }
+    }
+    if (set->sched == RB_SCHED_FAIR && best >= 0) {
+        return rb_set_next_fair(set, n);
+    }
+    // Only the lane that used its turn has data, it gets another one
+    if (best < 0 && spent >= 0) {
+        set->burst = 0;
+        best = spent;
+    }
+    return best;
+}
+
+// Same as rb_set_get(), but gives up with NULL at deadline (CLOCK_REALTIME)
+// unless deadline is NULL
+pn_rwbytes_t *rb_set_timedget(rb_set_t *set,
+                              const struct timespec *deadline) {
+    while (1) {
+        int n = __atomic_load_n(&set->n_lanes, __ATOMIC_ACQUIRE);
+        bool retired;
+
+        int idx = rb_set_pick(set, n, &retired);
+        if (retired) {
+            continue;
+        }
+        if (idx >= 0) {
+            rb_lane_t *lane = set->lanes[idx];
+
+            if (lane == set->current) {
+                set->burst++;
+            } else {
+                set->current = lane;
+                set->burst = 1;
+            }
+            // The weighted schedulers stay, strict moves on
+            set->next = set->sched == RB_SCHED_STRICT ? idx + 1 : idx;
+            pn_rwbytes_t *msg = rb_try_get(lane->rb);
+            if (msg) {
+                lane->deficit -= msg->size;
+                lane->bytes_out += msg->size;
+                return msg;
+            }
+            continue; // all of it was shed
+        }
+
+        int err = 0;
+        pthread_mutex_lock(&set->mutex);
+        if (!rb_set_pending(set)) {
+            PROBE1(rb_park, set);
+            if (deadline) {
+                err = pthread_cond_timedwait(&set->ready, &set->mutex,
+                                             deadline);
+            } else {
+                pthread_cond_wait(&set->ready, &set->mutex);
+            }
+            PROBE1(rb_wake, set);
+        }
+        pthread_mutex_unlock(&set->mutex);
+        set->queue_block++;
+        if (err == ETIMEDOUT) {
+            return NULL;
+        }
+    }
+}
+
+long rb_set_overruns(rb_set_t *set) {
+    pthread_mutex_lock(&set->mutex);
+    long overruns = set->retired_overruns;
+    for (int i = 0; i < set->n_lanes; i++) {
+        overruns += set->lanes[i]->rb->overruns;
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    return overruns;
+}
+
+long rb_set_processed(rb_set_t *set) {
+    pthread_mutex_lock(&set->mutex);
+    long processed = set->retired_processed;
+    for (int i = 0; i < set->n_lanes; i++) {
+        processed += set->lanes[i]->rb->processed;
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    return processed;
+}
+
+long rb_set_drops(rb_set_t *set, enum rb_drop kind) {
+    pthread_mutex_lock(&set->mutex);
+    long drops = set->retired_drops[kind];
+    for (int i = 0; i < set->n_lanes; i++) {
+        drops += set->lanes[i]->rb->drops[kind];
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    return drops;
+}
+
+long rb_set_grows(rb_set_t *set) {
+    pthread_mutex_lock(&set->mutex);
+    long grows = set->retired_grows;
+    for (int i = 0; i < set->n_lanes; i++) {
+        grows += set->lanes[i]->rb->grows;
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    return grows;
+}
+
+long rb_set_shrinks(rb_set_t *set) {
+    pthread_mutex_lock(&set->mutex);
+    long shrinks = set->retired_shrinks;
+    for (int i = 0; i < set->n_lanes; i++) {
+        shrinks += set->lanes[i]->rb->shrinks;
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    return shrinks;
+}
+
+long rb_set_mem(rb_set_t *set) {
+    pthread_mutex_lock(&set->mutex);
+    long mem = 0;
+    for (int i = 0; i < set->n_lanes; i++) {
+        mem += rb_mem(set->lanes[i]->rb);
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    return mem;
+}
+
+int rb_set_queued(rb_set_t *set) {
+    pthread_mutex_lock(&set->mutex);
+    int queued = 0;
+    for (int i = 0; i < set->n_lanes; i++) {
+        queued += rb_queued(set->lanes[i]->rb);
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    return queued;
+}
+
+void rb_set_policy_all(rb_set_t *set, const rb_policy_t *policy) {
+    pthread_mutex_lock(&set->mutex);
+    if (set->policy || (set->policy = malloc(sizeof(rb_policy_t)))) {
+        *set->policy = *policy;
+    }
+    for (int i = 0; i < set->n_lanes; i++) {
+        rb_offer_policy(set->lanes[i]->rb, policy);
+    }
+    pthread_mutex_unlock(&set->mutex);
+}
+
+void rb_set_budget(rb_set_t *set, long bytes) {
+    pthread_mutex_lock(&set->mutex);
+    set->budget = bytes;
+    set->budgeted = true;
+    pthread_mutex_unlock(&set->mutex);
+}
+
+void rb_set_wake_producers(rb_set_t *set, bool wake) {
+    pthread_mutex_lock(&set->mutex);
+    for (int i = 0; i < set->n_lanes; i++) {
+        rb_rwbytes_t *rb = set->lanes[i]->rb;
+
+        // Shared lanes never block the links that copy to them
+        if (set->lanes[i]->shared || rb->wake_producer == wake) {
+            continue;
+        }
+        if (wake) {
+            rb->wake_producer = true;
+        } else {
+            // Let go of a producer that is waiting now
+            rb->wake_producer = false;
+            pthread_mutex_lock(&rb->rb_mutex);
+            pthread_cond_broadcast(&rb->rb_free);
+            pthread_mutex_unlock(&rb->rb_mutex);
+        }
+    }
+    pthread_mutex_unlock(&set->mutex);
+}
+
+// One line per lane, for the periodic stats
+void rb_set_report(rb_set_t *set, FILE *out) {
+    pthread_mutex_lock(&set->mutex);
+    for (int i = 0; i < set->n_lanes; i++) {
+        rb_lane_t *lane = set->lanes[i];
+
+        fprintf(out,
+                "  lane %s: prio: %d, in: %ld, overrun: %ld, queued: %d/%d, "
+                "credit: %ld",
+                lane->name, lane->prio, lane->received, lane->rb->overruns,
+                rb_queued(lane->rb), rb_size(lane->rb), lane->credit);
+        if (lane->rb->drops[RB_DROP_TOO_LONG]) {
+            fprintf(out, ", too long: %ld",
+                    lane->rb->drops[RB_DROP_TOO_LONG]);
+        }
+        if (set->sched == RB_SCHED_FAIR) {
+            fprintf(out, ", out: %ld, %ldkB", lane->rb->processed,
+                    lane->bytes_out / 1024);
+        }
+        if (lane->rb->spare) {
+            fprintf(out, ", max: %d, grows: %ld, shrinks: %ld, mem: %ldkB",
+                    lane->rb->limit, lane->rb->grows, lane->rb->shrinks,
+                    rb_mem(lane->rb) / 1024);
+        }
+        fprintf(out, "%s\n", lane->closed ? " (closed)" : "");
+    }
+    pthread_mutex_unlock(&set->mutex);
+}
@@ -0,0 +1,123 @@
+#ifndef _RB_SET_H
+#define _RB_SET_H 1
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "rb.h"
+
+#define RB_SET_MAX_LANES 64
+#define RB_LANE_NAME_LEN 64
+#define RB_LANE_DEFAULT_PRIO 1 /* 0 is served first */
+#define RB_DRR_QUANTUM 4096    /* bytes per turn and weight, RB_SCHED_FAIR */
+
+// One single producer ring per inbound link.  Only one proactor thread at
+// a time handles the events of a connection, so every lane keeps the
+// single producer / single consumer contract of rb_rwbytes_t even when
+// several threads run the proactor.
+typedef struct {
+    rb_rwbytes_t *rb;
+    char name[RB_LANE_NAME_LEN];
+
+    // Set by the producer once the link is gone, the consumer frees the
+    // lane after draining it
+    volatile bool closed;
+
+    int prio;   // RB_SCHED_STRICT: lower values always go first
+    int weight; // RB_SCHED_WEIGHTED: messages per turn, RB_SCHED_FAIR:
+                // quanta per turn
+    long deficit; // RB_SCHED_FAIR: bytes left to send, consumer only
+
+    // Lanes fed by several links (content rules) take turns to produce
+    bool shared;
+    pthread_mutex_t put_mutex;
+
+    // stats
+    volatile long received;
+    volatile long credit;
+    volatile long bytes_out;
+} rb_lane_t;
+
+typedef enum {
+    RB_SCHED_STRICT,  // lowest prio first, round robin within a prio
+    RB_SCHED_WEIGHTED, // round robin, weight messages in a row per lane
+    RB_SCHED_FAIR      // deficit round robin, by bytes
+} rb_sched_t;
+
+// Lanes merged by the single consumer.  Lanes are added by the producers
+// and removed by the consumer, both under mutex, the consumer scans them
+// without it.
+typedef struct {
+    rb_lane_t *volatile lanes[RB_SET_MAX_LANES];
+    volatile int n_lanes;
+    int next;
+    rb_lane_t *current; // lane of the entry rb_set_get() returned last, NULL
+                        // once that lane is retired
+    int burst;          // entries taken in a row from current
+
+    rb_sched_t sched;
+    rb_policy_t *policy; // from rb_set_policy_all(), for lanes added later
+    bool budgeted;       // elastic lanes share budget, rb_set_budget()
+    volatile long budget;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+
+    // stats
+    volatile long queue_block;
+    // counters of lanes that were already freed
+    long retired_overruns;
+    long retired_processed;
+    long retired_received;
+    long retired_drops[RB_DROP_MAX];
+    long retired_grows;
+    long retired_shrinks;
+} rb_set_t;
+
+extern rb_set_t *rb_set_alloc(void);
+
+extern rb_lane_t *rb_set_add(rb_set_t *set, rb_rwbytes_t *rb,
+                             const char *name);
+
+extern rb_lane_t *rb_set_add_prio(rb_set_t *set, rb_rwbytes_t *rb,
+                                  const char *name, int prio, int weight);
+
+extern bool rb_lane_put_copy(rb_lane_t *lane, const pn_rwbytes_t *msg);
+
+extern void rb_lane_close(rb_lane_t *lane);
+
+extern pn_rwbytes_t *rb_set_get(rb_set_t *set);
+
+extern pn_rwbytes_t *rb_set_timedget(rb_set_t *set,
+                                     const struct timespec *deadline);
+
+extern long rb_set_overruns(rb_set_t *set);
+
+extern long rb_set_processed(rb_set_t *set);
+
+extern long rb_set_drops(rb_set_t *set, enum rb_drop kind);
+
+extern long rb_set_grows(rb_set_t *set);
+
+extern long rb_set_shrinks(rb_set_t *set);
+
+// Bytes of message buffers allocated by all lanes
+extern long rb_set_mem(rb_set_t *set);
+
+extern int rb_set_queued(rb_set_t *set);
+
+// Apply to every lane and to the lanes added later, while the producers
+// and the consumer run: each producer picks it up with its next rb_put()
+extern void rb_set_policy_all(rb_set_t *set, const rb_policy_t *policy);
+
+// Elastic lanes added from now on share bytes of buffers, see
+// rb_share_budget()
+extern void rb_set_budget(rb_set_t *set, long bytes);
+
+// Whether producers of lanes of their own wait for room, --amqp_block
+extern void rb_set_wake_producers(rb_set_t *set, bool wake);
+
+extern void rb_set_report(rb_set_t *set, FILE *out);
+
+#endif
@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include <features.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bridge.h"
+#include "capture.h"
+#include "socket_snd_th.h"
+
+// Sleep until the record is due, time is scaled by the replay speed.
+// Returns the error when the clock refuses the time, 0 otherwise.
+static int replay_pace(struct timespec *start, uint64_t rec_time,
+                       double speed) {
+    uint64_t due = rec_time / speed;
+    struct timespec ts = {start->tv_sec + due / 1000000000,
+                          start->tv_nsec + due % 1000000000};
+
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    int err;
+    while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                  NULL)) == EINTR) {
+    }
+    return err;
+}
+
+void replay_th_cleanup(void *app_ptr) {
+    app_data_t *app = (app_data_t *)app_ptr;
+
+    if (app) {
+        app->amqp_rcv_th_running = 0;
+    }
+
+    fprintf(stderr, "Exit REPLAY thread...\n");
+}
+
+// Feed a capture file into the ring buffer in place of the AMQP receiver.
+// The ring is never overrun, if the sender falls behind the replay waits.
+static void replay(app_data_t *app, capture_map_t *cm) {
+    rb_rwbytes_t *rb = app->rbin;
+    const capture_rec_t *rec;
+    long put = 0, kept = 0;
+    double speed = app->replay_speed;
+    struct timespec start;
+
+    printf("Replaying %lu messages from %s at %s speed\n", cm->hdr->count,
+           app->replay_file, app->replay_speed > 0 ? "scaled" : "maximum");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while ((rec = capture_next(cm)) != NULL) {
+        if (rec->len >= app->ring_buffer_size) {
+            fprintf(stderr, "Replay message too long: %uB >= %dB.\n",
+                    rec->len, app->ring_buffer_size);
+            continue;
+        }
+        int err = speed > 0 ? replay_pace(&start, rec->time, speed) : 0;
+        if (err) {
+            fprintf(stderr, "Replay pacing: %s, at maximum speed from now\n",
+                    strerror(err));
+            speed = 0;
+        }
+        while (rb_free_size(rb) == 0) {
+            pthread_mutex_lock(&rb->rb_mutex);
+            if (rb_free_size(rb) == 0) {
+                pthread_cond_wait(&rb->rb_free, &rb->rb_mutex);
+            }
+            pthread_mutex_unlock(&rb->rb_mutex);
+        }
+
+        pn_rwbytes_t *m = rb_get_head(rb);
+        if (m == NULL) {
+            fprintf(stderr, "Replay out of ring memory\n");
+            break;
+        }
+        memcpy(m->start, rec + 1, rec->len);
+        m->size = rec->len;
+        if (rb_put(rb) != NULL) {
+            kept++;
+        }
+        app->amqp_received++;
+        put++;
+
+        if ((app->message_count > 0) && (put >= app->message_count)) {
+            break;
+        }
+    }
+
+    // Let the sender finish before the main thread stops it
+    socket_snd_drain(app, rb, kept);
+    printf("Replay done, %ld messages\n", put);
+}
+
+void *replay_th(void *app_ptr) {
+    pthread_cleanup_push(replay_th_cleanup, app_ptr);
+
+    app_data_t *app = (app_data_t *)app_ptr;
+
+    capture_map_t *cm = capture_map(app->replay_file);
+    if (cm != NULL) {
+        replay(app, cm);
+        capture_unmap(cm);
+    }
+
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
@@ -0,0 +1,6 @@
+#ifndef _REPLAY_TH_H
+#define _REPLAY_TH_H 1
+
+extern void *replay_th(void *app_ptr);
+
+#endif
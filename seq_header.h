@@ -0,0 +1,29 @@
+#ifndef _SEQ_HEADER_H
+#define _SEQ_HEADER_H 1
+
+#include <stdint.h>
+
+#define SEQ_MAGIC 0x5351 /* "SQ" */
+#define SEQ_VERSION 1
+
+// Header in front of every datagram, or shared memory ring record, with
+// --seq_header.  All integers in network byte order.
+//
+// A stream is one run of a bridge, seq counts its datagrams from 0.  A gap
+// in seq is a datagram that did not arrive: unsent says how many of those
+// the bridge could not send (socket full or an error), the rest were lost
+// on the network or by the receiver.  ring_drops is what the bridge
+// dropped before sending (ring overruns and the overload policies), it
+// never takes a seq.  tools/seq_verify does that bookkeeping.
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t flags; // 0
+    uint32_t stream;
+    uint64_t seq;
+    uint64_t enqueued_ns; // CLOCK_REALTIME, when the message was received
+    uint32_t unsent;      // cumulative, datagrams of the stream not sent
+    uint32_t ring_drops;  // cumulative, refreshed every second
+} seq_hdr_t;
+
+#endif
@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include <features.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+// Polls of an empty ring before the consumer parks on the doorbell
+#define SHM_RING_SPIN 1024
+
+#define REC_SIZE(len)                                                          \
+    ((sizeof(shm_ring_rec_t) + (len) + SHM_RING_ALIGN - 1) &                   \
+     ~(uint64_t)(SHM_RING_ALIGN - 1))
+
+static void doorbell(int efd) {
+    uint64_t one = 1;
+
+    if (write(efd, &one, sizeof(one)) < 0) {
+        perror("shm_ring doorbell");
+    }
+}
+
+static void doorbell_wait(int efd) {
+    uint64_t val;
+
+    if (read(efd, &val, sizeof(val)) < 0 && errno != EINTR) {
+        perror("shm_ring doorbell wait");
+    }
+}
+
+// Hand the ring and doorbell fds to every consumer that connects
+static void *shm_ring_handoff_th(void *ring_ptr) {
+    shm_ring_t *ring = (shm_ring_t *)ring_ptr;
+    int fds[3] = {ring->ring_fd, ring->data_efd, ring->space_efd};
+
+    while (1) {
+        int conn = accept(ring->listen_fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; /* listen socket shut down */
+        }
+        char byte = 0;
+        struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+        union {
+            char buf[CMSG_SPACE(sizeof(fds))];
+            struct cmsghdr align;
+        } ctrl;
+        struct msghdr msg = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = ctrl.buf,
+                             .msg_controllen = sizeof(ctrl.buf)};
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        if (sendmsg(conn, &msg, 0) < 0) {
+            perror("shm_ring handoff");
+        } else {
+            printf("shm_ring: consumer attached\n");
+        }
+        close(conn);
+    }
+    return NULL;
+}
+
+static int shm_ring_listen(shm_ring_t *ring, const char *sock_path) {
+    struct sockaddr_un name;
+
+    if (strlen(sock_path) >= sizeof(name.sun_path)) {
+        fprintf(stderr, "shm_ring: socket path too long: %s\n", sock_path);
+        return -1;
+    }
+    ring->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ring->listen_fd < 0) {
+        perror("shm_ring socket");
+        return -1;
+    }
+    memset(&name, 0, sizeof(name));
+    name.sun_family = AF_UNIX;
+    strcpy(name.sun_path, sock_path);
+
+    unlink(sock_path);
+    if (bind(ring->listen_fd, (struct sockaddr *)&name, sizeof(name)) < 0 ||
+        listen(ring->listen_fd, 1) < 0) {
+        perror("shm_ring bind");
+        return -1;
+    }
+    if (pthread_create(&ring->handoff_th, NULL, shm_ring_handoff_th, ring)) {
+        perror("shm_ring handoff thread");
+        return -1;
+    }
+    ring->sock_path = strdup(sock_path);
+
+    return 0;
+}
+
+static int shm_ring_map(shm_ring_t *ring, size_t map_size, int prot) {
+    void *map = mmap(NULL, map_size, prot, MAP_SHARED, ring->ring_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("shm_ring mmap");
+        return -1;
+    }
+    ring->hdr = (shm_ring_hdr_t *)map;
+    ring->data = (char *)map + SHM_RING_HDR_SIZE;
+
+    return 0;
+}
+
+shm_ring_t *shm_ring_create(const char *sock_path, const char *file,
+                            size_t size) {
+    shm_ring_t *ring = calloc(1, sizeof(shm_ring_t));
+
+    // Round up to a power of 2 so positions can be masked
+    size_t ring_size = SHM_RING_HDR_SIZE;
+    while (ring_size < size) {
+        ring_size <<= 1;
+    }
+
+    ring->listen_fd = -1;
+    ring->data_efd = eventfd(0, EFD_CLOEXEC);
+    ring->space_efd = eventfd(0, EFD_CLOEXEC);
+    if (file != NULL) {
+        ring->ring_fd =
+            open(file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    } else {
+        ring->ring_fd = memfd_create("sg-bridge-ring", MFD_CLOEXEC);
+    }
+    if (ring->ring_fd < 0 || ring->data_efd < 0 || ring->space_efd < 0) {
+        perror("shm_ring create");
+        shm_ring_destroy(ring);
+        return NULL;
+    }
+    if (ftruncate(ring->ring_fd, SHM_RING_HDR_SIZE + ring_size) < 0 ||
+        shm_ring_map(ring, SHM_RING_HDR_SIZE + ring_size,
+                     PROT_READ | PROT_WRITE) < 0) {
+        perror("shm_ring size");
+        shm_ring_destroy(ring);
+        return NULL;
+    }
+    ring->mask = ring_size - 1;
+    ring->hdr->version = SHM_RING_VERSION;
+    ring->hdr->size = ring_size;
+    ring->hdr->data_offset = SHM_RING_HDR_SIZE;
+    __atomic_store_n(&ring->hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    if (sock_path != NULL && shm_ring_listen(ring, sock_path) != 0) {
+        shm_ring_destroy(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+// Wait until the consumer frees room for need bytes
+static void shm_ring_wait_space(shm_ring_t *ring, uint64_t head,
+                                uint64_t need) {
+    shm_ring_hdr_t *hdr = ring->hdr;
+
+    __atomic_store_n(&hdr->producer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    ring->tail_cache = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    if (hdr->size - (head - ring->tail_cache) < need) {
+        doorbell_wait(ring->space_efd);
+    }
+    __atomic_store_n(&hdr->producer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+int shm_ring_write(shm_ring_t *ring, const void *buf, size_t len, int block) {
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+
+    return shm_ring_writev(ring, &iov, 1, block);
+}
+
+// Copy one body, gathered from iovcnt pieces, into the ring.  Returns 0, or
+// -1 with errno set to EAGAIN when the ring is full and block is 0, or
+// EMSGSIZE if it can never fit.
+int shm_ring_writev(shm_ring_t *ring, const struct iovec *iov, int iovcnt,
+                    int block) {
+    shm_ring_hdr_t *hdr = ring->hdr;
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    uint64_t need = REC_SIZE(len);
+
+    if (need > hdr->size / 2) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint64_t head = hdr->head;
+    uint64_t off = head & ring->mask;
+    uint64_t pad = hdr->size - off < need ? hdr->size - off : 0;
+
+    while (hdr->size - (head - ring->tail_cache) < pad + need) {
+        ring->tail_cache = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+        if (hdr->size - (head - ring->tail_cache) >= pad + need) {
+            break;
+        }
+        if (!block) {
+            hdr->dropped++;
+            errno = EAGAIN;
+            return -1;
+        }
+        shm_ring_wait_space(ring, head, pad + need);
+    }
+
+    if (pad) {
+        ((shm_ring_rec_t *)(ring->data + off))->len = SHM_RING_WRAP;
+        head += pad;
+        off = 0;
+    }
+    shm_ring_rec_t *rec = (shm_ring_rec_t *)(ring->data + off);
+    char *dst = (char *)(rec + 1);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    rec->len = len;
+    rec->flags = 0;
+
+    __atomic_store_n(&hdr->head, head + need, __ATOMIC_RELEASE);
+    hdr->written++;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->consumer_waiting, __ATOMIC_RELAXED)) {
+        hdr->doorbells++;
+        doorbell(ring->data_efd);
+    }
+
+    return 0;
+}
+
+void shm_ring_destroy(shm_ring_t *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    if (ring->listen_fd >= 0) {
+        shutdown(ring->listen_fd, SHUT_RDWR);
+        if (ring->sock_path) {
+            pthread_join(ring->handoff_th, NULL);
+            unlink(ring->sock_path);
+            free(ring->sock_path);
+        }
+        close(ring->listen_fd);
+    }
+    if (ring->hdr) {
+        munmap(ring->hdr, SHM_RING_HDR_SIZE + ring->mask + 1);
+    }
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+    }
+    if (ring->data_efd >= 0) {
+        close(ring->data_efd);
+    }
+    if (ring->space_efd >= 0) {
+        close(ring->space_efd);
+    }
+    free(ring);
+}
+
+shm_ring_t *shm_ring_attach(const char *sock_path) {
+    struct sockaddr_un name;
+    int fds[3];
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("shm_ring socket");
+        return NULL;
+    }
+    memset(&name, 0, sizeof(name));
+    name.sun_family = AF_UNIX;
+    strncpy(name.sun_path, sock_path, sizeof(name.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
+        perror("shm_ring connect");
+        close(sock);
+        return NULL;
+    }
+
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = ctrl.buf,
+                         .msg_controllen = sizeof(ctrl.buf)};
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    close(sock);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n <= 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        fprintf(stderr, "shm_ring: no descriptors from %s\n", sock_path);
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    shm_ring_t *ring = calloc(1, sizeof(shm_ring_t));
+    ring->ring_fd = fds[0];
+    ring->data_efd = fds[1];
+    ring->space_efd = fds[2];
+    ring->listen_fd = -1;
+
+    struct stat st;
+    if (fstat(ring->ring_fd, &st) < 0 || st.st_size <= SHM_RING_HDR_SIZE ||
+        shm_ring_map(ring, st.st_size, PROT_READ | PROT_WRITE) < 0) {
+        shm_ring_destroy(ring);
+        return NULL;
+    }
+    if (__atomic_load_n(&ring->hdr->magic, __ATOMIC_ACQUIRE) !=
+            SHM_RING_MAGIC ||
+        ring->hdr->version != SHM_RING_VERSION ||
+        ring->hdr->size + SHM_RING_HDR_SIZE != st.st_size) {
+        fprintf(stderr, "shm_ring: unsupported ring layout\n");
+        ring->mask = st.st_size - SHM_RING_HDR_SIZE - 1;
+        shm_ring_destroy(ring);
+        return NULL;
+    }
+    ring->mask = ring->hdr->size - 1;
+
+    return ring;
+}
+
+// Return the next body in place, or NULL if the ring is empty and block is
+// 0.  The body stays valid until shm_ring_release().
+const char *shm_ring_peek(shm_ring_t *ring, uint32_t *len, int block) {
+    shm_ring_hdr_t *hdr = ring->hdr;
+    int spin = 0;
+
+    while (1) {
+        uint64_t tail = hdr->tail;
+        uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+        if (head != tail) {
+            uint64_t off = tail & ring->mask;
+            shm_ring_rec_t *rec = (shm_ring_rec_t *)(ring->data + off);
+
+            if (rec->len == SHM_RING_WRAP) {
+                __atomic_store_n(&hdr->tail, tail + hdr->size - off,
+                                 __ATOMIC_RELEASE);
+                continue;
+            }
+            *len = rec->len;
+            return (const char *)(rec + 1);
+        }
+        if (!block) {
+            return NULL;
+        }
+        if (spin++ < SHM_RING_SPIN) {
+            continue;
+        }
+        spin = 0;
+
+        __atomic_store_n(&hdr->consumer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) == tail) {
+            doorbell_wait(ring->data_efd);
+        }
+        __atomic_store_n(&hdr->consumer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+void shm_ring_release(shm_ring_t *ring, uint32_t len) {
+    shm_ring_hdr_t *hdr = ring->hdr;
+
+    __atomic_store_n(&hdr->tail, hdr->tail + REC_SIZE(len), __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->producer_waiting, __ATOMIC_RELAXED)) {
+        doorbell(ring->space_efd);
+    }
+}
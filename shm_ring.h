@@ -0,0 +1,103 @@
+#ifndef _SHM_RING_H
+#define _SHM_RING_H 1
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define SHM_RING_MAGIC 0x53474252 /* "SGBR" */
+#define SHM_RING_VERSION 1
+
+#define SHM_RING_HDR_SIZE 4096   /* data area starts at this offset */
+#define SHM_RING_ALIGN 8         /* records start on this boundary */
+#define SHM_RING_WRAP 0xffffffff /* record len: skip to the start of data */
+
+// Shared memory ring between the bridge (single producer) and the Smart
+// Gateway (single consumer).
+//
+// The mapping is a SHM_RING_HDR_SIZE header followed by `size` bytes of
+// data, size is a power of 2.  head and tail are free running byte counters,
+// a position maps to data[pos & (size - 1)].  The producer owns head, the
+// consumer owns tail, each sits on its own cache line.
+//
+// Every record starts on an SHM_RING_ALIGN boundary with a shm_ring_rec_t
+// followed by len bytes of message body (one decoded AMQP body section, or
+// the raw message in --passthrough mode).
+// Records never wrap: when a record does not fit before the end of the data
+// area the producer writes a record with len == SHM_RING_WRAP and continues
+// at offset 0, so the consumer can always read a body in place.
+//
+// The producer publishes a record by storing head with release semantics,
+// the consumer frees it by storing tail with release semantics.
+//
+// Doorbells are two eventfds.  A consumer that finds the ring empty sets
+// consumer_waiting, re-checks head and then blocks in read(data_efd).  The
+// producer writes data_efd only when consumer_waiting is set, so a busy
+// consumer costs no syscalls at all.  space_efd is the same handshake in the
+// other direction, used only when the bridge runs with --block.
+//
+// The ring fd and both eventfds are handed to whoever connects to the
+// bridge's unix stream socket, in one SCM_RIGHTS message carrying
+// [ring_fd, data_efd, space_efd].  Only one consumer may read at a time.
+typedef struct {
+    uint32_t len;
+    uint32_t flags; // reserved, 0
+} shm_ring_rec_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;        // bytes in the data area
+    uint64_t data_offset; // SHM_RING_HDR_SIZE
+
+    // Producer cache line
+    volatile uint64_t head __attribute__((aligned(64)));
+    volatile uint32_t producer_waiting;
+
+    // Consumer cache line
+    volatile uint64_t tail __attribute__((aligned(64)));
+    volatile uint32_t consumer_waiting;
+
+    // Producer stats
+    volatile uint64_t written __attribute__((aligned(64)));
+    volatile uint64_t dropped;
+    volatile uint64_t doorbells;
+} shm_ring_hdr_t;
+
+typedef struct {
+    shm_ring_hdr_t *hdr;
+    char *data;
+    uint64_t mask;
+
+    int ring_fd;
+    int data_efd;
+    int space_efd;
+
+    // Producer only
+    uint64_t tail_cache;
+    int listen_fd;
+    char *sock_path;
+    pthread_t handoff_th;
+} shm_ring_t;
+
+// Producer side, used by the bridge
+extern shm_ring_t *shm_ring_create(const char *sock_path, const char *file,
+                                   size_t size);
+
+extern int shm_ring_write(shm_ring_t *ring, const void *buf, size_t len,
+                          int block);
+
+extern int shm_ring_writev(shm_ring_t *ring, const struct iovec *iov,
+                           int iovcnt, int block);
+
+extern void shm_ring_destroy(shm_ring_t *ring);
+
+// Consumer side, used by the Smart Gateway (see tools/shm_ring_reader.c)
+extern shm_ring_t *shm_ring_attach(const char *sock_path);
+
+extern const char *shm_ring_peek(shm_ring_t *ring, uint32_t *len, int block);
+
+extern void shm_ring_release(shm_ring_t *ring, uint32_t len);
+
+#endif
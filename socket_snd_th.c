@@ -5,8 +5,11 @@
 #include <proton/message.h>
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,12 +19,63 @@
 #include <unistd.h>
 
 #include "bridge.h"
+#include "passthrough.h"
+#include "probes.h"
 #include "rb.h"
+#include "seq_header.h"
+#include "socket_snd_th.h"
 #include "utils.h"
 
-static struct addrinfo *peer_addrinfo;
+#define MAX_PEERS 8
+#define SEND_MAX_IOV 3 /* passthrough header, lane name, message */
+#define GSO_MAX_SEGS 64      /* UDP_MAX_SEGMENTS of older kernels */
+#define GSO_MAX_BYTES 65000  /* one UDP datagram before segmentation */
+
+// A --gw_inet address, with a UDP socket connected to it
+typedef struct {
+    int sock;
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+} peer_t;
+
+static peer_t peers[MAX_PEERS];
+static int n_peers = 0;
+static time_t resolve_at = 0; // re-resolve --gw_inet then, 0 for never
+
+// Datagrams waiting for one UDP_SEGMENT send, --udp_gso
+static struct {
+    char data[GSO_MAX_BYTES];
+    uint16_t len[GSO_MAX_SEGS];
+    int n;
+    size_t used;
+    size_t seg;     // segment size, the largest datagram with --udp_gso_pad
+    size_t max_seg; // the largest that fits the path MTU
+    char pad[GSO_MAX_BYTES];
+    uint64_t keys[GSO_MAX_SEGS]; // --dedup, of the messages in the batch
+    int n_keys;
+} gso;
+
 static pn_message_t *m_glbl = NULL;
 
+// Set while a proactor thread sends a message itself, --inline
+static __thread bool inline_send = false;
+
+// Set when an inline message is left to the sender thread unsent, its body
+// is a list that could go out only in part
+static __thread bool inline_deferred = false;
+
+// When the message being sent was committed to its ring, CLOCK_MONOTONIC
+// ns, 0 for just now
+static __thread uint64_t send_enqueued = 0;
+
+// --dedup on the body of the message being decoded, it has no id to go by
+static __thread bool dedup_body = false;
+
+// --dedup key of the message being sent, remembered only once it went out:
+// after a failed send the redundant copy is no duplicate
+static __thread bool dedup_pending = false;
+static __thread uint64_t dedup_pending_key;
+
 static int prepare_send_socket_unix(app_data_t *app) {
     struct sockaddr_un name;
 
@@ -45,82 +99,508 @@ static int prepare_send_socket_unix(app_data_t *app) {
     return 0;
 }
 
-static int prepare_send_socket_inet(app_data_t *app) {
-    struct addrinfo hints;
+// UDP payload of a connected socket that fits the path MTU
+static size_t peer_max_payload(peer_t *peer) {
+    int mtu = 1500;
+    socklen_t len = sizeof(mtu);
 
-    memset(&hints, 0, sizeof(struct addrinfo));
+    if (peer->sa.ss_family == AF_INET6) {
+        getsockopt(peer->sock, IPPROTO_IPV6, IPV6_MTU, &mtu, &len);
+        return mtu - 40 - 8;
+    }
+    getsockopt(peer->sock, IPPROTO_IP, IP_MTU, &mtu, &len);
+    return mtu - 20 - 8;
+}
+
+// Resolve --gw_inet and connect a socket to every address it has, keeping
+// the sockets of addresses that did not change.  On failure the previous
+// addresses stay in use.
+static int resolve_peers(app_data_t *app) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                             .ai_socktype = SOCK_DGRAM,
+                             .ai_flags = AI_ADDRCONFIG};
+    struct addrinfo *res;
+    peer_t next[MAX_PEERS];
+    int n_next = 0;
 
-    hints.ai_family = AF_UNSPEC, hints.ai_socktype = SOCK_DGRAM,
-    hints.ai_protocol = 0, hints.ai_flags = AI_ADDRCONFIG;
+    resolve_at = app->resolve_period ? time(NULL) + app->resolve_period : 0;
 
-    int err =
-        getaddrinfo(app->peer_host, app->peer_port, &hints, &peer_addrinfo);
+    int err = getaddrinfo(app->peer_host, app->peer_port, &hints, &res);
     if (err != 0) {
-        fprintf(stderr, "%s: getaddrinfo returned non-zero value: %d\n",
-                __func__, errno);
-        perror("Error");
-        freeaddrinfo(peer_addrinfo);
+        fprintf(stderr, "%s: getaddrinfo %s: %s\n", __func__, app->peer_host,
+                gai_strerror(err));
+        return -1;
+    }
+    for (struct addrinfo *ai = res; ai && n_next < MAX_PEERS;
+         ai = ai->ai_next) {
+        peer_t *peer = &next[n_next];
+
+        peer->sock = -1;
+        memcpy(&peer->sa, ai->ai_addr, ai->ai_addrlen);
+        peer->sa_len = ai->ai_addrlen;
+        for (int i = 0; i < n_peers; i++) {
+            if (peers[i].sock != -1 && peers[i].sa_len == peer->sa_len &&
+                memcmp(&peers[i].sa, &peer->sa, peer->sa_len) == 0) {
+                peer->sock = peers[i].sock; // unchanged, keep it
+                peers[i].sock = -1;
+                break;
+            }
+        }
+        if (peer->sock == -1) {
+            // Connected once, sends skip the route and neighbour lookup
+            peer->sock =
+                socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (peer->sock == -1 ||
+                connect(peer->sock, ai->ai_addr, ai->ai_addrlen) == -1) {
+                fprintf(stderr, "%s: cannot connect to %s\n", __func__,
+                        app->peer_host);
+                perror("Error");
+                if (peer->sock != -1) {
+                    close(peer->sock);
+                }
+                continue;
+            }
+            char host[NI_MAXHOST], port[NI_MAXSERV];
+            getnameinfo(ai->ai_addr, ai->ai_addrlen, host, sizeof(host), port,
+                        sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+            printf("%s ==> (%s:%s)\n", app->container_id, host, port);
+        }
+        n_next++;
+    }
+    freeaddrinfo(res);
+    if (n_next == 0) {
+        return -1;
+    }
+
+    // Addresses that went away
+    for (int i = 0; i < n_peers; i++) {
+        if (peers[i].sock != -1) {
+            close(peers[i].sock);
+        }
+    }
+    memcpy(peers, next, n_next * sizeof(peer_t));
+    n_peers = n_next;
+    app->send_sock = peers[0].sock;
+
+    gso.max_seg = GSO_MAX_BYTES;
+    for (int i = 0; i < n_peers; i++) {
+        size_t max = peer_max_payload(&peers[i]);
+        gso.max_seg = max < gso.max_seg ? max : gso.max_seg;
+    }
+
+    return 0;
+}
+
+// A new --gw_inet host:port from the control socket, the sender owns it
+// from now on
+static void take_retarget(app_data_t *app) {
+    // What the last retarget allocated, the first peer_host is not ours
+    static char *retargeted = NULL;
+    char *target = __atomic_exchange_n(&app->retarget, NULL, __ATOMIC_ACQUIRE);
+
+    if (target) {
+        char *port = strrchr(target, ':');
+
+        *port++ = '\0';
+        printf("Sending to %s:%s from now on\n", target, port);
+        app->peer_host = target;
+        app->peer_port = port;
+        free(retargeted);
+        retargeted = target;
+    }
+}
+
+static int prepare_send_socket_inet(app_data_t *app) {
+    if (resolve_peers(app) == -1) {
         return -1;
     }
+    if (app->udp_gso) {
+        printf("UDP GSO: up to %d datagrams of at most %zuB per send%s\n",
+               app->udp_gso, gso.max_seg,
+               app->udp_gso_pad ? ", padded" : "");
+    }
+
+    return 0;
+}
 
-    app->send_sock =
-        socket(peer_addrinfo->ai_family, peer_addrinfo->ai_socktype,
-               peer_addrinfo->ai_protocol);
-    if (app->send_sock == -1) {
-        fprintf(stderr, "%s: socket returned -1\n", __func__);
-        perror("Error");
-        freeaddrinfo(peer_addrinfo);
+static int prepare_send_shm_ring(app_data_t *app) {
+    app->shm_ring = shm_ring_create(app->shm_ring_sock, app->shm_ring_file,
+                                    app->shm_ring_size);
+    if (app->shm_ring == NULL) {
         return -1;
     }
+    printf("%s ==> (%s, %luB ring)\n", app->container_id, app->shm_ring_sock,
+           app->shm_ring->hdr->size);
 
-    char addrstr[100];
+    return 0;
+}
 
-    void *ptr = &((struct sockaddr_in *)peer_addrinfo->ai_addr)->sin_addr;
-    inet_ntop(peer_addrinfo->ai_family, ptr, addrstr, sizeof(addrstr));
+// sendmsg() to the unix socket, or to every --gw_inet address.  Sent if
+// any address took it, otherwise errno is the one of the last failure.
+static ssize_t send_msg(app_data_t *app, struct msghdr *msg, int flags) {
+    if (app->domain != AF_INET) {
+        msg->msg_name = &app->sa;
+        msg->msg_namelen = app->sa_len;
+        return sendmsg(app->send_sock, msg, flags);
+    }
+
+    ssize_t sent = -1;
+    int err = 0;
+    for (int i = 0; i < n_peers; i++) {
+        ssize_t ret = sendmsg(peers[i].sock, msg, flags);
+        if (ret >= 0) {
+            sent = ret;
+        } else {
+            err = errno;
+        }
+    }
+    if (sent < 0) {
+        errno = err;
+    }
+    return sent;
+}
 
-    printf(
-        "%s ==> (%s:%d)\n", app->container_id, addrstr,
-        ntohs(
-            (((struct sockaddr_in *)((struct sockaddr *)peer_addrinfo->ai_addr))
-                 ->sin_port)));
+static int send_flags(app_data_t *app) {
+    // The proactor thread never blocks
+    int flags = __atomic_load_n(&app->socket_flags, __ATOMIC_RELAXED);
 
-    memcpy(&app->sa, peer_addrinfo->ai_addr, peer_addrinfo->ai_addrlen);
-    app->sa_len = peer_addrinfo->ai_addrlen;
+    return inline_send ? flags | MSG_DONTWAIT : flags;
+}
 
+// Account for a send of n datagrams, 1 on an error that will not go away
+static int send_result(app_data_t *app, ssize_t sent_bytes, int n) {
+    PROBE2(send, sent_bytes, sent_bytes < 0 ? errno : 0);
+    if (sent_bytes <= 0) {
+        app->sock_unsent += n;
+        // MSG_DONTWAIT is set
+        switch (errno) {
+        case EAGAIN:
+            // Normal backup
+            app->sock_would_block += n;
+            break;
+        case EBADF:
+        case ENOTSOCK:
+            // sockfd is not a valid file descriptor
+            // TODO reopen socket
+            perror("SG Send");
+            return 1;
+            break;
+        case ECONNREFUSED:
+            break;
+        default:
+            perror("SG Send");
+            printf("%d ", errno);
+            return 1;
+        }
+    } else {
+        app->sock_sent += n;
+        app->sock_bytes += sent_bytes;
+    }
     return 0;
 }
 
+// Wait for the --pace token buckets to allow n datagrams of bytes.  The
+// proactor thread never waits, its sends delay the sender thread's.
+static void pace(app_data_t *app, int n, size_t bytes) {
+    if (app->pacer == NULL) {
+        return;
+    }
+    if (inline_send) {
+        pacer_take(app->pacer, n, bytes, false);
+        return;
+    }
+    stage_switch(&app->snd_acct, STAGE_PACE);
+    pacer_take(app->pacer, n, bytes, true);
+    stage_switch(&app->snd_acct, STAGE_DECODE);
+}
+
+// Send one datagram, or ring record, gathered from iovcnt pieces, already
+// paced for
+static int send_paced(app_data_t *app, struct iovec *iov, int iovcnt) {
+    int flags = send_flags(app);
+    ssize_t sent_bytes;
+
+    // The stage accounting is the sender thread's
+    if (!inline_send) {
+        stage_switch(&app->snd_acct, STAGE_SEND);
+    }
+    if (app->null_sink) {
+        sent_bytes = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            sent_bytes += iov[i].iov_len;
+        }
+    } else if (app->shm_ring) {
+        // Same errno contract as sendmsg(), EAGAIN when the ring is full
+        sent_bytes = -1;
+        if (shm_ring_writev(app->shm_ring, iov, iovcnt,
+                            !(flags & MSG_DONTWAIT)) == 0) {
+            sent_bytes = 0;
+            for (int i = 0; i < iovcnt; i++) {
+                sent_bytes += iov[i].iov_len;
+            }
+        }
+        // For the stats, the ring is gone once the sender exits
+        app->shm_ring_doorbells = app->shm_ring->hdr->doorbells;
+    } else {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+        sent_bytes = send_msg(app, &msg, flags);
+    }
+    if (!inline_send) {
+        stage_switch(&app->snd_acct, STAGE_DECODE);
+    }
+    return send_result(app, sent_bytes, 1);
+}
+
+// Send one datagram, or ring record, gathered from iovcnt pieces
+static int send_now(app_data_t *app, struct iovec *iov, int iovcnt) {
+    if (app->pacer) {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            len += iov[i].iov_len;
+        }
+        pace(app, 1, len);
+    }
+    return send_paced(app, iov, iovcnt);
+}
+
+// Send the batched datagrams, several of them as one UDP_SEGMENT send
+static int gso_send(app_data_t *app) {
+    int n = gso.n;
+    size_t len = gso.used;
+    char *data = gso.data;
+
+    if (n == 0) {
+        return 0;
+    }
+    if (app->udp_gso_pad && n > 1) {
+        // All but the last padded to the segment size with spaces, which
+        // JSON consumers skip
+        char *from = gso.data;
+        for (int i = 0; i < n; i++) {
+            memcpy(gso.pad + i * gso.seg, from, gso.len[i]);
+            if (i < n - 1) {
+                memset(gso.pad + i * gso.seg + gso.len[i], ' ',
+                       gso.seg - gso.len[i]);
+            }
+            from += gso.len[i];
+        }
+        data = gso.pad;
+        len = (n - 1) * gso.seg + gso.len[n - 1];
+    }
+
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (n > 1) {
+        uint16_t seg = gso.seg;
+
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(seg));
+        memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+    }
+
+    // The whole batch is paced as one, its datagrams leave back to back
+    pace(app, n, len);
+    if (!inline_send) {
+        stage_switch(&app->snd_acct, STAGE_SEND);
+    }
+    ssize_t sent_bytes = send_msg(app, &msg, send_flags(app));
+    if (!inline_send) {
+        stage_switch(&app->snd_acct, STAGE_DECODE);
+    }
+
+    gso.n = 0;
+    gso.used = 0;
+    if (sent_bytes < 0 && n > 1 && (errno == EIO || errno == EINVAL)) {
+        // No segmentation offload on this path, send one by one from now on.
+        // The batch was paced for already.
+        fprintf(stderr, "UDP GSO: %s, disabled\n", strerror(errno));
+        app->udp_gso = 0;
+
+        int err = 0;
+        char *from = gso.data;
+        for (int i = 0; i < n; i++) {
+            struct iovec one = {.iov_base = from, .iov_len = gso.len[i]};
+            err += send_paced(app, &one, 1);
+            from += gso.len[i];
+        }
+        return err;
+    }
+    if (sent_bytes > 0 && n > 1) {
+        app->gso_sends++;
+    }
+    return send_result(app, sent_bytes, n);
+}
+
+// Send the batch, then remember the --dedup keys of its messages if all
+// of it went out
+static int gso_flush(app_data_t *app) {
+    long unsent = app->sock_unsent;
+    int err = gso_send(app);
+
+    if (app->sock_unsent == unsent) {
+        for (int i = 0; i < gso.n_keys; i++) {
+            dedup_add(app->dedup, gso.keys[i]);
+        }
+    }
+    gso.n_keys = 0;
+    return err;
+}
+
+// Whether a datagram of len bytes can join the batch
+static bool gso_fits(app_data_t *app, size_t len) {
+    if (app->udp_gso_pad) {
+        size_t seg = len > gso.seg ? len : gso.seg;
+        return (gso.n + 1) * seg <= GSO_MAX_BYTES;
+    }
+    // Segments are all the same size, only the last can be shorter
+    return len <= gso.seg && gso.used + len <= GSO_MAX_BYTES;
+}
+
+// Batch the datagram for a UDP_SEGMENT send, the batch goes out when it is
+// full, when the next datagram does not fit it or when the sender is idle
+static int gso_add(app_data_t *app, struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    int err = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len == 0 || len > gso.max_seg) {
+        // Would be IP fragments, not segments
+        err = gso_flush(app);
+        return err + send_now(app, iov, iovcnt);
+    }
+    if (gso.n && !gso_fits(app, len)) {
+        err = gso_flush(app);
+    }
+    if (gso.n == 0 || len > gso.seg) {
+        gso.seg = len;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(gso.data + gso.used, iov[i].iov_base, iov[i].iov_len);
+        gso.used += iov[i].iov_len;
+    }
+    gso.len[gso.n++] = len;
+
+    if ((!app->udp_gso_pad && len < gso.seg) || gso.n == app->udp_gso) {
+        err += gso_flush(app);
+    }
+    return err;
+}
+
+// Fill in the --seq_header of the next datagram
+static void seq_header(app_data_t *app, seq_hdr_t *hdr) {
+    struct timespec now;
+    uint64_t enqueued;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    enqueued = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    if (send_enqueued) {
+        // How long ago, on the wall clock
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        enqueued -= now.tv_sec * 1000000000ULL + now.tv_nsec - send_enqueued;
+    }
+
+    hdr->magic = htons(SEQ_MAGIC);
+    hdr->version = SEQ_VERSION;
+    hdr->flags = 0;
+    hdr->stream = htonl(app->seq_stream);
+    hdr->seq = htobe64(app->seq++);
+    hdr->enqueued_ns = htobe64(enqueued);
+    hdr->unsent = htonl(app->sock_unsent);
+    hdr->ring_drops = htonl(app->ring_drops);
+}
+
+static int send_iov(app_data_t *app, struct iovec *iov, int iovcnt) {
+    struct iovec seq_iov[SEND_MAX_IOV + 1];
+    seq_hdr_t hdr;
+
+    if (app->seq_header) {
+        seq_header(app, &hdr);
+        seq_iov[0].iov_base = &hdr;
+        seq_iov[0].iov_len = sizeof(hdr);
+        memcpy(&seq_iov[1], iov, iovcnt * sizeof(struct iovec));
+        iov = seq_iov;
+        iovcnt++;
+    }
+    if (app->udp_gso && n_peers && !app->null_sink) {
+        return gso_add(app, iov, iovcnt);
+    }
+    return send_now(app, iov, iovcnt);
+}
+
+// Send collectd JSON as binary records, anything else as it is
+static int send_body(app_data_t *app, const char *data, size_t len) {
+    struct iovec iov[2];
+
+    if (app->transcode && transcode(app->transcode, data, len, iov) == 0) {
+        long sent = app->sock_sent;
+        int err = send_iov(app, iov, 2);
+        if (app->sock_sent == sent) {
+            transcode_lost(app->transcode);
+        }
+        return err;
+    }
+    iov[0].iov_base = (void *)data;
+    iov[0].iov_len = len;
+
+    return send_iov(app, iov, 1);
+}
+
+static int send_aggregate(const char *json, size_t len, void *app_ptr) {
+    return send_body((app_data_t *)app_ptr, json, len);
+}
+
+// --dedup: whether key was seen, dedup_settle() remembers it if not
+static bool duplicate(app_data_t *app, uint64_t key) {
+    bool dup = dedup_has(app->dedup, key);
+    dedup_pending = !dup;
+    dedup_pending_key = key;
+    return dup;
+}
+
+// --dedup: remember the key of the message just processed unless one of
+// its sends failed since unsent was read, with the batch it joined
+static void dedup_settle(app_data_t *app, long unsent) {
+    if (!dedup_pending) {
+        return;
+    }
+    dedup_pending = false;
+    if (gso.n && gso.n_keys == GSO_MAX_SEGS) {
+        // Folded into --aggregate windows while the batch waits
+        gso_flush(app);
+    }
+    if (app->sock_unsent != unsent) {
+        return;
+    }
+    if (gso.n) {
+        gso.keys[gso.n_keys++] = dedup_pending_key;
+    } else {
+        dedup_add(app->dedup, dedup_pending_key);
+    }
+}
+
 static int process_message_binary(app_data_t *app, pn_data_t *body) {
     pn_bytes_t b = pn_data_get_bytes(body);
     if (b.start != NULL) {
-        int send_flags = app->socket_flags;
-
-        ssize_t sent_bytes = sendto(app->send_sock, b.start, b.size, send_flags,
-                                    &app->sa, app->sa_len);
-        if (sent_bytes <= 0) {
-            // MSG_DONTWAIT is set
-            switch (errno) {
-            case EAGAIN:
-                // Normal backup
-                app->sock_would_block++;
-                break;
-            case EBADF:
-            case ENOTSOCK:
-                // sockfd is not a valid file descriptor
-                // TODO reopen socket
-                perror("SG Send");
-                return 1;
-                break;
-            case ECONNREFUSED:
-                break;
-            default:
-                perror("SG Send");
-                printf("%d ", errno);
-                return 1;
-            }
-        } else {
-            app->sock_sent++;
+        if (dedup_body && duplicate(app, hash64(b.start, b.size))) {
+            return 0;
         }
+        // Only the payload of an oslo.messaging envelope goes on
+        if (app->oslo) {
+            oslo_unwrap(app->oslo, b.start, b.size, &b.start, &b.size);
+        }
+        // collectd JSON waits for the end of the aggregation window
+        if (app->aggregate &&
+            aggregate_add(app->aggregate, b.start, b.size) == 0) {
+            return 0;
+        }
+        return send_body(app, b.start, b.size);
     }
     return 0;
 }
@@ -147,7 +627,45 @@ static int process_message_body(app_data_t *app, pn_data_t *body) {
     return err;
 }
 
-static int decode_message(app_data_t *app, pn_rwbytes_t data) {
+// Past its absolute-expiry-time, or its ttl counted from the enqueue
+static bool message_expired(app_data_t *app, pn_message_t *m) {
+    struct timespec now;
+
+    pn_timestamp_t expiry = pn_message_get_expiry_time(m);
+    if (expiry) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec * 1000LL + now.tv_nsec / 1000000 > expiry) {
+            return true;
+        }
+    }
+    pn_millis_t ttl = pn_message_get_ttl(m);
+    // Inline messages were received just now
+    uint64_t put = inline_send ? 0 : rb_tail_time(app->lanes->current->rb);
+    if (ttl && put) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec * 1000000000ULL + now.tv_nsec - put >
+            ttl * 1000000ULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// --dedup_key id: whether a message with the same id was seen, any type
+// of id is compared by its encoding.  Without an id the body decides.
+static bool duplicate_id(app_data_t *app, pn_message_t *m) {
+    char buf[256];
+
+    ssize_t len = pn_data_encode(pn_message_id(m), buf, sizeof(buf));
+    if (len <= 1) {
+        // None, or a null
+        dedup_body = true;
+        return false;
+    }
+    return duplicate(app, hash64(buf, len));
+}
+
+static int decode_body(app_data_t *app, pn_rwbytes_t data) {
     pn_message_t *m;
 
     // Use a static message with pn_message_clear(...)
@@ -160,8 +678,23 @@ static int decode_message(app_data_t *app, pn_rwbytes_t data) {
 
     int err = pn_message_decode(m, data.start, data.size);
     if (!err) {
+        if (app->drop_expired && message_expired(app, m)) {
+            app->amqp_expired++;
+            return 0;
+        }
         pn_data_t *body = pn_message_body(m);
-        if (pn_data_next(body)) {
+        bool has_body = pn_data_next(body);
+        // A would block halfway through a list could not be retried without
+        // sending its first elements twice
+        if (inline_send && has_body && pn_data_type(body) == PN_LIST) {
+            inline_deferred = true;
+            return 0;
+        }
+        dedup_body = app->dedup && !app->dedup_id;
+        if (app->dedup && app->dedup_id && duplicate_id(app, m)) {
+            return 0;
+        }
+        if (has_body) {
             err = process_message_body(app, body);
             if (err) {
                 return 1;
@@ -178,11 +711,119 @@ static int decode_message(app_data_t *app, pn_rwbytes_t data) {
     return 0;
 }
 
+int decode_message(app_data_t *app, pn_rwbytes_t data) {
+    PROBE2(decode_start, data.start, data.size);
+    int err = decode_body(app, data);
+    PROBE2(decode_end, data.start, err);
+
+    return err;
+}
+
+// Forward the message as received, optionally behind a passthrough_hdr_t
+static int passthrough_message(app_data_t *app, rb_lane_t *lane,
+                               pn_rwbytes_t data) {
+    struct iovec iov[3];
+    int iovcnt = 0;
+    passthrough_hdr_t hdr;
+
+    if (app->passthrough_header) {
+        hdr.magic = htons(PASSTHROUGH_MAGIC);
+        hdr.version = PASSTHROUGH_VERSION;
+        hdr.name_len = strnlen(lane->name, sizeof(lane->name));
+        hdr.msg_len = htonl(data.size);
+
+        iov[iovcnt].iov_base = &hdr;
+        iov[iovcnt++].iov_len = sizeof(hdr);
+        iov[iovcnt].iov_base = lane->name;
+        iov[iovcnt++].iov_len = hdr.name_len;
+    }
+    iov[iovcnt].iov_base = data.start;
+    iov[iovcnt++].iov_len = data.size;
+
+    return send_iov(app, iov, iovcnt);
+}
+
+// --inline: decode and send in the calling proactor thread, without the
+// ring hop.  Returns -1 with nothing sent when that would reorder messages
+// (the sender thread has some in hand or queued), when --pace holds sends
+// back, when the body is a list or when the socket would block, the caller
+// queues the message then.
+int inline_message(app_data_t *app, rb_lane_t *lane, pn_rwbytes_t data) {
+    if (pthread_mutex_trylock(&app->send_mutex) != 0) {
+        __atomic_add_fetch(&app->inline_queued, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    // Queued before processed: rb_try_get() counts a message processed
+    // before it moves the tail
+    if (rb_set_queued(app->lanes) != 0 ||
+        rb_set_processed(app->lanes) != app->snd_done ||
+        (app->pacer && !pacer_ready(app->pacer))) {
+        pthread_mutex_unlock(&app->send_mutex);
+        __atomic_add_fetch(&app->inline_queued, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    long sent = app->sock_sent;
+    long unsent = app->sock_unsent;
+    long would_block = app->sock_would_block;
+    uint64_t seq = app->seq;
+
+    inline_send = true;
+    inline_deferred = false;
+    send_enqueued = 0;
+    if (app->passthrough) {
+        passthrough_message(app, lane, data);
+    } else {
+        decode_message(app, data);
+    }
+    gso_flush(app);
+    // Requeued, the message is no duplicate of itself
+    dedup_settle(app, unsent);
+    inline_send = false;
+
+    // Nothing went out, the sender thread retries it
+    bool requeue = inline_deferred || (app->sock_sent == sent &&
+                                       app->sock_would_block != would_block);
+    if (requeue) {
+        // Not an attempt of its own, the sender thread makes that
+        app->sock_would_block = would_block;
+        app->sock_unsent = unsent;
+        app->seq = seq;
+        __atomic_add_fetch(&app->inline_queued, 1, __ATOMIC_RELAXED);
+    } else {
+        app->inline_sent++;
+    }
+    pthread_mutex_unlock(&app->send_mutex);
+
+    return requeue ? -1 : 0;
+}
+
+void socket_snd_drain(app_data_t *app, rb_rwbytes_t *rb, long kept) {
+    while (__atomic_load_n(&app->snd_out, __ATOMIC_ACQUIRE) +
+               rb->drops[RB_DROP_OLDEST] + rb->drops[RB_DROP_AGED] <
+           kept) {
+        usleep(1000);
+    }
+}
+
 void socket_snd_th_cleanup(void *app_ptr) {
     app_data_t *app = (app_data_t *)app_ptr;
 
     if (app) {
         app->socket_snd_th_running = 0;
+
+        // The window so far, sent without waiting: nothing reads it later
+        if (app->aggregate && app->aggregate->n_series) {
+            inline_send = true;
+            send_enqueued = 0;
+            aggregate_flush(app->aggregate, send_aggregate, app);
+            gso_flush(app);
+            inline_send = false;
+        }
+
+        shm_ring_t *ring = app->shm_ring;
+        app->shm_ring = NULL;
+        shm_ring_destroy(ring);
     }
 
     fprintf(stderr, "Exit SOCKET thread...\n");
@@ -197,31 +838,88 @@ void *socket_snd_th(void *app_ptr) {
     memset(&app->sa, 0, app->sa_len);
 
     // Create the send socket
-    switch (app->domain) {
-    case AF_UNIX:
-        if (prepare_send_socket_unix(app) == -1) {
-            fprintf(stderr, "Failed to create socket... exiting!");
+    if (app->null_sink) {
+        // --sink null, nothing to create
+    } else if (app->shm_ring_sock) {
+        if (prepare_send_shm_ring(app) == -1) {
+            fprintf(stderr, "Failed to create shared memory ring... exiting!");
             return NULL;
         }
-        break;
+    } else {
+        switch (app->domain) {
+        case AF_UNIX:
+            if (prepare_send_socket_unix(app) == -1) {
+                fprintf(stderr, "Failed to create socket... exiting!");
+                return NULL;
+            }
+            break;
 
-    case AF_INET:
-        if (prepare_send_socket_inet(app) == -1) {
-            fprintf(stderr, "Failed to create socket... exiting!");
-            return NULL;
-        }
-        break;
+        case AF_INET:
+            if (prepare_send_socket_inet(app) == -1) {
+                fprintf(stderr, "Failed to create socket... exiting!");
+                return NULL;
+            }
+            break;
 
-    default:
-        fprintf(stderr, "Unknown domain type: %d", app->domain);
-        break;
+        default:
+            fprintf(stderr, "Unknown domain type: %d", app->domain);
+            break;
+        }
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &app->rbin->total_t2);
+    stage_start(&app->snd_acct, "socket_snd_th", STAGE_RING_WAIT);
 
     while (1) {
-        pn_rwbytes_t *msg = rb_get(app->rbin);
-        decode_message(app, *msg);
+        pn_rwbytes_t *msg;
+
+        stage_switch(&app->snd_acct, STAGE_RING_WAIT);
+        if (app->aggregate) {
+            msg = rb_set_timedget(app->lanes, &app->aggregate->window_end);
+        } else {
+            msg = rb_set_get(app->lanes);
+        }
+        stage_switch(&app->snd_acct, STAGE_DECODE);
+        if (app->inline_mode) {
+            pthread_mutex_lock(&app->send_mutex);
+        }
+        if (app->aggregate && aggregate_due(app->aggregate)) {
+            send_enqueued = 0;
+            aggregate_flush(app->aggregate, send_aggregate, app);
+            gso_flush(app);
+        }
+        if (msg != NULL && msg->size == 0) {
+            app->snd_done++; // damaged in --rb_file, nothing to send
+        } else if (msg != NULL) {
+            long unsent = app->sock_unsent;
+
+            send_enqueued = rb_tail_time(app->lanes->current->rb);
+            if (app->passthrough) {
+                passthrough_message(app, app->lanes->current, *msg);
+            } else {
+                decode_message(app, *msg);
+            }
+            dedup_settle(app, unsent);
+            app->snd_done++;
+        }
+        if (gso.n && rb_set_queued(app->lanes) == 0) {
+            gso_flush(app); // idle, do not hold datagrams back
+        }
+        if (app->retarget || (resolve_at && time(NULL) >= resolve_at)) {
+            gso_flush(app);
+            take_retarget(app);
+            resolve_peers(app);
+        }
+        // --rb_file: held back in a batch is not sent yet.  Folded into an
+        // --aggregate window counts as done, a crash loses the window.
+        if (gso.n == 0) {
+            rb_done(app->rbin);
+        }
+        if (gso.n == 0) {
+            __atomic_store_n(&app->snd_out, app->snd_done, __ATOMIC_RELEASE);
+        }
+        if (app->inline_mode) {
+            pthread_mutex_unlock(&app->send_mutex);
+        }
     }
 
     if (app->send_sock != -1) {
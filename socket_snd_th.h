@@ -1,6 +1,27 @@
 #ifndef _SOCKET_SND_TH_H
 #define _SOCKET_SND_TH_H 1
 
+#include <proton/types.h>
+
+#include "rb_set.h"
+
+struct app_data;
+
 extern void *socket_snd_th(void *app_ptr);
 
+// Decode one AMQP message and send its body, 1 on a decode or send error.
+// Only called from the sender thread, and by tools/decode_bench.
+extern int decode_message(struct app_data *app, pn_rwbytes_t data);
+
+// Block until the sender has sent what a source kept in rb, less what the
+// drop policy shed.  For the replay and synthetic sources, before the main
+// thread stops the sender.
+extern void socket_snd_drain(struct app_data *app, rb_rwbytes_t *rb,
+                             long kept);
+
+// --inline, called from a proactor thread with a complete message.  -1 if
+// it was not sent and has to be queued.
+extern int inline_message(struct app_data *app, rb_lane_t *lane,
+                          pn_rwbytes_t data);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "stage_acct.h"
+#include "utils.h"
+
+static const char *stage_names[STAGE_MAX] = {
+    "proactor_wait", "delivery", "events", "ring_wait",
+    "decode",        "send",     "pace"};
+
+static double ns_per_tick = 1.0;
+
+// Measure the stage clock against CLOCK_MONOTONIC once at startup
+void stage_calibrate(void) {
+    struct timespec t1, t2, diff = {0, 0};
+    struct timespec pause = {0, 20000000};
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t c1 = stage_clock();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    uint64_t c2 = stage_clock();
+
+    time_diff(t1, t2, &diff);
+    if (c2 > c1) {
+        ns_per_tick = (diff.tv_sec * 1000000000.0 + diff.tv_nsec) / (c2 - c1);
+    }
+}
+
+void stage_start(stage_acct_t *acct, const char *name, stage_t stage) {
+    acct->name = name;
+    acct->stage = stage;
+    acct->last = stage_clock();
+}
+
+uint64_t stage_ns(stage_acct_t *acct, stage_t stage) {
+    return acct->ticks[stage] * ns_per_tick;
+}
+
+// Print the share of each stage since the previous report, the time spent
+// outside of the wait stages (pacing is one) is shown as busy and returned
+// in ns
+uint64_t stage_report(stage_acct_t *acct, uint64_t *last_ticks) {
+    uint64_t delta[STAGE_MAX];
+    uint64_t total = 0, busy = 0;
+
+    if (acct->name == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < STAGE_MAX; i++) {
+        uint64_t ticks = acct->ticks[i];
+
+        delta[i] = ticks - last_ticks[i];
+        last_ticks[i] = ticks;
+        total += delta[i];
+        if (i != STAGE_PROACTOR_WAIT && i != STAGE_RING_WAIT &&
+            i != STAGE_PACE) {
+            busy += delta[i];
+        }
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    char buf[32];
+    struct timespec busy_ts = {busy * ns_per_tick / 1000000000,
+                               (uint64_t)(busy * ns_per_tick) % 1000000000};
+
+    printf("%s: busy %ss", acct->name,
+           time_snprintf(buf, sizeof(buf), busy_ts));
+    for (int i = 0; i < STAGE_MAX; i++) {
+        if (delta[i]) {
+            printf(", %s: %.1f%%", stage_names[i], 100.0 * delta[i] / total);
+        }
+    }
+    printf("\n");
+
+    return busy * ns_per_tick;
+}
@@ -0,0 +1,62 @@
+#ifndef _STAGE_ACCT_H
+#define _STAGE_ACCT_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Pipeline stages, every thread only uses its own subset
+typedef enum {
+    // amqp_rcv_th
+    STAGE_PROACTOR_WAIT,
+    STAGE_DELIVERY,
+    STAGE_EVENTS, // everything else the proactor hands us
+    // socket_snd_th
+    STAGE_RING_WAIT,
+    STAGE_DECODE,
+    STAGE_SEND,
+    STAGE_PACE, // held back by --pace
+    STAGE_MAX
+} stage_t;
+
+// Time spent per stage by one thread.  The owning thread charges the time
+// since the last switch to the stage it is leaving, which costs one TSC
+// read per switch.  Other threads only read ticks[].
+typedef struct {
+    const char *name;
+    volatile uint64_t ticks[STAGE_MAX];
+    uint64_t last;
+    stage_t stage;
+} stage_acct_t;
+
+static inline uint64_t stage_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void stage_switch(stage_acct_t *acct, stage_t stage) {
+    uint64_t now = stage_clock();
+
+    acct->ticks[acct->stage] += now - acct->last;
+    acct->last = now;
+    acct->stage = stage;
+}
+
+extern void stage_calibrate(void);
+
+extern void stage_start(stage_acct_t *acct, const char *name, stage_t stage);
+
+extern uint64_t stage_ns(stage_acct_t *acct, stage_t stage);
+
+extern uint64_t stage_report(stage_acct_t *acct, uint64_t *last_ticks);
+
+#endif
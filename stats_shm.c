@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include <features.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bridge.h"
+#include "stats_shm.h"
+
+// Every counter published in the stats page, in page order.  New counters
+// go at the end so the index of the existing ones stays the same.
+#define STATS_SHM_COUNTERS(X)                                                  \
+    X(amqp_received, app->amqp_received)                                       \
+    X(amqp_partial, app->amqp_partial)                                         \
+    X(amqp_total_batches, app->amqp_total_batches)                             \
+    X(amqp_link_credit, app->amqp_link_credit)                                 \
+    X(link_credit, app->link_credit)                                           \
+    X(sock_sent, app->sock_sent)                                               \
+    X(amqp_decode_errs, app->amqp_decode_errs)                                 \
+    X(sock_would_block, app->sock_would_block)                                 \
+    X(rb_overruns, rb_set_overruns(app->lanes))                                \
+    X(rb_processed, rb_set_processed(app->lanes))                              \
+    X(rb_queue_block, app->lanes->queue_block)                                 \
+    X(rb_count, rb_size(app->rbin))                                            \
+    X(rb_buf_size, app->rbin->buf_size)                                        \
+    X(rb_inuse, rb_inuse_size(app->rbin))                                      \
+    X(shm_ring_doorbells, app->shm_ring_doorbells)                             \
+    X(rcv_proactor_wait_ns, rcv_stage_ns(app, STAGE_PROACTOR_WAIT))            \
+    X(rcv_delivery_ns, rcv_stage_ns(app, STAGE_DELIVERY))                      \
+    X(rcv_events_ns, rcv_stage_ns(app, STAGE_EVENTS))                          \
+    X(snd_ring_wait_ns, stage_ns(&app->snd_acct, STAGE_RING_WAIT))             \
+    X(snd_decode_ns, stage_ns(&app->snd_acct, STAGE_DECODE))                   \
+    X(snd_send_ns, stage_ns(&app->snd_acct, STAGE_SEND))                       \
+    X(capture_records, app->capture ? app->capture->hdr.count : 0)             \
+    X(rb_queued, rb_set_queued(app->lanes))                                    \
+    X(rb_lanes, app->lanes->n_lanes)                                           \
+    X(sock_bytes, app->sock_bytes)                                             \
+    X(transcode_msgs, app->transcode ? app->transcode->msgs : 0)               \
+    X(transcode_errs, app->transcode ? app->transcode->errs : 0)               \
+    X(transcode_resets, app->transcode ? app->transcode->resets : 0)           \
+    X(aggregate_samples, app->aggregate ? app->aggregate->samples : 0)         \
+    X(aggregate_emitted, app->aggregate ? app->aggregate->emitted : 0)         \
+    X(drop_oldest, rb_set_drops(app->lanes, RB_DROP_OLDEST))                   \
+    X(drop_sampled, rb_set_drops(app->lanes, RB_DROP_SAMPLED))                 \
+    X(drop_aged, rb_set_drops(app->lanes, RB_DROP_AGED))                       \
+    X(amqp_expired, app->amqp_expired)                                         \
+    X(inline_sent, app->inline_sent)                                           \
+    X(inline_queued, app->inline_queued)                                       \
+    X(gso_sends, app->gso_sends)                                               \
+    X(sock_unsent, app->sock_unsent)                                           \
+    X(rb_grows, rb_set_grows(app->lanes))                                      \
+    X(rb_shrinks, rb_set_shrinks(app->lanes))                                  \
+    X(rb_mem, rb_set_mem(app->lanes))                                          \
+    X(pace_waits, app->pacer ? app->pacer->waits : 0)                          \
+    X(pace_ns, app->pacer ? app->pacer->wait_ns : 0)                           \
+    X(lanes_queued, rb_set_queued(app->lanes))                                 \
+    X(amqp_presettled, app->amqp_presettled)                                   \
+    X(amqp_frames_out, app->amqp_frames_out)                                   \
+    X(oslo_unwrapped, app->oslo ? app->oslo->unwrapped : 0)                    \
+    X(dedup_checked, app->dedup ? app->dedup->checked : 0)                     \
+    X(dedup_dups, app->dedup ? app->dedup->dups : 0)                           \
+    X(amqp_reconnects, app->amqp_reconnects)                                   \
+    X(amqp_reconnect_ns, app->amqp_reconnect_ns)                               \
+    X(amqp_reconnect_kept, app->amqp_reconnect_kept)                           \
+    X(fair_sources, app->fair ? app->fair->n_sources : 0)                      \
+    X(fair_unclassified, app->fair ? app->fair->unclassified : 0)              \
+    X(drop_too_long, rb_set_drops(app->lanes, RB_DROP_TOO_LONG))              \
+    X(aggregate_errs, app->aggregate ? app->aggregate->errs : 0)
+
+// Summed over all proactor threads
+static uint64_t rcv_stage_ns(app_data_t *app, stage_t stage) {
+    uint64_t ns = 0;
+
+    for (int i = 0; i < app->amqp_threads; i++) {
+        ns += stage_ns(&app->rcv_acct[i], stage);
+    }
+    return ns;
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+stats_shm_t *stats_shm_open(const char *path) {
+    static const char *names[] = {
+#define X(name, value) #name,
+        STATS_SHM_COUNTERS(X)
+#undef X
+    };
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("stats_shm open");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(stats_shm_t)) < 0) {
+        perror("stats_shm ftruncate");
+        close(fd);
+        return NULL;
+    }
+    stats_shm_t *shm = mmap(NULL, sizeof(stats_shm_t), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("stats_shm mmap");
+        return NULL;
+    }
+
+    int n = sizeof(names) / sizeof(names[0]);
+
+    shm->version = STATS_SHM_VERSION;
+    shm->size = sizeof(stats_shm_t);
+    shm->n_counters = n;
+    shm->history_len = STATS_SHM_HISTORY;
+    shm->pid = getpid();
+    shm->start_time = realtime_ns();
+    for (int i = 0; i < n; i++) {
+        strncpy(shm->names[i], names[i], STATS_SHM_NAME_LEN - 1);
+    }
+    // Readers check the magic last, publish it once everything else is set
+    __atomic_store_n(&shm->magic, STATS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return shm;
+}
+
+// Called once per second from the main thread, the only writer
+void stats_shm_update(stats_shm_t *shm, app_data_t *app) {
+    if (shm == NULL) {
+        return;
+    }
+    uint64_t seq = shm->seq;
+
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    int i = 0;
+    shm->current.time = realtime_ns();
+#define X(name, value) shm->current.values[i++] = (uint64_t)(value);
+    STATS_SHM_COUNTERS(X)
+#undef X
+
+    memcpy(&shm->history[shm->history_count % STATS_SHM_HISTORY],
+           &shm->current, sizeof(shm->current));
+    shm->history_count++;
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void stats_shm_close(stats_shm_t *shm, const char *path) {
+    if (shm == NULL) {
+        return;
+    }
+    munmap(shm, sizeof(stats_shm_t));
+    unlink(path);
+}
@@ -0,0 +1,57 @@
+#ifndef _STATS_SHM_H
+#define _STATS_SHM_H 1
+
+#include <stdint.h>
+
+#define STATS_SHM_MAGIC 0x53474253 /* "SGBS" */
+#define STATS_SHM_VERSION 1
+
+#define STATS_SHM_MAX_COUNTERS 64
+#define STATS_SHM_NAME_LEN 32
+#define STATS_SHM_HISTORY 300 /* per second samples kept in the ring */
+
+// Layout of the stats page published under /dev/shm.  All integers are
+// native endian, the page is written by the bridge once per second and
+// only ever read by the consumers, so reading costs the bridge nothing.
+//
+// The page is guarded by a seqlock: the writer makes seq odd before it
+// touches anything and even again when it is done.  A reader copies the
+// parts it needs and retries if seq was odd or changed in the meantime.
+//
+// Counters are self describing: names[i] is the name of current[i] and of
+// history[*].values[i], so new counters can be appended without changing
+// the version.  The version changes only if this struct changes.
+typedef struct {
+    uint64_t time;   // CLOCK_REALTIME in ns when the sample was taken
+    uint64_t values[STATS_SHM_MAX_COUNTERS];
+} stats_shm_sample_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size; // sizeof(stats_shm_t) of the writer
+    uint32_t n_counters;
+    uint32_t history_len;
+    uint32_t pid;
+    uint64_t start_time; // CLOCK_REALTIME in ns at bridge startup
+
+    volatile uint64_t seq;
+
+    // Number of samples written to history so far, the latest one is at
+    // history[(history_count - 1) % history_len]
+    uint64_t history_count;
+
+    char names[STATS_SHM_MAX_COUNTERS][STATS_SHM_NAME_LEN];
+    stats_shm_sample_t current;
+    stats_shm_sample_t history[STATS_SHM_HISTORY];
+} stats_shm_t;
+
+struct app_data;
+
+extern stats_shm_t *stats_shm_open(const char *path);
+
+extern void stats_shm_update(stats_shm_t *shm, struct app_data *app);
+
+extern void stats_shm_close(stats_shm_t *shm, const char *path);
+
+#endif
@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include <features.h>
+
+#include <proton/message.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bridge.h"
+#include "pacer.h"
+#include "socket_snd_th.h"
+
+#define SYNTH_MSGS 256 /* distinct messages, sent in turn */
+
+// Encode collectd JSON messages like the ones a router delivers, one
+// interface metric per message from a fleet of hosts
+static int synth_corpus(app_data_t *app, pn_rwbytes_t *msgs) {
+    pn_message_t *m = pn_message();
+    char json[1024];
+
+    for (int i = 0; i < SYNTH_MSGS; i++) {
+        int len = snprintf(
+            json, sizeof(json),
+            "[{\"values\":[%d.5,%d],\"dstypes\":[\"gauge\",\"derive\"],"
+            "\"dsnames\":[\"rx\",\"tx\"],\"time\":1600000000.%03d,"
+            "\"interval\":10.000,\"host\":\"compute-%d.localdomain\","
+            "\"plugin\":\"interface\",\"plugin_instance\":\"eth%d\","
+            "\"type\":\"if_octets\",\"type_instance\":\"\"}]",
+            i * 7, i * 1000, i, i % 32, i % 8);
+
+        pn_message_clear(m);
+        pn_data_put_binary(pn_message_body(m), pn_bytes(len, json));
+        size_t size = app->ring_buffer_size;
+        msgs[i].start = malloc(size);
+        if (pn_message_encode(m, msgs[i].start, &size) != 0) {
+            fprintf(stderr, "Synthetic message does not fit a %dB buffer\n",
+                    app->ring_buffer_size);
+            pn_message_free(m);
+            return -1;
+        }
+        msgs[i].size = size;
+    }
+    pn_message_free(m);
+
+    return 0;
+}
+
+void synth_th_cleanup(void *app_ptr) {
+    app_data_t *app = (app_data_t *)app_ptr;
+
+    if (app) {
+        app->amqp_rcv_th_running = 0;
+    }
+
+    fprintf(stderr, "Exit SYNTHETIC thread...\n");
+}
+
+// --source synthetic: fill the ring buffer in place of the AMQP receiver,
+// at --synthetic_rate or as fast as the sender takes messages.  Like
+// replay, the ring is never overrun.
+void *synth_th(void *app_ptr) {
+    pthread_cleanup_push(synth_th_cleanup, app_ptr);
+
+    app_data_t *app = (app_data_t *)app_ptr;
+    rb_rwbytes_t *rb = app->rbin;
+    stage_acct_t *acct = &app->rcv_acct[0];
+    pn_rwbytes_t msgs[SYNTH_MSGS] = {{0}};
+    pacer_t *pacer = NULL;
+    long put = 0, kept = 0;
+
+    if (synth_corpus(app, msgs) == 0) {
+        printf("Synthetic source at %s\n",
+               app->synthetic_rate > 0 ? "a fixed rate" : "maximum rate");
+        if (app->synthetic_rate > 0) {
+            pacer = pacer_alloc(app->synthetic_rate, 0,
+                                atoi(DEFAULT_PACE_BURST));
+        }
+        // Waiting shows as proactor_wait, making messages as delivery
+        stage_start(acct, "synthetic", STAGE_DELIVERY);
+        while (app->message_count <= 0 || put < app->message_count) {
+            if (pacer) {
+                stage_switch(acct, STAGE_PROACTOR_WAIT);
+                pacer_take(pacer, 1, 0, true);
+                stage_switch(acct, STAGE_DELIVERY);
+            }
+            stage_switch(acct, STAGE_PROACTOR_WAIT);
+            while (rb_free_size(rb) == 0) {
+                pthread_mutex_lock(&rb->rb_mutex);
+                if (rb_free_size(rb) == 0) {
+                    pthread_cond_wait(&rb->rb_free, &rb->rb_mutex);
+                }
+                pthread_mutex_unlock(&rb->rb_mutex);
+            }
+            stage_switch(acct, STAGE_DELIVERY);
+            pn_rwbytes_t *msg = &msgs[put % SYNTH_MSGS];
+            pn_rwbytes_t *m = rb_get_head(rb);
+            if (m == NULL) {
+                fprintf(stderr, "Synthetic source out of ring memory\n");
+                break;
+            }
+            memcpy(m->start, msg->start, msg->size);
+            m->size = msg->size;
+            if (rb_put(rb) != NULL) {
+                kept++;
+            }
+            app->amqp_received++;
+            put++;
+        }
+        // Let the sender finish before the main thread stops it
+        socket_snd_drain(app, rb, kept);
+        printf("Synthetic source done, %ld messages\n", put);
+    }
+    pacer_free(pacer);
+    for (int i = 0; i < SYNTH_MSGS; i++) {
+        free(msgs[i].start);
+    }
+
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
@@ -0,0 +1,6 @@
+#ifndef _SYNTH_TH_H
+#define _SYNTH_TH_H 1
+
+extern void *synth_th(void *app_ptr);
+
+#endif
@@ -0,0 +1,157 @@
+// Reader for the shared memory stats page published with --stats_shm
+//
+// usage: bridge_stat [-w] [-n samples] /dev/shm/sg-bridge-<cid>
+//
+//   (no flag)   print the current value of every counter
+//   -w          print the per second rate of every counter until killed
+//   -n samples  dump the last samples of the history ring as CSV
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats_shm.h"
+
+static stats_shm_t *map_stats(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(stats_shm_t)) {
+        fprintf(stderr, "%s: not a stats page\n", path);
+        close(fd);
+        return NULL;
+    }
+    stats_shm_t *shm =
+        mmap(NULL, sizeof(stats_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != STATS_SHM_MAGIC ||
+        shm->version != STATS_SHM_VERSION) {
+        fprintf(stderr, "%s: unsupported stats page (magic %x version %u)\n",
+                path, shm->magic, shm->version);
+        munmap(shm, sizeof(stats_shm_t));
+        return NULL;
+    }
+    return shm;
+}
+
+// Seqlock read: copy the whole page and retry if the writer was active
+static void snapshot(const stats_shm_t *shm, stats_shm_t *copy) {
+    uint64_t seq1, seq2;
+
+    do {
+        while ((seq1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1) {
+            usleep(1000);
+        }
+        memcpy(copy, (const void *)shm, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+    } while (seq1 != seq2);
+}
+
+static void print_current(const stats_shm_t *s) {
+    for (int i = 0; i < s->n_counters; i++) {
+        printf("%-*s %lu\n", STATS_SHM_NAME_LEN, s->names[i],
+               s->current.values[i]);
+    }
+}
+
+static void print_history(const stats_shm_t *s, uint64_t n) {
+    if (n > s->history_count) {
+        n = s->history_count;
+    }
+    if (n > s->history_len) {
+        n = s->history_len;
+    }
+    printf("time");
+    for (int i = 0; i < s->n_counters; i++) {
+        printf(",%s", s->names[i]);
+    }
+    printf("\n");
+    for (uint64_t idx = s->history_count - n; idx < s->history_count; idx++) {
+        const stats_shm_sample_t *sample = &s->history[idx % s->history_len];
+
+        printf("%lu", sample->time);
+        for (int i = 0; i < s->n_counters; i++) {
+            printf(",%lu", sample->values[i]);
+        }
+        printf("\n");
+    }
+}
+
+static void watch(const stats_shm_t *shm, stats_shm_t *s) {
+    uint64_t last_count = 0;
+    stats_shm_sample_t last;
+
+    snapshot(shm, s);
+    last = s->current;
+    last_count = s->history_count;
+    while (1) {
+        sleep(1);
+        snapshot(shm, s);
+        if (s->history_count == last_count) {
+            continue;
+        }
+        double secs = (s->current.time - last.time) / 1e9;
+        for (int i = 0; i < s->n_counters; i++) {
+            printf("%s: %.0f%s", s->names[i],
+                   (s->current.values[i] - last.values[i]) / secs,
+                   i + 1 < s->n_counters ? ", " : "\n");
+        }
+        last = s->current;
+        last_count = s->history_count;
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt, watch_mode = 0;
+    long samples = 0;
+
+    while ((opt = getopt(argc, argv, "wn:h")) != -1) {
+        switch (opt) {
+        case 'w':
+            watch_mode = 1;
+            break;
+        case 'n':
+            samples = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w] [-n samples] stats_file\n",
+                    argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-w] [-n samples] stats_file\n", argv[0]);
+        return 1;
+    }
+
+    stats_shm_t *shm = map_stats(argv[optind]);
+    if (shm == NULL) {
+        return 1;
+    }
+    stats_shm_t *s = malloc(sizeof(stats_shm_t));
+
+    if (watch_mode) {
+        watch(shm, s);
+    }
+    snapshot(shm, s);
+    if (samples > 0) {
+        print_history(s, samples);
+    } else {
+        print_current(s);
+    }
+
+    return 0;
+}
@@ -0,0 +1,266 @@
+// Benchmark the sender's decode path against generated message corpora
+//
+// usage: decode_bench [-n messages] [-c corpus] [-t] [-u]
+//
+// Every message goes through decode_message(), the same code socket_snd_th
+// runs (pn_message_decode, the body walk and the send), with the output
+// going to a null sink so only the decoding is measured.  Allocations are
+// counted by wrapping malloc() and friends.  -t transcodes collectd JSON
+// as --transcode does, -u unwraps oslo.messaging envelopes as --oslo_unwrap
+// does.
+//
+// Corpora, each a set of distinct messages replayed in turn:
+//   collectd   small collectd JSON, one binary body per message
+//   ceilometer large ceilometer event JSON as a string body
+//   list       lists of collectd JSON binaries
+//   nested     deeply nested lists around a single binary
+//   malformed  truncated and corrupted AMQP frames
+
+#define _GNU_SOURCE
+#include <proton/message.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bridge.h"
+#include "socket_snd_th.h"
+
+#define CORPUS_MSGS 64
+#define NESTED_DEPTH 32
+#define LIST_ITEMS 16
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static volatile long n_allocs;
+
+void *malloc(size_t size) {
+    n_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    n_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    n_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+typedef struct {
+    pn_rwbytes_t msgs[CORPUS_MSGS];
+    size_t bytes;
+} corpus_t;
+
+static long n_msgs = 1000000;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int collectd_json(char *buf, size_t size, int i) {
+    return snprintf(
+        buf, size,
+        "[{\"values\":[%d.5,%d],\"dstypes\":[\"gauge\",\"derive\"],"
+        "\"dsnames\":[\"rx\",\"tx\"],\"time\":1600000000.%03d,"
+        "\"interval\":10.000,\"host\":\"compute-%d.localdomain\","
+        "\"plugin\":\"interface\",\"plugin_instance\":\"eth%d\","
+        "\"type\":\"if_octets\",\"type_instance\":\"\"}]",
+        i * 7, i * 1000, i, i % 8, i % 4);
+}
+
+static int ceilometer_json(char *buf, size_t size, int i) {
+    int len = snprintf(buf, size,
+                       "{\"request\":{\"oslo.version\":\"2.0\","
+                       "\"oslo.message\":\"{\\\"message_id\\\":"
+                       "\\\"%08x-6f2e-4b4c-8a43-2d1c4e0b%04x\\\","
+                       "\\\"publisher_id\\\":\\\"telemetry.publisher."
+                       "controller-%d\\\",\\\"event_type\\\":\\\"event\\\","
+                       "\\\"priority\\\":\\\"SAMPLE\\\",\\\"payload\\\":[",
+                       i * 2654435761U, i, i % 3);
+
+    // A batch of events, as the notifier sends them
+    for (int e = 0; e < 8 && len < size; e++) {
+        len += snprintf(
+            buf + len, size - len,
+            "%s{\\\"message_id\\\":\\\"%04x-%04x\\\",\\\"event_type\\\":"
+            "\\\"compute.instance.update\\\",\\\"generated\\\":"
+            "\\\"2020-09-13T12:26:40.%06d\\\",\\\"traits\\\":["
+            "[\\\"service\\\",1,\\\"compute\\\"],"
+            "[\\\"project_id\\\",1,\\\"a0b1c2d3e4f5%04x\\\"],"
+            "[\\\"state\\\",1,\\\"active\\\"],"
+            "[\\\"host\\\",1,\\\"compute-%d\\\"]],"
+            "\\\"raw\\\":{},\\\"message_signature\\\":"
+            "\\\"3b1e2f4a5c6d7e8f9a0b1c2d3e4f5a6b7c8d9e0f\\\"}",
+            e ? "," : "", i, e, i * 1000 + e, i, e);
+    }
+    len += snprintf(buf + len, size - len, "]}\"}}");
+
+    return len;
+}
+
+static void encode(corpus_t *corpus, int i, pn_message_t *m) {
+    pn_rwbytes_t *out = &corpus->msgs[i];
+    size_t size = 64 * 1024;
+
+    out->start = malloc(size);
+    if (pn_message_encode(m, out->start, &size) != 0) {
+        fprintf(stderr, "pn_message_encode failed\n");
+        exit(1);
+    }
+    out->size = size;
+    corpus->bytes += size;
+}
+
+static void build_corpus(corpus_t *corpus, const char *name) {
+    pn_message_t *m = pn_message();
+    char buf[8192];
+
+    for (int i = 0; i < CORPUS_MSGS; i++) {
+        pn_message_clear(m);
+        pn_data_t *body = pn_message_body(m);
+
+        if (strcmp(name, "collectd") == 0) {
+            int len = collectd_json(buf, sizeof(buf), i);
+            pn_data_put_binary(body, pn_bytes(len, buf));
+        } else if (strcmp(name, "ceilometer") == 0) {
+            int len = ceilometer_json(buf, sizeof(buf), i);
+            pn_data_put_string(body, pn_bytes(len, buf));
+        } else if (strcmp(name, "list") == 0) {
+            pn_data_put_list(body);
+            pn_data_enter(body);
+            for (int j = 0; j < LIST_ITEMS; j++) {
+                int len = collectd_json(buf, sizeof(buf), i * LIST_ITEMS + j);
+                pn_data_put_binary(body, pn_bytes(len, buf));
+            }
+            pn_data_exit(body);
+        } else if (strcmp(name, "nested") == 0) {
+            for (int d = 0; d < NESTED_DEPTH; d++) {
+                pn_data_put_list(body);
+                pn_data_enter(body);
+            }
+            int len = collectd_json(buf, sizeof(buf), i);
+            pn_data_put_binary(body, pn_bytes(len, buf));
+            for (int d = 0; d < NESTED_DEPTH; d++) {
+                pn_data_exit(body);
+            }
+        } else if (strcmp(name, "malformed") == 0) {
+            int len = collectd_json(buf, sizeof(buf), i);
+            pn_data_put_binary(body, pn_bytes(len, buf));
+            encode(corpus, i, m);
+
+            // Cut the frame short, or flip bytes of the encoding
+            pn_rwbytes_t *msg = &corpus->msgs[i];
+            if (i % 2) {
+                corpus->bytes -= msg->size / 2;
+                msg->size /= 2;
+            } else {
+                for (size_t b = i % 7; b < msg->size; b += 13) {
+                    msg->start[b] ^= 0xa5;
+                }
+            }
+            continue;
+        } else {
+            fprintf(stderr, "Unknown corpus: %s\n", name);
+            exit(1);
+        }
+        encode(corpus, i, m);
+    }
+    pn_message_free(m);
+}
+
+static void bench(const char *name, int transcode, int unwrap) {
+    corpus_t corpus = {0};
+    app_data_t *app = calloc(1, sizeof(app_data_t));
+
+    build_corpus(&corpus, name);
+    app->null_sink = 1;
+    if (transcode) {
+        app->transcode = transcode_alloc();
+    }
+    if (unwrap) {
+        app->oslo = oslo_alloc();
+    }
+
+    // Warm up, the first decode allocates the reused pn_message_t
+    for (int i = 0; i < CORPUS_MSGS; i++) {
+        decode_message(app, corpus.msgs[i]);
+    }
+    app->amqp_decode_errs = 0;
+    app->sock_sent = 0;
+
+    long allocs = n_allocs;
+    double start = now();
+    for (long i = 0; i < n_msgs; i++) {
+        decode_message(app, corpus.msgs[i % CORPUS_MSGS]);
+    }
+    double secs = now() - start;
+    allocs = n_allocs - allocs;
+
+    printf("%-10s %5zuB/msg: %8.1f ns/msg, %6.2f allocs/msg, "
+           "%ld sent, %ld amqp_decode_errs\n",
+           name, corpus.bytes / CORPUS_MSGS, secs * 1e9 / n_msgs,
+           (double)allocs / n_msgs, app->sock_sent, app->amqp_decode_errs);
+
+    for (int i = 0; i < CORPUS_MSGS; i++) {
+        free(corpus.msgs[i].start);
+    }
+    transcode_free(app->transcode);
+    oslo_free(app->oslo);
+    free(app);
+}
+
+int main(int argc, char **argv) {
+    const char *corpora[] = {"collectd", "ceilometer", "list", "nested",
+                             "malformed"};
+    const char *only = NULL;
+    int transcode = 0, unwrap = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:tuh")) != -1) {
+        switch (opt) {
+        case 'n':
+            n_msgs = atol(optarg);
+            break;
+        case 'c':
+            only = optarg;
+            break;
+        case 't':
+            transcode = 1;
+            break;
+        case 'u':
+            unwrap = 1;
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-n messages] [-c corpus] [-t] [-u]\n",
+                    argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    int found = 0;
+    for (int i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+        if (only == NULL || strcmp(only, corpora[i]) == 0) {
+            bench(corpora[i], transcode, unwrap);
+            found++;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "Unknown corpus: %s\n", only);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,254 @@
+// Sink for --seq_header datagrams that accounts for every lost one
+//
+// usage: seq_verify [-i seconds] host:port | /path/to/unix/socket
+//
+// Binds the address the bridge sends to (stop the gateway first) and
+// prints, per stream and every interval, the datagrams received, the gaps
+// in seq split into those the bridge could not send and those lost after
+// it (network or this socket), late and duplicate datagrams, what the
+// bridge dropped before sending, overflows of this socket's buffer and the
+// one-way latency from AMQP receive to here.  Latency needs both clocks in
+// sync.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <endian.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "seq_header.h"
+
+#define MAX_STREAMS 16
+#define LAT_BUCKETS 32 /* log2 of microseconds */
+
+typedef struct {
+    uint32_t id;
+    uint64_t next; // seq expected next
+    long received;
+    long missing; // gaps not yet filled by late datagrams
+    long late;
+    long dups;
+    uint32_t first_unsent, unsent;
+    uint32_t first_ring_drops, ring_drops;
+    long lat[LAT_BUCKETS];
+    uint64_t lat_max;
+} stream_t;
+
+static stream_t streams[MAX_STREAMS];
+static int n_streams;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_sink(const char *addr) {
+    int sock;
+
+    if (addr[0] == '/') {
+        struct sockaddr_un name = {.sun_family = AF_UNIX};
+
+        strncpy(name.sun_path, addr, sizeof(name.sun_path) - 1);
+        unlink(addr);
+        sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (sock < 0 || bind(sock, (struct sockaddr *)&name, sizeof(name))) {
+            perror(addr);
+            return -1;
+        }
+    } else {
+        char *host = strdup(addr);
+        char *port = strrchr(host, ':');
+        struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                                 .ai_socktype = SOCK_DGRAM,
+                                 .ai_flags = AI_PASSIVE};
+        struct addrinfo *res;
+
+        if (port == NULL) {
+            fprintf(stderr, "%s: expected host:port\n", addr);
+            return -1;
+        }
+        *port++ = '\0';
+        int err = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+        if (err) {
+            fprintf(stderr, "%s: %s\n", addr, gai_strerror(err));
+            return -1;
+        }
+        sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (sock < 0 || bind(sock, res->ai_addr, res->ai_addrlen)) {
+            perror(addr);
+            return -1;
+        }
+        freeaddrinfo(res);
+        free(host);
+    }
+    int one = 1, rcvbuf = 16 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    return sock;
+}
+
+static stream_t *find_stream(uint32_t id) {
+    for (int i = 0; i < n_streams; i++) {
+        if (streams[i].id == id) {
+            return &streams[i];
+        }
+    }
+    if (n_streams == MAX_STREAMS) {
+        return NULL;
+    }
+    stream_t *s = &streams[n_streams++];
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+
+    return s;
+}
+
+static void account(const seq_hdr_t *hdr, uint64_t now) {
+    stream_t *s = find_stream(ntohl(hdr->stream));
+    uint64_t seq = be64toh(hdr->seq);
+
+    if (s == NULL) {
+        return;
+    }
+    if (s->received == 0) {
+        // Joined mid stream, what came before is not ours to count
+        s->next = seq;
+        s->first_unsent = ntohl(hdr->unsent);
+        s->first_ring_drops = ntohl(hdr->ring_drops);
+    }
+    s->received++;
+    if (seq >= s->next) {
+        s->missing += seq - s->next;
+        s->next = seq + 1;
+        s->unsent = ntohl(hdr->unsent);
+        s->ring_drops = ntohl(hdr->ring_drops);
+    } else if (s->missing > 0) {
+        // Fills a gap, or is a copy of one that already did; without a
+        // window of seen seqs the two cannot be told apart
+        s->late++;
+        s->missing--;
+    } else {
+        s->dups++;
+    }
+
+    uint64_t enqueued = be64toh(hdr->enqueued_ns);
+    uint64_t us = now > enqueued ? (now - enqueued) / 1000 : 0;
+    int b = 0;
+    while (b < LAT_BUCKETS - 1 && (1ULL << b) <= us) {
+        b++;
+    }
+    s->lat[b]++;
+    s->lat_max = us > s->lat_max ? us : s->lat_max;
+}
+
+// Upper bound of the bucket holding the pct percentile, in microseconds
+static uint64_t percentile(const stream_t *s, double pct) {
+    long total = 0, seen = 0;
+
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        total += s->lat[b];
+    }
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += s->lat[b];
+        if (seen >= total * pct) {
+            return 1ULL << b;
+        }
+    }
+    return 0;
+}
+
+static void report(uint32_t rcvbuf_drops, long foreign) {
+    for (int i = 0; i < n_streams; i++) {
+        stream_t *s = &streams[i];
+        long unsent = (uint32_t)(s->unsent - s->first_unsent);
+
+        printf("stream %08x: received %ld, missing %ld (bridge unsent %ld, "
+               "lost after the bridge %ld), late %ld, dups %ld, "
+               "bridge ring drops %u\n",
+               s->id, s->received, s->missing, unsent,
+               s->missing > unsent ? s->missing - unsent : 0, s->late,
+               s->dups, s->ring_drops - s->first_ring_drops);
+        printf("  latency: p50 < %luus, p99 < %luus, max %luus\n",
+               (unsigned long)percentile(s, 0.5),
+               (unsigned long)percentile(s, 0.99), (unsigned long)s->lat_max);
+    }
+    printf("socket buffer overflows: %u, without header: %ld\n", rcvbuf_drops,
+           foreign);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    int opt, interval = 1;
+
+    while ((opt = getopt(argc, argv, "i:h")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i seconds] host:port|socket_path\n",
+                    argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-i seconds] host:port|socket_path\n",
+                argv[0]);
+        return 1;
+    }
+    int sock = open_sink(argv[optind]);
+    if (sock < 0) {
+        return 1;
+    }
+
+    static char buf[65536];
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    uint32_t rcvbuf_drops = 0;
+    long foreign = 0;
+    time_t next_report = time(NULL) + interval;
+
+    while (1) {
+        struct pollfd pfd = {.fd = sock, .events = POLLIN};
+
+        if (poll(&pfd, 1, 100) > 0) {
+            struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+            struct msghdr msg = {.msg_iov = &iov,
+                                 .msg_iovlen = 1,
+                                 .msg_control = control,
+                                 .msg_controllen = sizeof(control)};
+            ssize_t len = recvmsg(sock, &msg, 0);
+            uint64_t now = now_ns();
+
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+                 cm = CMSG_NXTHDR(&msg, cm)) {
+                if (cm->cmsg_level == SOL_SOCKET &&
+                    cm->cmsg_type == SO_RXQ_OVFL) {
+                    memcpy(&rcvbuf_drops, CMSG_DATA(cm), sizeof(uint32_t));
+                }
+            }
+            const seq_hdr_t *hdr = (const seq_hdr_t *)buf;
+            if (len >= (ssize_t)sizeof(seq_hdr_t) &&
+                ntohs(hdr->magic) == SEQ_MAGIC &&
+                hdr->version == SEQ_VERSION) {
+                account(hdr, now);
+            } else if (len >= 0) {
+                foreign++;
+            }
+        }
+        if (time(NULL) >= next_report) {
+            report(rcvbuf_drops, foreign);
+            next_report += interval;
+        }
+    }
+    return 0;
+}
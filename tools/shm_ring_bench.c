@@ -0,0 +1,139 @@
+// Compare the unix datagram output path with the shared memory ring
+//
+// usage: shm_ring_bench [-n messages] [-s size] [-r ring_bytes]
+//
+// A producer thread pushes messages of the given size to a consumer thread,
+// once through a unix datagram socketpair (sendto/recv, what --gw_unix
+// does) and once through the shared memory ring (what --gw_shm does).  Both
+// sides block when the transport is full, so nothing is dropped.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+static long n_msgs = 2000000;
+static size_t msg_size = 512;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double secs, long doorbells) {
+    printf("%-8s %ld x %zuB: %.3fs, %.0f msg/s, %.1f ns/msg, %ld wakeups\n",
+           name, n_msgs, msg_size, secs, n_msgs / secs, secs * 1e9 / n_msgs,
+           doorbells);
+}
+
+static void *dgram_consumer(void *sock_ptr) {
+    int sock = *(int *)sock_ptr;
+    char *buf = malloc(msg_size);
+    volatile char sink = 0;
+
+    for (long i = 0; i < n_msgs; i++) {
+        if (recv(sock, buf, msg_size, 0) > 0) {
+            sink ^= buf[0];
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void bench_dgram(const char *msg) {
+    int sv[2];
+    pthread_t th;
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    double start = now();
+    pthread_create(&th, NULL, dgram_consumer, &sv[1]);
+    for (long i = 0; i < n_msgs; i++) {
+        if (send(sv[0], msg, msg_size, 0) < 0) {
+            perror("send");
+            exit(1);
+        }
+    }
+    pthread_join(th, NULL);
+    report("dgram", now() - start, 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void *shm_consumer(void *ring_ptr) {
+    shm_ring_t *ring = (shm_ring_t *)ring_ptr;
+    volatile char sink = 0;
+
+    for (long i = 0; i < n_msgs; i++) {
+        uint32_t len;
+        const char *body = shm_ring_peek(ring, &len, 1);
+
+        sink ^= body[0];
+        shm_ring_release(ring, len);
+    }
+    return NULL;
+}
+
+static void bench_shm(const char *msg, size_t ring_bytes) {
+    pthread_t th;
+    shm_ring_t *ring = shm_ring_create(NULL, NULL, ring_bytes);
+
+    if (ring == NULL) {
+        exit(1);
+    }
+    double start = now();
+    pthread_create(&th, NULL, shm_consumer, ring);
+    for (long i = 0; i < n_msgs; i++) {
+        if (shm_ring_write(ring, msg, msg_size, 1) < 0) {
+            perror("shm_ring_write");
+            exit(1);
+        }
+    }
+    pthread_join(th, NULL);
+    report("shm_ring", now() - start, ring->hdr->doorbells);
+
+    shm_ring_destroy(ring);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    size_t ring_bytes = 16 * 1024 * 1024;
+
+    while ((opt = getopt(argc, argv, "n:s:r:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            n_msgs = atol(optarg);
+            break;
+        case 's':
+            msg_size = atol(optarg);
+            break;
+        case 'r':
+            ring_bytes = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n messages] [-s size] [-r bytes]\n",
+                    argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    char *msg = malloc(msg_size);
+    memset(msg, 'x', msg_size);
+
+    bench_dgram(msg);
+    bench_shm(msg, ring_bytes);
+
+    free(msg);
+    return 0;
+}
@@ -0,0 +1,65 @@
+// Reference consumer for the shared memory ring output (--gw_shm)
+//
+// usage: shm_ring_reader [-c] /path/to/socket
+//
+// Attaches to the ring through the bridge's handoff socket and reads the
+// bodies in place.  By default every body is written to stdout followed by
+// a newline, with -c only the number of bodies per second is printed.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm_ring.h"
+
+int main(int argc, char **argv) {
+    int opt, count_only = 0;
+
+    while ((opt = getopt(argc, argv, "ch")) != -1) {
+        switch (opt) {
+        case 'c':
+            count_only = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c] socket_path\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-c] socket_path\n", argv[0]);
+        return 1;
+    }
+
+    shm_ring_t *ring = shm_ring_attach(argv[optind]);
+    if (ring == NULL) {
+        return 1;
+    }
+    fprintf(stderr, "attached to %lu byte ring\n", ring->hdr->size);
+
+    long count = 0;
+    time_t last = time(NULL);
+
+    while (1) {
+        uint32_t len;
+        const char *body = shm_ring_peek(ring, &len, 1);
+
+        if (count_only) {
+            count++;
+            time_t now = time(NULL);
+            if (now != last) {
+                printf("%ld msg/s, producer dropped %lu\n", count,
+                       ring->hdr->dropped);
+                count = 0;
+                last = now;
+            }
+        } else {
+            fwrite(body, 1, len, stdout);
+            fputc('\n', stdout);
+        }
+        shm_ring_release(ring, len);
+    }
+
+    return 0;
+}
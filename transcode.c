@@ -0,0 +1,211 @@
+#include <endian.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "collectd_json.h"
+#include "transcode.h"
+#include "utils.h"
+
+#define TRANSCODE_FULL -2
+
+transcode_t *transcode_alloc(void) {
+    transcode_t *tc = calloc(1, sizeof(transcode_t));
+
+    tc->arena = malloc(TRANSCODE_ARENA_SIZE);
+    tc->reset = true;
+
+    return tc;
+}
+
+void transcode_free(transcode_t *tc) {
+    if (tc == NULL) {
+        return;
+    }
+    free(tc->arena);
+    free(tc->defs.start);
+    free(tc->metrics.start);
+    free(tc);
+}
+
+static void transcode_reset(transcode_t *tc) {
+    memset(tc->slots, 0, sizeof(tc->slots));
+    tc->n_strings = 0;
+    tc->arena_used = 0;
+    tc->epoch++;
+    tc->reset = true;
+    tc->since_reset = 0;
+    tc->resets++;
+}
+
+static void *buf_reserve(transcode_buf_t *b, size_t len) {
+    if (b->len + len > b->size) {
+        b->size = b->size ? b->size * 2 : 4096;
+        while (b->len + len > b->size) {
+            b->size *= 2;
+        }
+        b->start = realloc(b->start, b->size);
+    }
+    void *p = b->start + b->len;
+    b->len += len;
+
+    return p;
+}
+
+static void put_u8(transcode_buf_t *b, uint8_t v) {
+    *(uint8_t *)buf_reserve(b, 1) = v;
+}
+
+static void put_u16(transcode_buf_t *b, uint16_t v) {
+    v = htole16(v);
+    memcpy(buf_reserve(b, sizeof(v)), &v, sizeof(v));
+}
+
+static void put_u32(transcode_buf_t *b, uint32_t v) {
+    v = htole32(v);
+    memcpy(buf_reserve(b, sizeof(v)), &v, sizeof(v));
+}
+
+static void put_u64(transcode_buf_t *b, uint64_t v) {
+    v = htole64(v);
+    memcpy(buf_reserve(b, sizeof(v)), &v, sizeof(v));
+}
+
+// Id of s, defining it in this message if it is new.  Returns
+// TRANSCODE_FULL when the table or the arena has no room left.
+static int intern(transcode_t *tc, const collectd_str_t *s) {
+    if (s->size == 0) {
+        return 0;
+    }
+    if (s->size > UINT16_MAX) {
+        return -1;
+    }
+    uint32_t hash = fnv1a(FNV1A_INIT, s->start, s->size);
+    uint32_t idx = hash & (TRANSCODE_HASH_SIZE - 1);
+
+    // The table is never more than half full, there is always a free slot
+    for (;; idx = (idx + 1) & (TRANSCODE_HASH_SIZE - 1)) {
+        transcode_slot_t *slot = &tc->slots[idx];
+
+        if (slot->id == 0) {
+            break;
+        }
+        if (slot->hash == hash && slot->len == s->size &&
+            memcmp(tc->arena + slot->offset, s->start, s->size) == 0) {
+            return slot->id;
+        }
+    }
+    if (tc->n_strings + 1 >= TRANSCODE_MAX_STRINGS ||
+        tc->arena_used + s->size > TRANSCODE_ARENA_SIZE) {
+        return TRANSCODE_FULL;
+    }
+    transcode_slot_t *slot = &tc->slots[idx];
+    slot->hash = hash;
+    slot->id = ++tc->n_strings;
+    slot->len = s->size;
+    slot->offset = tc->arena_used;
+    memcpy(tc->arena + tc->arena_used, s->start, s->size);
+    tc->arena_used += s->size;
+
+    put_u16(&tc->defs, slot->id);
+    put_u16(&tc->defs, s->size);
+    memcpy(buf_reserve(&tc->defs, s->size), s->start, s->size);
+    tc->n_defs++;
+
+    return slot->id;
+}
+
+static int encode_metric(collectd_metric_t *m, void *ctx) {
+    transcode_t *tc = (transcode_t *)ctx;
+    const collectd_str_t *names[] = {&m->host, &m->plugin, &m->plugin_instance,
+                                     &m->type, &m->type_instance};
+    int ids[5];
+
+    for (int i = 0; i < 5; i++) {
+        if ((ids[i] = intern(tc, names[i])) < 0) {
+            return ids[i];
+        }
+    }
+    put_u64(&tc->metrics, isnan(m->time) ? 0 : m->time * 1e9);
+    put_u32(&tc->metrics, isnan(m->interval) ? 0 : m->interval * 1e3);
+    for (int i = 0; i < 5; i++) {
+        put_u16(&tc->metrics, ids[i]);
+    }
+    put_u16(&tc->metrics, m->n_values);
+    for (int i = 0; i < m->n_values; i++) {
+        collectd_value_t *v = &m->values[i];
+        int id = intern(tc, &v->dsname);
+        uint64_t bits;
+
+        if (id < 0) {
+            return id;
+        }
+        put_u8(&tc->metrics, v->dstype);
+        put_u16(&tc->metrics, id);
+        if (v->dstype == COLLECTD_GAUGE) {
+            memcpy(&bits, &v->gauge, sizeof(bits));
+        } else {
+            bits = v->counter; // same bits for derive
+        }
+        put_u64(&tc->metrics, bits);
+    }
+    tc->n_metrics++;
+
+    return 0;
+}
+
+static int encode(transcode_t *tc, const char *json, size_t len) {
+    tc->defs.len = 0;
+    tc->metrics.len = 0;
+    tc->n_defs = 0;
+    tc->n_metrics = 0;
+    buf_reserve(&tc->defs, sizeof(transcode_hdr_t)); // filled in at the end
+
+    return collectd_json_parse(json, len, encode_metric, tc);
+}
+
+// The last message was not delivered, neither were its definitions
+void transcode_lost(transcode_t *tc) {
+    if (tc->n_defs) {
+        transcode_reset(tc);
+    }
+}
+
+int transcode(transcode_t *tc, const char *json, size_t len,
+              struct iovec *iov) {
+    if (tc->since_reset == TRANSCODE_RESET_MSGS) {
+        transcode_reset(tc);
+    }
+    int err = encode(tc, json, len);
+    if (err == TRANSCODE_FULL) {
+        // Start over with an empty table
+        transcode_reset(tc);
+        err = encode(tc, json, len);
+    }
+    if (err < 0) {
+        // Strings defined by this message were never sent
+        if (tc->n_defs) {
+            transcode_reset(tc);
+        }
+        tc->errs++;
+        return -1;
+    }
+
+    transcode_hdr_t hdr = {.magic = htole16(TRANSCODE_MAGIC),
+                           .version = TRANSCODE_VERSION,
+                           .flags = tc->reset ? TRANSCODE_F_RESET : 0,
+                           .epoch = htole16(tc->epoch),
+                           .n_strings = htole16(tc->n_defs),
+                           .n_metrics = htole32(tc->n_metrics)};
+    memcpy(tc->defs.start, &hdr, sizeof(hdr));
+    tc->reset = false;
+    tc->since_reset++;
+    tc->msgs++;
+
+    iov[0].iov_base = tc->defs.start;
+    iov[0].iov_len = tc->defs.len;
+    iov[1].iov_base = tc->metrics.start;
+    iov[1].iov_len = tc->metrics.len;
+
+    return 0;
+}
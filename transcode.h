@@ -0,0 +1,103 @@
+#ifndef _TRANSCODE_H
+#define _TRANSCODE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define TRANSCODE_MAGIC 0x4d53 /* "SM" */
+#define TRANSCODE_VERSION 1
+
+#define TRANSCODE_F_RESET 0x01 /* forget all strings before reading this */
+
+#define TRANSCODE_MAX_STRINGS 4096 /* ids 1..4095, 0 is the empty string */
+#define TRANSCODE_HASH_SIZE 8192
+#define TRANSCODE_ARENA_SIZE (256 * 1024)
+#define TRANSCODE_RESET_MSGS 65536 /* resend all strings this often */
+
+// Binary metric records, the --transcode replacement for collectd JSON.
+// One message per collectd message, all integers little endian, no padding:
+//
+//   transcode_hdr_t
+//   n_strings string definitions:
+//     uint16 id, uint16 len, len bytes
+//   n_metrics metrics:
+//     uint64 time      ns since the epoch
+//     uint32 interval  ms
+//     uint16 host, plugin, plugin_instance, type, type_instance  string ids
+//     uint16 n_values
+//     n_values values:
+//       uint8 dstype   enum collectd_dstype
+//       uint16 dsname  string id
+//       8 bytes        double for gauge, int64 for derive, uint64 otherwise
+//
+// Strings are interned: a string is defined once, in the first message
+// that uses it, and later messages only carry its id.  The bridge forgets
+// all strings, and starts the next message with TRANSCODE_F_RESET and a new
+// epoch, when the table is full, when a message that defined strings could
+// not be sent and every TRANSCODE_RESET_MSGS messages.  A consumer forgets
+// its strings on TRANSCODE_F_RESET or when the epoch changes.  One that sees
+// an id it does not know (it joined late or a datagram was lost) drops
+// messages until the next reset.
+//
+// Messages that are not collectd JSON are forwarded unchanged, they never
+// start with the magic.
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t flags;
+    uint16_t epoch;
+    uint16_t n_strings;
+    uint32_t n_metrics;
+} transcode_hdr_t;
+
+typedef struct {
+    uint32_t hash;
+    uint16_t id; // 0 for a free slot
+    uint16_t len;
+    uint32_t offset; // into arena
+} transcode_slot_t;
+
+typedef struct {
+    char *start;
+    size_t len;
+    size_t size;
+} transcode_buf_t;
+
+// Encoder state, owned by the sender thread
+typedef struct {
+    transcode_slot_t slots[TRANSCODE_HASH_SIZE];
+    int n_strings;
+    char *arena;
+    size_t arena_used;
+
+    uint16_t epoch;
+    bool reset; // flag the next message
+    long since_reset;
+
+    // Output of the last transcode(): header and definitions, then metrics
+    transcode_buf_t defs;
+    transcode_buf_t metrics;
+    int n_defs;
+    int n_metrics;
+
+    // stats
+    long msgs;
+    long errs;
+    long resets;
+} transcode_t;
+
+extern transcode_t *transcode_alloc(void);
+
+extern void transcode_free(transcode_t *tc);
+
+// Encode one collectd JSON message into iov[0..1], valid until the next
+// call.  Returns -1 if the message is not collectd JSON.
+extern int transcode(transcode_t *tc, const char *json, size_t len,
+                     struct iovec *iov);
+
+// Call it when the message from the last transcode() could not be sent
+extern void transcode_lost(transcode_t *tc);
+
+#endif
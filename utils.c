@@ -1,5 +1,6 @@
 #include "utils.h"
 #include <stdio.h>
+#include <string.h>
 
 void time_diff(struct timespec t1, struct timespec t2, struct timespec *diff) {
     if (t2.tv_nsec < t1.tv_nsec) {
@@ -19,12 +20,51 @@ void time_diff(struct timespec t1, struct timespec t2, struct timespec *diff) {
         diff->tv_sec += t2.tv_sec - t1.tv_sec;
         diff->tv_nsec += t2.tv_nsec - t1.tv_nsec;
     }
+    /* diff accumulates, keep tv_nsec within a second */
+    if (diff->tv_nsec >= 1000000000) {
+        diff->tv_sec += diff->tv_nsec / 1000000000;
+        diff->tv_nsec %= 1000000000;
+    }
 }
 
 char *time_snprintf(char *buf, size_t n, struct timespec t1) {
-    double pct = (t1.tv_sec * 1000000000.0) + t1.tv_nsec / 1000000000.0;
+    double secs = t1.tv_sec + t1.tv_nsec / 1000000000.0;
 
-    snprintf(buf, n, "%f", pct);
+    snprintf(buf, n, "%f", secs);
 
     return buf;
 }
+
+// Mix the bits of a 64 bit word, the murmur3 finalizer
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+// 64 bit hash of a message, 8 bytes per step
+uint64_t hash64(const char *s, size_t len) {
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+    uint64_t w;
+
+    for (; len >= 8; s += 8, len -= 8) {
+        memcpy(&w, s, 8);
+        h = (h ^ mix64(w)) * 0x9e3779b97f4a7c15ULL;
+    }
+    w = 0;
+    memcpy(&w, s, len);
+
+    return mix64(h ^ w);
+}
+
+// Continue a FNV-1a hash, start with FNV1A_INIT
+uint32_t fnv1a(uint32_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return h;
+}
@@ -1,9 +1,15 @@
 #ifndef _UTILS_H
 #define _UTILS_H 1
 
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
+#define FNV1A_INIT 2166136261u
+
 void time_diff(struct timespec t1, struct timespec t2, struct timespec *diff);
 char *time_snprintf(char *buf, size_t n, struct timespec t1);
+uint32_t fnv1a(uint32_t h, const char *s, size_t len);
+uint64_t hash64(const char *s, size_t len);
 
 #endif